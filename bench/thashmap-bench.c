@@ -75,6 +75,19 @@ struct s_khash {
 
 THM_DEFINE(s_thm, s_thm, entry, key);
 
+/* String keys, shared by hashed head and khash string map */
+struct s_str {
+	struct thm_entry entry;
+	uint32_t	hash;
+	char		key[24];
+};
+
+#define	s_str_hash(key)		thm_hash_bytes((key), strlen((key)))
+#define	s_str_eq(elm, k)	(strcmp((elm)->key, (k)) == 0)
+
+THM_DEFINE_HASH(s_str, s_str, entry, hash, const char *, s_str_hash,
+    s_str_eq);
+
 static __inline int
 s_rbtree_cmp(struct s_rb *a, struct s_rb *b)
 {
@@ -97,6 +110,7 @@ LLRB_GENERATE_STATIC(s_llrbtree, s_llrb, entry, s_llrbtree_cmp);
 LIST_HEAD(s_hashtbl_head, s_hashtbl);
 
 KHASH_MAP_INIT_INT(kh32, struct s_khash *);
+KHASH_MAP_INIT_STR(khstr, struct s_str *);
 
 static void
 benchmark_result(const char *name, intmax_t n,
@@ -187,8 +201,38 @@ benchmark_result(const char *name, intmax_t n,
 		remove_subr;						\
 	}
 
+/* String keys are set up before, misses look up keys of another set */
+#define TEST_STR(insert_subr, insert_check, find_subr, remove_subr)	\
+	for (i = 0; i < n; i++) {					\
+		elm = &elm_list[i];					\
+		insert_subr;						\
+		if (!(insert_check)) {					\
+			printf("insert failed: %d/%d\n", i, n);		\
+			abort();					\
+		}							\
+	}								\
+	for (j = 0; j < 2; j++) {					\
+		for (i = j; i < n; i += 2) {				\
+			key = elm_list[i].key;				\
+			r = find_subr;					\
+			if (r != &elm_list[i])				\
+				abort();				\
+		}							\
+		for (i = j; i < n; i += 4) {				\
+			key = miss_list[i].key;				\
+			r = find_subr;					\
+			if (r != NULL)					\
+				abort();				\
+		}							\
+	}								\
+	for (i = 0; i < n; i++) {					\
+		elm = &elm_list[i];					\
+		key = elm->key;						\
+		remove_subr;						\
+	}
+
 static void
-test_thm(int *keys, const int n)
+test_thm(int *keys, const int n, const char *name, u_int flags)
 {
 	struct timeval tstart, tend;
 	struct thm_pool pool;
@@ -197,7 +241,11 @@ test_thm(int *keys, const int n)
 
 	thm_pool_init(&pool, "thashmap-bench");
 
-	THM_HEAD_INIT(s_thm, &head, &pool);
+	if (THM_HEAD_INIT_FLAGS(s_thm, &head, &pool, flags) != 0) {
+		printf("%16s: unsupported\n", name);
+		thm_pool_destroy(&pool);
+		return;
+	}
 
 	struct s_thm *elm, *elm_list;
 	struct s_thm *r;
@@ -212,7 +260,8 @@ test_thm(int *keys, const int n)
 
 	gettimeofday(&tstart, NULL);
 
-	TEST(bucket = THM_INSERT(s_thm, &head, elm), bucket != NULL,
+	TEST(while ((bucket = THM_INSERT(s_thm, &head, elm)) == NULL)
+		thm_pool_new_block(&pool), bucket != NULL,
 	    key, THM_BUCKET_FIRST(s_thm, THM_FIND(s_thm, &head, key, NULL)),
 	    THM_REMOVE(s_thm, &head, elm));
 
@@ -223,7 +272,811 @@ test_thm(int *keys, const int n)
 
 	free(elm_list);
 
-	benchmark_result("thashmap", n, &tstart, &tend);
+	benchmark_result(name, n, &tstart, &tend);
+}
+
+/* Value mode head, leaves point to elements, finds don't touch them */
+static void
+test_thm_value(int *keys, const int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head head;
+
+	thm_pool_init(&pool, "thashmap-bench");
+
+	thm_head_init_flags(&head, &pool, 0, THM_HEAD_KEY30 | THM_HEAD_VALUE);
+
+	struct s_thm *elm, *elm_list;
+	struct s_thm *r;
+	uint32_t key;
+	int i;
+
+	elm_list = malloc(sizeof(*elm) * n);
+
+	for (i = 0; i < n; i+= 230)
+		thm_pool_new_block(&pool);
+	thm_pool_new_block(&pool);
+
+	gettimeofday(&tstart, NULL);
+
+	TEST(while (thm_vinsert(&head, elm->key,
+	    thm_value_from_ptr(elm)) != 0)
+		thm_pool_new_block(&pool), 1,
+	    key, thm_value_to_ptr(thm_vfind(&head, key, NULL)),
+	    thm_vremove(&head, elm->key));
+
+	gettimeofday(&tend, NULL);
+
+	thm_head_destroy(&head);
+	thm_pool_destroy(&pool);
+
+	free(elm_list);
+
+	benchmark_result("thashmap/value", n, &tstart, &tend);
+}
+
+/* Route table like prefix lengths, most of them /16 to /24 */
+static u_int
+lpm_plen(int i)
+{
+	static const u_int plens[] = { 8, 12, 16, 18, 20, 22, 24, 24, 24, 32 };
+
+	return (plens[i % (sizeof(plens) / sizeof(plens[0]))]);
+}
+
+static uint64_t
+lpm_marker(uint32_t addr, u_int plen)
+{
+	return (((uint64_t)1 << plen) | ((uint64_t)addr >> (32 - plen)));
+}
+
+/*
+ * Longest prefix match of addresses near the prefixes, LPM head against a
+ * value head probed once per prefix length.
+ */
+static void
+test_thm_lpm(int *keys, const int n, int probe)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head head;
+	uintptr_t value;
+	uint32_t addr;
+	u_int plen;
+	int i, j, found;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	if (probe)
+		thm_head_init_flags(&head, &pool, 0,
+		    THM_HEAD_KEY64 | THM_HEAD_VALUE);
+	else
+		thm_head_init_flags(&head, &pool, 0, THM_HEAD_LPM);
+
+	for (i = 0; i < n; i++) {
+		addr = (uint32_t)keys[i] << 2;
+		value = thm_value_from_int(i);
+		if (probe) {
+			while (thm_vinsert(&head,
+			    lpm_marker(addr, lpm_plen(i)), value) != 0)
+				thm_pool_new_block(&pool);
+		} else {
+			while (thm_lpm_insert(&head, addr, lpm_plen(i),
+			    value) != 0)
+				thm_pool_new_block(&pool);
+		}
+	}
+
+	found = 0;
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		addr = ((uint32_t)keys[i] << 2) ^ (uint32_t)keys[(i + 1) % n];
+		if (!probe) {
+			found += thm_lpm(&head, addr, &plen) != 0;
+			continue;
+		}
+		for (j = 32; j >= 0; j--) {
+			if (thm_vfind(&head, lpm_marker(addr, j), NULL) != 0) {
+				found++;
+				break;
+			}
+		}
+	}
+	gettimeofday(&tend, NULL);
+
+	thm_head_destroy(&head);
+	thm_pool_destroy(&pool);
+
+	if (found == 0)
+		abort();
+	benchmark_result(probe ? "lpm/probe" : "lpm", n, &tstart, &tend);
+}
+
+/* Insert cost of leaf counts, rank and select on the counting head */
+static void
+test_thm_rank(int *keys, int n, int count)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head head;
+	u_long sum;
+	int i;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_head_init_flags(&head, &pool, 0, THM_HEAD_VALUE | THM_HEAD_WIDE |
+	    (count ? THM_HEAD_COUNT : 0));
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		while (thm_vinsert(&head, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result(count ? "rank/insert-count" : "rank/insert", n,
+	    &tstart, &tend);
+
+	if (count) {
+		sum = 0;
+		gettimeofday(&tstart, NULL);
+		for (i = 0; i < n; i++)
+			sum += thm_rank(&head, (uint32_t)keys[(i + 1) % n]);
+		gettimeofday(&tend, NULL);
+		benchmark_result("rank", n, &tstart, &tend);
+
+		gettimeofday(&tstart, NULL);
+		for (i = 0; i < n; i++)
+			sum += thm_vselect(&head, (u_int)keys[i] %
+			    thm_count(&head), NULL) != 0;
+		gettimeofday(&tend, NULL);
+		benchmark_result("select", n, &tstart, &tend);
+		if (sum == 0)
+			abort();
+	}
+
+	thm_head_destroy(&head);
+	thm_pool_destroy(&pool);
+}
+
+static uint64_t
+aggr_value(struct thm_bucket *bucket)
+{
+	return (thm_value_to_int((uintptr_t)bucket));
+}
+
+static uint64_t
+aggr_sum(uint64_t a, uint64_t b)
+{
+	return (a + b);
+}
+
+static const struct thm_aggr aggr_sum_ops = { 0, aggr_value, aggr_sum };
+
+/* Range sums over 1/256 of the key space, aggregate head against a walk */
+static void
+test_thm_aggr(int *keys, int n, int aggr)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head head;
+	struct thm_cursor cr;
+	uintptr_t value;
+	uint64_t lo, hi, sum;
+	int i, nq;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_head_init_aggr(&head, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, &aggr_sum_ops);
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		while (thm_vinsert(&head, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+	gettimeofday(&tend, NULL);
+	if (aggr)
+		benchmark_result("aggr/insert", n, &tstart, &tend);
+
+	nq = n < 1000 ? n : 1000;
+	sum = 0;
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < nq; i++) {
+		lo = (uint32_t)keys[i];
+		hi = lo + (UINT32_MAX >> 8);
+		if (aggr) {
+			sum += thm_aggregate(&head, lo, hi);
+			continue;
+		}
+		for (value = thm_vnfind(&head, lo, &cr);
+		    value != 0 && thm_vkey(&cr) <= hi;
+		    value = thm_vnext(&cr))
+			sum += thm_value_to_int(value);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result(aggr ? "aggr" : "aggr/walk", nq, &tstart, &tend);
+	if (sum == 0)
+		abort();
+
+	thm_head_destroy(&head);
+	thm_pool_destroy(&pool);
+}
+
+static void
+digest_range_cb(void *arg, uint64_t lo __unused, uint64_t hi __unused)
+{
+	(*(u_long *)arg)++;
+}
+
+/*
+ * Compare two heads differing in a few keys, digests first taken for all
+ * entries and then for the entries changed only, against a lockstep walk.
+ */
+static void
+test_thm_digest(int *keys, int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head a, b;
+	struct thm_cursor cra, crb;
+	uintptr_t va, vb;
+	u_long ndiff;
+	int i;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_head_init_digest(&a, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	thm_head_init_digest(&b, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	for (i = 0; i < n; i++) {
+		while (thm_vinsert(&a, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&b, (uint32_t)keys[n - 1 - i],
+		    thm_value_from_int(n - 1 - i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+
+	ndiff = 0;
+	gettimeofday(&tstart, NULL);
+	thm_digest_cmp(&a, &b, digest_range_cb, &ndiff);
+	gettimeofday(&tend, NULL);
+	benchmark_result("digest/all", 1, &tstart, &tend);
+
+	for (i = 0; i < 10; i++)
+		thm_vinsert(&b, (uint32_t)keys[i * (n / 10)],
+		    thm_value_from_int(n + i));
+
+	gettimeofday(&tstart, NULL);
+	thm_digest_cmp(&a, &b, digest_range_cb, &ndiff);
+	gettimeofday(&tend, NULL);
+	benchmark_result("digest/changed", 1, &tstart, &tend);
+
+	gettimeofday(&tstart, NULL);
+	va = thm_vfirst(&a, &cra);
+	vb = thm_vfirst(&b, &crb);
+	while (va != 0 && vb != 0) {
+		if (thm_vkey(&cra) != thm_vkey(&crb) || va != vb)
+			ndiff++;
+		va = thm_vnext(&cra);
+		vb = thm_vnext(&crb);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("digest/walk", 1, &tstart, &tend);
+	if (ndiff == 0)
+		abort();
+
+	thm_head_destroy(&a);
+	thm_head_destroy(&b);
+	thm_pool_destroy(&pool);
+}
+
+static void
+diff_cb(void *arg, uint64_t key __unused, struct thm_bucket *a __unused,
+    struct thm_bucket *b __unused)
+{
+	(*(u_long *)arg)++;
+}
+
+/*
+ * Keys changed between two heads, lockstep diff of plain and digest heads
+ * against merging two cursors.
+ */
+static void
+test_thm_diff(int *keys, int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	struct thm_head a, b, da, db;
+	struct thm_cursor cra, crb;
+	uintptr_t va, vb;
+	uint64_t ka, kb;
+	u_long ndiff;
+	int i;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_head_init_flags(&a, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE);
+	thm_head_init_flags(&b, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE);
+	thm_head_init_digest(&da, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	thm_head_init_digest(&db, &pool, 0, THM_HEAD_KEY32 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	for (i = 0; i < n; i++) {
+		while (thm_vinsert(&a, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&da, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+		if (i % (n / 10 + 1) == 1)
+			continue;
+		while (thm_vinsert(&b, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&db, (uint32_t)keys[i],
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+	thm_digest(&da);
+	thm_digest(&db);
+
+	ndiff = 0;
+	gettimeofday(&tstart, NULL);
+	thm_diff(&a, &b, NULL, diff_cb, &ndiff);
+	gettimeofday(&tend, NULL);
+	benchmark_result("diff/lockstep", 1, &tstart, &tend);
+
+	gettimeofday(&tstart, NULL);
+	thm_diff(&da, &db, NULL, diff_cb, &ndiff);
+	gettimeofday(&tend, NULL);
+	benchmark_result("diff/digest", 1, &tstart, &tend);
+
+	gettimeofday(&tstart, NULL);
+	va = thm_vfirst(&a, &cra);
+	vb = thm_vfirst(&b, &crb);
+	while (va != 0 || vb != 0) {
+		ka = va != 0 ? thm_vkey(&cra) : UINT64_MAX;
+		kb = vb != 0 ? thm_vkey(&crb) : UINT64_MAX;
+		if (ka != kb || va != vb)
+			ndiff++;
+		if (ka <= kb)
+			va = thm_vnext(&cra);
+		if (kb <= ka)
+			vb = thm_vnext(&crb);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("diff/cursors", 1, &tstart, &tend);
+	if (ndiff == 0)
+		abort();
+
+	thm_head_destroy(&a);
+	thm_head_destroy(&b);
+	thm_head_destroy(&da);
+	thm_head_destroy(&db);
+	thm_pool_destroy(&pool);
+}
+
+static void
+setop_cb(void *arg, uint64_t key __unused, struct thm_bucket *a __unused,
+    struct thm_bucket *b __unused)
+{
+	(*(u_long *)arg)++;
+}
+
+/*
+ * Intersect a long and a short posting list stored as set heads with ids
+ * up to range, structural intersection against merging two cursors.
+ */
+static void
+test_thm_setop(int *keys, int n, const char *name, int range)
+{
+	struct timeval tstart, tend;
+	struct thm_cursor cra, crb;
+	struct thm_pool pool;
+	struct thm_head a, b;
+	uint64_t ka, kb;
+	u_long count, mcount;
+	char buf[32];
+	int i, ia, ib;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_head_init_flags(&a, &pool, 0, THM_HEAD_KEY30 | THM_HEAD_SET);
+	thm_head_init_flags(&b, &pool, 0, THM_HEAD_KEY30 | THM_HEAD_SET);
+	for (i = 0; i < n; i++) {
+		while (thm_set_add(&a, keys[i] % range) != 0)
+			thm_pool_new_block(&pool);
+		if (i % 16 != 0)
+			continue;
+		while (thm_set_add(&b, keys[n - 1 - i] % range) != 0)
+			thm_pool_new_block(&pool);
+	}
+
+	count = 0;
+	gettimeofday(&tstart, NULL);
+	thm_intersect(&a, &b, setop_cb, &count);
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/intersect", name);
+	benchmark_result(buf, 1, &tstart, &tend);
+
+	mcount = 0;
+	gettimeofday(&tstart, NULL);
+	ia = thm_set_first(&a, &cra, &ka);
+	ib = thm_set_first(&b, &crb, &kb);
+	while (ia != 0 && ib != 0) {
+		if (ka == kb)
+			mcount++;
+		if (ka <= kb)
+			ia = thm_set_next(&cra, &ka);
+		else
+			ib = thm_set_next(&crb, &kb);
+	}
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/cursors", name);
+	benchmark_result(buf, 1, &tstart, &tend);
+	if (count != mcount)
+		abort();
+
+	count = 0;
+	gettimeofday(&tstart, NULL);
+	thm_difference(&b, &a, setop_cb, &count);
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/difference", name);
+	benchmark_result(buf, 1, &tstart, &tend);
+
+	thm_head_destroy(&a);
+	thm_head_destroy(&b);
+	thm_pool_destroy(&pool);
+}
+
+static u_long
+thm_pool_used_kb(struct thm_pool *pool)
+{
+	struct thm_pool_stats ps;
+
+	thm_pool_get_stats(pool, &ps);
+
+	return ((ps.tp_slots - ps.tp_slots_free) * 4 * sizeof(uintptr_t) /
+	    1024);
+}
+
+/* Many heads holding zero to three keys each */
+static void
+test_thm_small(int *keys, const int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	THM_HEAD(s_thm) *heads;
+
+	struct s_thm *elm, *elm_list;
+	int i, nheads;
+
+	thm_pool_init(&pool, "thashmap-bench");
+
+	nheads = n / 2;
+	heads = malloc(sizeof(*heads) * nheads);
+	elm_list = malloc(sizeof(*elm) * n);
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < nheads; i++)
+		THM_HEAD_INIT(s_thm, &heads[i], &pool);
+	for (i = 0; i < n; i++) {
+		elm = &elm_list[i];
+		elm->key = keys[i];
+		while (THM_INSERT(s_thm, &heads[(i / 4) * 2 + (i % 4 == 3)],
+		    elm) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("small/insert", n, &tstart, &tend);
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		if (THM_FIND(s_thm, &heads[(i / 4) * 2 + (i % 4 == 3)],
+		    keys[i], NULL) == NULL)
+			abort();
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("small/find", n, &tstart, &tend);
+
+	printf("%16s: %d heads of %zu bytes, %lu KB\n", "small", nheads,
+	    sizeof(*heads), thm_pool_used_kb(&pool));
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s_thm, &heads[(i / 4) * 2 + (i % 4 == 3)],
+		    &elm_list[i]);
+	gettimeofday(&tend, NULL);
+	benchmark_result("small/remove", n, &tstart, &tend);
+
+	for (i = 0; i < nheads; i++)
+		THM_HEAD_DESTROY(s_thm, &heads[i]);
+	thm_pool_destroy(&pool);
+
+	free(heads);
+	free(elm_list);
+}
+
+/* Set head against entry head holding the same keys */
+static void
+test_thm_set(int *keys, const int n, const char *name, int range)
+{
+	struct timeval tstart, tend;
+	struct thm_cursor cursor;
+	struct thm_pool pool, epool;
+	struct thm_head head;
+	THM_HEAD(s_thm) ehead;
+	THM_BUCKET(s_thm) *bucket;
+
+	struct s_thm *elm, *elm_list;
+	uint64_t key, sum;
+	u_long used, eused;
+	char buf[32];
+	int i, m;
+
+	thm_pool_init(&pool, "thashmap-bench");
+	thm_pool_init(&epool, "thashmap-bench");
+
+	thm_head_init_flags(&head, &pool, 0, THM_HEAD_KEY30 | THM_HEAD_SET);
+	THM_HEAD_INIT(s_thm, &ehead, &epool);
+
+	elm_list = malloc(sizeof(*elm) * n);
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		while (thm_set_add(&head, keys[i] % range) != 0)
+			thm_pool_new_block(&pool);
+	}
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/add", name);
+	benchmark_result(buf, n, &tstart, &tend);
+
+	for (i = 0, m = 0; i < n; i++) {
+		elm = &elm_list[m];
+		elm->key = keys[i] % range;
+		if (THM_FIND(s_thm, &ehead, elm->key, NULL) != NULL)
+			continue;
+		while (THM_INSERT(s_thm, &ehead, elm) == NULL)
+			thm_pool_new_block(&epool);
+		m++;
+	}
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		if (!thm_set_member(&head, keys[i] % range))
+			abort();
+	}
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/member", name);
+	benchmark_result(buf, n, &tstart, &tend);
+
+	sum = 0;
+	gettimeofday(&tstart, NULL);
+	for (i = thm_set_first(&head, &cursor, &key); i != 0;
+	    i = thm_set_next(&cursor, &key))
+		sum += key;
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/scan", name);
+	benchmark_result(buf, m, &tstart, &tend);
+
+	gettimeofday(&tstart, NULL);
+	for (bucket = THM_FIRST(s_thm, &ehead, &cursor); bucket != NULL;
+	    bucket = THM_NEXT(s_thm, &cursor))
+		sum -= THM_BUCKET_FIRST(s_thm, bucket)->key;
+	gettimeofday(&tend, NULL);
+	benchmark_result("thashmap/scan", m, &tstart, &tend);
+	if (sum != 0)
+		abort();
+
+	used = thm_pool_used_kb(&pool);
+	eused = thm_pool_used_kb(&epool) + m * sizeof(*elm) / 1024;
+	printf("%16s: %d keys, %lu KB set, %lu KB entries\n", name, m,
+	    used, eused);
+
+	for (i = 0; i < m; i++)
+		THM_REMOVE(s_thm, &ehead, &elm_list[i]);
+	for (i = 0; i < n; i++)
+		thm_set_remove(&head, keys[i] % range);
+
+	thm_head_destroy(&head);
+	THM_HEAD_DESTROY(s_thm, &ehead);
+	thm_pool_destroy(&pool);
+	thm_pool_destroy(&epool);
+
+	free(elm_list);
+}
+
+/*
+ * Lookups of present keys and of key + 1, mostly misses. Keys are taken
+ * in sorted order from a separate array, so entry loads aren't sequential
+ * and the miss loop touches entries only through the map.
+ */
+static void
+test_thm_miss(int *keys, const int n, const char *name, u_int flags)
+{
+	struct timeval tstart, tend;
+	struct thm_cursor cursor;
+	struct thm_pool pool;
+	THM_HEAD(s_thm) head;
+	THM_BUCKET(s_thm) *bucket;
+
+	struct s_thm *elm, *elm_list, **order;
+	uint32_t *okeys;
+	char buf[32];
+	int i, j, hits;
+
+	thm_pool_init(&pool, "thashmap-bench");
+
+	THM_HEAD_INIT_FLAGS(s_thm, &head, &pool, flags);
+
+	elm_list = malloc(sizeof(*elm) * n);
+
+	for (i = 0; i < n; i++) {
+		elm = &elm_list[i];
+		elm->key = keys[i];
+		while (THM_INSERT(s_thm, &head, elm) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	order = malloc(sizeof(*order) * n);
+	okeys = malloc(sizeof(*okeys) * n);
+	i = 0;
+	for (bucket = THM_FIRST(s_thm, &head, &cursor); bucket != NULL;
+	    bucket = THM_NEXT(s_thm, &cursor)) {
+		order[i] = THM_BUCKET_FIRST(s_thm, bucket);
+		okeys[i] = order[i]->key;
+		i++;
+	}
+	assert(i == n);
+
+	gettimeofday(&tstart, NULL);
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < n; i++) {
+			elm = order[i];
+			bucket = THM_FIND(s_thm, &head, okeys[i], NULL);
+			if (THM_BUCKET_FIRST(s_thm, bucket) != elm)
+				abort();
+		}
+	}
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/hit", name);
+	benchmark_result(buf, 4 * n, &tstart, &tend);
+
+	hits = 0;
+	gettimeofday(&tstart, NULL);
+	for (j = 0; j < 4; j++) {
+		for (i = 0; i < n; i++) {
+			if (THM_FIND(s_thm, &head, okeys[i] + 1, NULL) != NULL)
+				hits++;
+		}
+	}
+	gettimeofday(&tend, NULL);
+	snprintf(buf, sizeof(buf), "%s/miss", name);
+	benchmark_result(buf, 4 * n - hits, &tstart, &tend);
+
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s_thm, &head, &elm_list[i]);
+
+	THM_HEAD_DESTROY(s_thm, &head);
+	thm_pool_destroy(&pool);
+
+	free(okeys);
+	free(order);
+	free(elm_list);
+}
+
+/* Iterate forward and backward over the whole head */
+static void
+test_thm_scan(int *keys, const int n, const char *name, u_int flags)
+{
+	struct timeval tstart, tend;
+	struct thm_cursor cursor;
+	struct thm_pool pool;
+	THM_HEAD(s_thm) head;
+	THM_BUCKET(s_thm) *bucket;
+
+	struct s_thm *elm, *elm_list;
+	uint64_t sum;
+	int i, j, rounds;
+
+	thm_pool_init(&pool, "thashmap-bench");
+
+	THM_HEAD_INIT_FLAGS(s_thm, &head, &pool, flags);
+
+	elm_list = malloc(sizeof(*elm) * n);
+
+	for (i = 0; i < n; i++) {
+		elm = &elm_list[i];
+		elm->key = keys[i];
+		while (THM_INSERT(s_thm, &head, elm) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	rounds = 1 + 4000000 / n;
+	sum = 0;
+	gettimeofday(&tstart, NULL);
+	for (j = 0; j < rounds; j++) {
+		for (bucket = THM_FIRST(s_thm, &head, &cursor); bucket != NULL;
+		    bucket = THM_NEXT(s_thm, &cursor))
+			sum += THM_BUCKET_FIRST(s_thm, bucket)->key;
+		for (bucket = THM_LAST(s_thm, &head, &cursor); bucket != NULL;
+		    bucket = THM_PREV(s_thm, &cursor))
+			sum -= THM_BUCKET_FIRST(s_thm, bucket)->key;
+	}
+	gettimeofday(&tend, NULL);
+	if (sum != 0)
+		abort();
+	benchmark_result(name, 2 * rounds * (intmax_t)n, &tstart, &tend);
+
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s_thm, &head, &elm_list[i]);
+
+	THM_HEAD_DESTROY(s_thm, &head);
+	thm_pool_destroy(&pool);
+
+	free(elm_list);
+}
+
+/* Remove 7 of every 8 keys, then look up the survivors */
+static void
+test_thm_delete(int *keys, const int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	THM_HEAD(s_thm) head;
+	THM_BUCKET(s_thm) *bucket;
+
+	struct s_thm *elm, *elm_list;
+	u_long used_full, used_left;
+	int i, j;
+
+	thm_pool_init(&pool, "thashmap-bench");
+
+	THM_HEAD_INIT(s_thm, &head, &pool);
+
+	elm_list = malloc(sizeof(*elm) * n);
+
+	for (i = 0; i < n; i++) {
+		elm = &elm_list[i];
+		elm->key = keys[i];
+		while (THM_INSERT(s_thm, &head, elm) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	used_full = thm_pool_used_kb(&pool);
+
+	gettimeofday(&tstart, NULL);
+	for (i = 0; i < n; i++) {
+		if (i % 8 != 0)
+			THM_REMOVE(s_thm, &head, &elm_list[i]);
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("thashmap/delete", n - (n + 7) / 8, &tstart, &tend);
+
+	used_left = thm_pool_used_kb(&pool);
+
+	gettimeofday(&tstart, NULL);
+	for (j = 0; j < 8; j++) {
+		for (i = 0; i < n; i += 8) {
+			elm = &elm_list[i];
+			bucket = THM_FIND(s_thm, &head, elm->key, NULL);
+			if (THM_BUCKET_FIRST(s_thm, bucket) != elm)
+				abort();
+		}
+	}
+	gettimeofday(&tend, NULL);
+	benchmark_result("thashmap/find", 8 * ((n + 7) / 8), &tstart, &tend);
+
+	printf("%16s: %lu KB full, %lu KB after delete\n", "thashmap/memory",
+	    used_full, used_left);
+
+	for (i = 0; i < n; i += 8)
+		THM_REMOVE(s_thm, &head, &elm_list[i]);
+
+	THM_HEAD_DESTROY(s_thm, &head);
+	thm_pool_destroy(&pool);
+
+	free(elm_list);
 }
 
 static void
@@ -430,6 +1283,97 @@ test_khash(int *keys, const int n)
 	benchmark_result("khash", n, &tstart, &tend);
 }
 
+/* Same numeric keys as strings, misses are one character longer */
+static void
+str_list_init(int *keys, const int n, struct s_str **elm_list,
+    struct s_str **miss_list)
+{
+	int i;
+
+	*elm_list = malloc(sizeof(struct s_str) * n);
+	*miss_list = malloc(sizeof(struct s_str) * n);
+	for (i = 0; i < n; i++) {
+		snprintf((*elm_list)[i].key, sizeof((*elm_list)[i].key),
+		    "thashmap/%010u", keys[i]);
+		snprintf((*miss_list)[i].key, sizeof((*miss_list)[i].key),
+		    "thashmap/%010u/", keys[i]);
+	}
+}
+
+static void
+test_thm_str(int *keys, const int n)
+{
+	struct timeval tstart, tend;
+	struct thm_pool pool;
+	THM_HEAD(s_str) head;
+
+	struct s_str *elm, *elm_list, *miss_list, *r;
+	const char *key;
+	int i, j;
+
+	str_list_init(keys, n, &elm_list, &miss_list);
+
+	thm_pool_init(&pool, "thashmap-bench");
+	THM_HEAD_INIT_FLAGS(s_str, &head, &pool, THM_HEAD_WIDE | THM_HEAD_FPRINT);
+
+	gettimeofday(&tstart, NULL);
+
+	TEST_STR(while ((r = THM_HINSERT(s_str, &head, elm, elm->key)) == NULL)
+		thm_pool_new_block(&pool), r == elm,
+	    THM_HFIND(s_str, &head, key),
+	    THM_HREMOVE(s_str, &head, key));
+
+	gettimeofday(&tend, NULL);
+
+	THM_HEAD_DESTROY(s_str, &head);
+	thm_pool_destroy(&pool);
+
+	free(elm_list);
+	free(miss_list);
+
+	benchmark_result("thashmap/str", n, &tstart, &tend);
+}
+
+static __inline struct s_str *
+khash_str_search(khash_t(khstr) *kh, const char *key)
+{
+	khint_t k = kh_get(khstr, kh, key);
+	if (k != kh_end(kh)) {
+		return (kh_value(kh, k));
+	}
+	return (NULL);
+}
+
+static void
+test_khash_str(int *keys, const int n)
+{
+	struct timeval tstart, tend;
+	struct s_str *elm, *elm_list, *miss_list, *r;
+	khash_t(khstr) *kh;
+	const char *key;
+	khint_t k;
+	int i, j, ret;
+
+	str_list_init(keys, n, &elm_list, &miss_list);
+	kh = kh_init(khstr);
+
+	gettimeofday(&tstart, NULL);
+
+	TEST_STR(k = kh_put(khstr, kh, elm->key, &ret);
+		kh_value(kh, k) = elm, ret > 0,
+	    khash_str_search(kh, key),
+	    kh_del(khstr, kh, kh_get(khstr, kh, key)));
+
+	gettimeofday(&tend, NULL);
+
+	kh_destroy(khstr, kh);
+
+	free(elm_list);
+	free(miss_list);
+
+	benchmark_result("khash/str", n, &tstart, &tend);
+}
+
 
 static int
 key_random(void)
@@ -473,13 +1417,74 @@ remove_dup(int *keys, int n)
 	free(keys_sorted);
 }
 
+/* Contiguous run of keys at random base, in random order */
+static void
+keys_dense(int *keys, int n)
+{
+	int base, i, j, t;
+
+	base = key_random() & ~0xfffff & (THM_KEY_MASK - n);
+	for (i = 0; i < n; i++)
+		keys[i] = base + i;
+	for (i = n - 1; i > 0; i--) {
+		j = key_random() % (i + 1);
+		t = keys[i];
+		keys[i] = keys[j];
+		keys[j] = t;
+	}
+}
+
 int
 main(int argc, char **argv)
 {
+	const char *mode;
 	int i, n, ntests, *keys;
 
 	n = 200000;
 	ntests = 10;
+	mode = "all";
+
+	/*
+	 * thashmap-bench n ntests [mode]
+	 * stride: compare strides on the same keys
+	 * delete: delete-heavy phase, memory left after deletes
+	 * value: entry heads against value mode heads
+	 * miss: lookup misses with and without key fingerprints
+	 * set: set head on sparse and dense keys
+	 * small: many heads with zero to three keys
+	 * wide: regular root against wide root table
+	 * scan: iteration over dense and sparse heads
+	 * dense: contiguous keys with and without dense tables
+	 * str: hashed head against khash on string keys
+	 * lpm: longest prefix match against probing every prefix length
+	 * rank: leaf count upkeep on inserts, rank and select
+	 * aggr: range sums by aggregate head against a walk
+	 * digest: digest compare of two heads against a lockstep walk
+	 * diff: keys changed between two heads against merging cursors
+	 * setop: intersection of set heads against merging cursors
+	 */
+	if (argc >= 4) {
+		mode = argv[3];
+		if (strcmp(mode, "stride") != 0 &&
+		    strcmp(mode, "delete") != 0 &&
+		    strcmp(mode, "value") != 0 &&
+		    strcmp(mode, "miss") != 0 &&
+		    strcmp(mode, "set") != 0 &&
+		    strcmp(mode, "small") != 0 &&
+		    strcmp(mode, "wide") != 0 &&
+		    strcmp(mode, "scan") != 0 &&
+		    strcmp(mode, "dense") != 0 &&
+		    strcmp(mode, "str") != 0 &&
+		    strcmp(mode, "lpm") != 0 &&
+		    strcmp(mode, "rank") != 0 &&
+		    strcmp(mode, "aggr") != 0 &&
+		    strcmp(mode, "digest") != 0 &&
+		    strcmp(mode, "diff") != 0 &&
+		    strcmp(mode, "setop") != 0) {
+			fprintf(stderr, "invalid mode: %s\n", mode);
+			return (1);
+		}
+	}
 
 	if (argc >= 3) {
 		ntests = atoi(argv[2]);
@@ -508,7 +1513,109 @@ main(int argc, char **argv)
 			keys[i] = key_random();
 		remove_dup(keys, n);
 
-		test_thm(keys, n);
+		if (strcmp(mode, "delete") == 0) {
+			test_thm_delete(keys, n);
+			continue;
+		}
+
+		if (strcmp(mode, "stride") == 0) {
+			test_thm(keys, n, "thashmap/4", THM_HEAD_STRIDE4);
+			test_thm(keys, n, "thashmap/5", THM_HEAD_STRIDE5);
+			test_thm(keys, n, "thashmap/6", THM_HEAD_STRIDE6);
+			continue;
+		}
+
+		if (strcmp(mode, "set") == 0) {
+			test_thm_set(keys, n, "set/sparse", THM_KEY_MASK);
+			test_thm_set(keys, n, "set/dense", 2 * n);
+			continue;
+		}
+
+		if (strcmp(mode, "scan") == 0) {
+			test_thm_scan(keys, n, "thashmap", 0);
+			test_thm_scan(keys, n, "thashmap/wide", THM_HEAD_WIDE);
+			test_thm_scan(keys, n / 2000 + 1, "sparse", 0);
+			test_thm_scan(keys, n / 2000 + 1, "sparse/wide",
+			    THM_HEAD_WIDE);
+			continue;
+		}
+
+		if (strcmp(mode, "wide") == 0) {
+			test_thm_miss(keys, n, "thashmap", 0);
+			test_thm_miss(keys, n, "thashmap/wide", THM_HEAD_WIDE);
+			test_thm_miss(keys, n, "thashmap/4", THM_HEAD_STRIDE4);
+			test_thm_miss(keys, n, "thashmap/4/wide",
+			    THM_HEAD_STRIDE4 | THM_HEAD_WIDE);
+			continue;
+		}
+
+		if (strcmp(mode, "dense") == 0) {
+			keys_dense(keys, n);
+			test_thm(keys, n, "thashmap", 0);
+			test_thm(keys, n, "thashmap/dense", THM_HEAD_DENSE);
+			test_thm_scan(keys, n, "scan", 0);
+			test_thm_scan(keys, n, "scan/dense", THM_HEAD_DENSE);
+			continue;
+		}
+
+		if (strcmp(mode, "str") == 0) {
+			test_thm_str(keys, n);
+			test_khash_str(keys, n);
+			continue;
+		}
+
+		if (strcmp(mode, "lpm") == 0) {
+			test_thm_lpm(keys, n, 0);
+			test_thm_lpm(keys, n, 1);
+			continue;
+		}
+		if (strcmp(mode, "rank") == 0) {
+			test_thm_rank(keys, n, 0);
+			test_thm_rank(keys, n, 1);
+			continue;
+		}
+		if (strcmp(mode, "aggr") == 0) {
+			test_thm_aggr(keys, n, 0);
+			test_thm_aggr(keys, n, 1);
+			continue;
+		}
+		if (strcmp(mode, "digest") == 0) {
+			test_thm_digest(keys, n);
+			continue;
+		}
+
+		if (strcmp(mode, "diff") == 0) {
+			test_thm_diff(keys, n);
+			continue;
+		}
+
+		if (strcmp(mode, "setop") == 0) {
+			test_thm_setop(keys, n, "setop/sparse", THM_KEY_MASK);
+			test_thm_setop(keys, n, "setop/dense", 4 * n);
+			continue;
+		}
+
+		if (strcmp(mode, "small") == 0) {
+			test_thm_small(keys, n);
+			continue;
+		}
+
+		if (strcmp(mode, "miss") == 0) {
+			test_thm_miss(keys, n, "thashmap", 0);
+			if (sizeof(uintptr_t) >= 8)
+				test_thm_miss(keys, n, "thashmap/fp",
+				    THM_HEAD_FPRINT);
+			continue;
+		}
+
+		if (strcmp(mode, "value") == 0) {
+			test_thm(keys, n, "thashmap", 0);
+			test_thm_value(keys, n);
+			continue;
+		}
+
+		test_thm(keys, n, "thashmap", 0);
+		test_thm_value(keys, n);
 		test_hashtbl(keys, n, 1);
 		test_hashtbl(keys, n, 4);
 		test_hashtbl(keys, n, 8);
@@ -27,6 +27,7 @@
 #include <sys/types.h>
 
 #include <assert.h>
+#include <errno.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -43,6 +44,8 @@ static const int test_opt_verbose = 0;
 static const int test_opt_fragmentation = 0;
 static const int test_opt_random = 1;
 
+static uint32_t test_hash_buckets = 1;
+
 struct s1 {
 	char		pad1[5];
 	uint32_t	key;
@@ -57,11 +60,56 @@ struct s2 {
 	uint32_t	key2;
 };
 
+struct s3 {
+	struct thm_entry entry;
+	uint64_t	key;
+};
+
+struct s4 {
+	struct thm_entry entry;
+	struct thm_skey	key;
+	char		buf[24];
+};
+
+struct s5 {
+	char		pad1[5];
+	struct thm_dentry entry;
+	uint32_t	key;
+};
+
+/* Hashed by string key, second map has few hashes for many collisions */
+struct s6 {
+	struct thm_entry entry;
+	struct thm_entry entry2;
+	uint32_t	hash;
+	uint32_t	hash2;
+	char		key[16];
+};
+
+/* Entry with a value summarized by aggregate heads */
+struct s7 {
+	struct thm_entry entry;
+	uint64_t	key;
+	uint64_t	val;
+};
+
 typedef void test_method_t(int *, int);
 
 THM_DEFINE(s1_map, s1, entry, key);
+THM_DEFINE32(s1_map32, s1, entry, key);
 THM_DEFINE(s2_map1, s2, entry1, key1);
 THM_DEFINE(s2_map2, s2, entry2, key2);
+THM_DEFINE64(s3_map, s3, entry, key);
+THM_DEFINE_SKEY(s4_map, s4, entry, key);
+THM_DEFINE_DLIST(s5_map, s5, entry, key);
+THM_DEFINE64(s7_map, s7, entry, key);
+
+#define	s6_hash(key)		thm_hash_bytes((key), strlen((key)))
+#define	s6_hash2(key)		(s6_hash((key)) % test_hash_buckets)
+#define	s6_eq(elm, k)		(strcmp((elm)->key, (k)) == 0)
+
+THM_DEFINE_HASH(s6_map, s6, entry, hash, const char *, s6_hash, s6_eq);
+THM_DEFINE_HASH(s6_map2, s6, entry2, hash2, const char *, s6_hash2, s6_eq);
 
 static void
 test_pool_stats(const char *msg, struct thm_pool *pool)
@@ -89,6 +137,37 @@ key_cmp(const void *xa, const void *xb)
 	return (((*a) & THM_KEY_MASK) - ((*b) & THM_KEY_MASK));
 }
 
+static int
+key_cmp32(const void *xa, const void *xb)
+{
+	const uint32_t *a = xa, *b = xb;
+
+	return (*a < *b ? -1 : *a > *b);
+}
+
+static int
+key_cmp64(const void *xa, const void *xb)
+{
+	const uint64_t *a = xa, *b = xb;
+
+	return (*a < *b ? -1 : *a > *b);
+}
+
+static int
+key_cmp_skey(const void *xa, const void *xb)
+{
+	const struct s4 *a = *(struct s4 * const *)xa;
+	const struct s4 *b = *(struct s4 * const *)xb;
+	size_t len;
+	int r;
+
+	len = a->key.tsk_len < b->key.tsk_len ? a->key.tsk_len : b->key.tsk_len;
+	r = memcmp(a->key.tsk_data, b->key.tsk_data, len);
+	if (r != 0)
+		return (r);
+	return ((int)a->key.tsk_len - (int)b->key.tsk_len);
+}
+
 static const int test_gen_key_seed = 33554467UL;
 
 static __inline int
@@ -646,7 +725,7 @@ again:
 
 		xbucket = THM_FIND(s1_map, &head, ep->key, &xcursor);
 		assert(xbucket == bucket);
-		assert(cursor.tc_level = xcursor.tc_level);
+		assert(cursor.tc_level == xcursor.tc_level);
 		assert(cursor.tc_path[cursor.tc_level] ==
 		    xcursor.tc_path[xcursor.tc_level]);
 
@@ -714,7 +793,7 @@ again:
 
 		xbucket = THM_FIND(s1_map, &head, ep->key, &xcursor);
 		assert(xbucket == bucket);
-		assert(cursor.tc_level = xcursor.tc_level);
+		assert(cursor.tc_level == xcursor.tc_level);
 		assert(cursor.tc_path[cursor.tc_level] ==
 		    xcursor.tc_path[xcursor.tc_level]);
 
@@ -876,6 +955,2265 @@ again:
 	free(elist);
 }
 
+__unused static void
+test_keywidth(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s1_map32) head32;
+	THM_BUCKET(s1_map32) *b32;
+	THM_HEAD(s3_map) head64;
+	THM_BUCKET(s3_map) *b64;
+
+	struct s1 *ep32, *elist32;
+	struct s3 *ep64, *elist64;
+	uint32_t *skeys32;
+	uint64_t *skeys64;
+	int i;
+
+	elist32 = malloc(sizeof(struct s1) * n);
+	elist64 = malloc(sizeof(struct s3) * n);
+	skeys32 = malloc(sizeof(uint32_t) * n);
+	skeys64 = malloc(sizeof(uint64_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT(s1_map32, &head32, &pool);
+	THM_HEAD_INIT(s3_map, &head64, &pool);
+
+	for (i = 0; i < n; i++) {
+		ep32 = &elist32[i];
+		ep64 = &elist64[i];
+		/* Use all key bits, odd multiplier keeps keys distinct */
+		ep32->key = keys[i];
+		ep64->key = (uint64_t)(uint32_t)keys[i] * 0x9e3779b97f4a7c15ULL;
+		skeys32[i] = ep32->key;
+		skeys64[i] = ep64->key;
+		while (THM_INSERT(s1_map32, &head32, ep32) == NULL)
+			thm_pool_new_block(&pool);
+		while (THM_INSERT(s3_map, &head64, ep64) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	qsort(skeys32, n, sizeof(uint32_t), key_cmp32);
+	qsort(skeys64, n, sizeof(uint64_t), key_cmp64);
+
+	i = 0;
+	for (b32 = THM_FIRST(s1_map32, &head32, &cursor); b32 != NULL;
+	    b32 = THM_NEXT(s1_map32, &cursor)) {
+		ep32 = THM_BUCKET_FIRST(s1_map32, b32);
+		assert(ep32->key == skeys32[i]);
+		while (i < n && ep32->key == skeys32[i])
+			i++;
+	}
+	assert(i == n);
+
+	i = 0;
+	for (b64 = THM_FIRST(s3_map, &head64, &cursor); b64 != NULL;
+	    b64 = THM_NEXT(s3_map, &cursor)) {
+		ep64 = THM_BUCKET_FIRST(s3_map, b64);
+		assert(ep64->key == skeys64[i]);
+		while (i < n && ep64->key == skeys64[i])
+			i++;
+	}
+	assert(i == n);
+
+	for (i = 0; i + 1 < n; i++) {
+		if (skeys64[i] + 1 >= skeys64[i + 1])
+			continue;
+		b64 = THM_NFIND(s3_map, &head64, skeys64[i] + 1, NULL);
+		assert(b64 != NULL);
+		ep64 = THM_BUCKET_FIRST(s3_map, b64);
+		assert(ep64->key == skeys64[i + 1]);
+		assert(THM_FIND(s3_map, &head64, skeys64[i] + 1, NULL) == NULL);
+	}
+	assert(THM_NFIND(s3_map, &head64, skeys64[n - 1] + 1, NULL) == NULL ||
+	    skeys64[n - 1] == ~(uint64_t)0);
+
+	for (i = 0; i < n; i++) {
+		ep32 = &elist32[i];
+		ep64 = &elist64[i];
+		b32 = THM_FIND(s1_map32, &head32, ep32->key, NULL);
+		assert(b32 != NULL);
+		b64 = THM_FIND(s3_map, &head64, ep64->key, NULL);
+		assert(b64 != NULL);
+		THM_REMOVE(s1_map32, &head32, ep32);
+		THM_REMOVE(s3_map, &head64, ep64);
+	}
+
+	assert(THM_EMPTY(s1_map32, &head32));
+	assert(THM_EMPTY(s3_map, &head64));
+
+	THM_HEAD_DESTROY(s1_map32, &head32);
+	THM_HEAD_DESTROY(s3_map, &head64);
+
+	thm_pool_destroy(&pool);
+
+	free(skeys32);
+	free(skeys64);
+	free(elist32);
+	free(elist64);
+}
+
+static void
+test_stride_flags(int *keys, int n, u_int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s3_map) head;
+	THM_BUCKET(s3_map) *bucket;
+
+	struct s3 *ep, *elist;
+	uint64_t *skeys;
+	int i;
+
+	elist = malloc(sizeof(struct s3) * n);
+	skeys = malloc(sizeof(uint64_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	assert(THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, flags) == 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Mix sparse keys with dense duplicate prone ones */
+		if (i % 2 == 0)
+			ep->key = (uint64_t)(uint32_t)keys[i] *
+			    0x9e3779b97f4a7c15ULL;
+		else
+			ep->key = keys[i] & 0x3ff;
+		skeys[i] = ep->key;
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	qsort(skeys, n, sizeof(uint64_t), key_cmp64);
+
+	i = 0;
+	for (bucket = THM_FIRST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_NEXT(s3_map, &cursor)) {
+		THM_BUCKET_FOREACH(s3_map, ep, bucket) {
+			assert(i < n && ep->key == skeys[i]);
+			i++;
+		}
+	}
+	assert(i == n);
+
+	i = n;
+	for (bucket = THM_LAST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_PREV(s3_map, &cursor)) {
+		THM_BUCKET_FOREACH(s3_map, ep, bucket) {
+			i--;
+			assert(i >= 0 && ep->key == skeys[i]);
+		}
+	}
+	assert(i == 0);
+
+	for (i = 0; i + 1 < n; i++) {
+		if (skeys[i] + 1 >= skeys[i + 1])
+			continue;
+		bucket = THM_NFIND(s3_map, &head, skeys[i] + 1, NULL);
+		assert(bucket != NULL);
+		ep = THM_BUCKET_FIRST(s3_map, bucket);
+		assert(ep->key == skeys[i + 1]);
+		assert(THM_FIND(s3_map, &head, skeys[i] + 1, NULL) == NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		assert(THM_FIND(s3_map, &head, ep->key, NULL) != NULL);
+		THM_REMOVE(s3_map, &head, ep);
+	}
+
+	assert(THM_EMPTY(s3_map, &head));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(skeys);
+	free(elist);
+}
+
+__unused static void
+test_stride(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_head head;
+	int error;
+
+	/* Fanout must fit the slot map word, unsupported strides fail */
+	thm_pool_init(&pool, "thashmap-test");
+	assert(thm_head_init_flags(&head, &pool, 0, THM_HEAD_STRIDE) ==
+	    EINVAL);
+	assert(thm_head_init_flags(&head, &pool, 0, THM_HEAD_KEYWIDTH) ==
+	    EINVAL);
+	assert(thm_head_init_flags(&head, &pool, 0,
+	    THM_HEAD_SKEY | THM_HEAD_STRIDE4) == EINVAL);
+	error = thm_head_init_flags(&head, &pool, 0, THM_HEAD_STRIDE6);
+#ifdef THM_SLOT_HEADER
+	assert(error == EINVAL);
+#else
+	assert(error == (sizeof(uintptr_t) >= 8 ? 0 : EINVAL));
+#endif
+	if (error == 0)
+		thm_head_destroy(&head);
+	thm_pool_destroy(&pool);
+
+	test_stride_flags(keys, n, THM_HEAD_STRIDE4);
+	test_stride_flags(keys, n, THM_HEAD_STRIDE5);
+	if (error == 0)
+		test_stride_flags(keys, n, THM_HEAD_STRIDE6);
+}
+
+static void
+test_prefix_check(struct thm_head *head, struct s3 *elist, int n,
+    int removed)
+{
+	struct thm_cursor cursor;
+	struct thm_bucket *bucket;
+	struct s3 *ep;
+	uint64_t prev = 0;
+	int i, count;
+
+	count = 0;
+	for (bucket = thm_first(head, &cursor); bucket != NULL;
+	    bucket = thm_next(&cursor)) {
+		ep = s3_map_ENTRY(thm_bucket_first(bucket));
+		assert(count == 0 || prev < ep->key);
+		prev = ep->key;
+		for (; ep != NULL; ep = s3_map_ENTRY(thm_bucket_next(&ep->entry)))
+			count++;
+	}
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		bucket = thm_find(head, ep->key, NULL);
+		if (i % 2 == 0 && removed) {
+			assert(bucket == NULL);
+			bucket = thm_nfind(head, ep->key, NULL);
+			assert(bucket == NULL || s3_map_ENTRY(
+			    thm_bucket_first(bucket))->key > ep->key);
+			continue;
+		}
+		assert(bucket != NULL);
+		assert(s3_map_ENTRY(thm_bucket_first(bucket))->key == ep->key);
+	}
+
+	assert(count == (removed ? n / 2 : n));
+}
+
+/* Clustered keys share long prefixes */
+__unused static void
+test_prefix(int *keys, int n)
+{
+	struct thm_pool pool;
+	THM_HEAD(s3_map) head;
+
+	struct s3 *ep, *elist;
+	int i;
+
+	elist = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT(s3_map, &head, &pool);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Low bits keep keys unique */
+		ep->key = ((uint64_t)((uint32_t)keys[i] % 5) << 60) |
+		    ((uint64_t)((uint32_t)keys[i] % 3) << 30) |
+		    ((uint64_t)(keys[i] & 0x7) << 20) | i;
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+
+	for (i = 0; i < n; i += 2)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	test_prefix_check(&head.s3_map_head, elist, n, 1);
+
+	for (i = 0; i < n; i += 2) {
+		while (THM_INSERT(s3_map, &head, &elist[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+
+	assert(THM_EMPTY(s3_map, &head));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+/* Fingerprints reject misses, entries and duplicates still work */
+__unused static void
+test_fprint(int *keys, int n)
+{
+	struct thm_pool pool;
+	THM_HEAD(s3_map) head;
+	THM_BUCKET(s3_map) *bucket;
+
+	struct s3 *ep, *elist, *dlist;
+	int i;
+
+	if (sizeof(uintptr_t) < 8)
+		return;
+
+	elist = malloc(sizeof(struct s3) * n);
+	dlist = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, THM_HEAD_FPRINT);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Low bits keep keys unique, bit 16 is never set */
+		ep->key = ((uint64_t)(uint32_t)keys[i] << 32) | (uint32_t)i;
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		assert(THM_FIND(s3_map, &head, ep->key ^ 0x10000, NULL) ==
+		    NULL);
+	}
+
+	/* Duplicate goes first in the bucket, removing it restores leaf */
+	for (i = 0; i < n; i += 2) {
+		dlist[i].key = elist[i].key;
+		bucket = THM_INSERT(s3_map, &head, &dlist[i]);
+		assert(bucket != NULL);
+		assert(THM_BUCKET_FIRST(s3_map, bucket) == &dlist[i]);
+		assert(THM_BUCKET_NEXT(s3_map, &dlist[i]) == &elist[i]);
+	}
+	for (i = 0; i < n; i += 2) {
+		THM_REMOVE(s3_map, &head, &dlist[i]);
+		bucket = THM_FIND(s3_map, &head, elist[i].key, NULL);
+		assert(THM_BUCKET_FIRST(s3_map, bucket) == &elist[i]);
+	}
+
+	for (i = 0; i < n; i += 2)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	test_prefix_check(&head.s3_map_head, elist, n, 1);
+
+	for (i = 1; i < n; i += 2)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+
+	assert(THM_EMPTY(s3_map, &head));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+	free(dlist);
+}
+
+static int
+test_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+static void
+test_set_flags(int *keys, int n, u_int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	struct thm_head head;
+	uint64_t key, *skeys;
+	int i, j, m;
+
+	skeys = malloc(sizeof(uint64_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_head_init_flags(&head, &pool, 0, THM_HEAD_SET | flags);
+
+	/* Half of the keys are dense to fill bitmaps */
+	for (i = 0; i < n; i++) {
+		skeys[i] = (uint32_t)keys[i] & THM_KEY_MASK;
+		if (i % 2 == 1)
+			skeys[i] &= 0xfff;
+		while (thm_set_add(&head, skeys[i]) != 0)
+			thm_pool_new_block(&pool);
+	}
+	qsort(skeys, n, sizeof(uint64_t), test_u64_cmp);
+	for (i = 1, m = 1; i < n; i++) {
+		if (skeys[i] != skeys[m - 1])
+			skeys[m++] = skeys[i];
+	}
+
+	for (i = 0, j = thm_set_first(&head, &cursor, &key); j != 0;
+	    i++, j = thm_set_next(&cursor, &key))
+		assert(i < m && key == skeys[i]);
+	assert(i == m);
+	for (i = m - 1, j = thm_set_last(&head, &cursor, &key); j != 0;
+	    i--, j = thm_set_prev(&cursor, &key))
+		assert(i >= 0 && key == skeys[i]);
+	assert(i == -1);
+
+	for (i = 0; i < m; i++) {
+		assert(thm_set_member(&head, skeys[i]));
+		j = thm_set_nfind(&head, skeys[i] + 1, &cursor, &key);
+		if (i + 1 < m) {
+			assert(j != 0 && key == skeys[i + 1]);
+			if (skeys[i] + 1 != skeys[i + 1])
+				assert(!thm_set_member(&head, skeys[i] + 1));
+		} else
+			assert(j == 0);
+	}
+
+	for (i = 0; i < m; i += 2)
+		assert(thm_set_remove(&head, skeys[i]));
+	for (i = 0; i < m; i++) {
+		assert(thm_set_member(&head, skeys[i]) == (i % 2));
+		j = thm_set_nfind(&head, skeys[i], &cursor, &key);
+		if (i % 2 == 1)
+			assert(j != 0 && key == skeys[i]);
+		else if (i + 1 < m)
+			assert(j != 0 && key == skeys[i + 1]);
+		else
+			assert(j == 0);
+	}
+	for (i = 0; i < m; i++)
+		assert(thm_set_remove(&head, skeys[i]) == (i % 2));
+
+	assert(thm_empty(&head));
+	assert(thm_set_first(&head, &cursor, &key) == 0);
+
+	thm_head_destroy(&head);
+
+	thm_pool_destroy(&pool);
+
+	free(skeys);
+}
+
+__unused static void
+test_set(int *keys, int n)
+{
+	test_set_flags(keys, n, THM_HEAD_KEY30 | THM_HEAD_STRIDE4);
+	test_set_flags(keys, n, THM_HEAD_KEY30 | THM_HEAD_STRIDE5);
+	if (sizeof(uintptr_t) >= 8)
+		test_set_flags(keys, n, THM_HEAD_KEY64 | THM_HEAD_STRIDE5);
+}
+
+static void
+test_dlist_check(THM_HEAD(s5_map) *head, struct s5 *elist, int n,
+    int nbuckets, int removed)
+{
+	THM_BUCKET(s5_map) *bucket;
+	struct s5 *ep, *prev;
+	int i, count;
+
+	for (i = 0; i < nbuckets; i++) {
+		bucket = THM_FIND(s5_map, head, i, NULL);
+		count = 0;
+		prev = NULL;
+		if (bucket != NULL) {
+			THM_BUCKET_FOREACH(s5_map, ep, bucket) {
+				assert(ep->key == (uint32_t)i);
+				assert(ep->entry.tde_prev == (prev == NULL ?
+				    NULL : &prev->entry.tde_entry));
+				prev = ep;
+				count++;
+			}
+		}
+		/* Key i is held by elements i, i + nbuckets, ... */
+		assert(count == (n - i + nbuckets - 1) / nbuckets -
+		    (removed ? (n - i + 2 * nbuckets - 1) / (2 * nbuckets) :
+		    0));
+	}
+}
+
+/* Large duplicate buckets of doubly linked entries */
+__unused static void
+test_dlist(int *keys __unused, int n)
+{
+	struct thm_pool pool;
+	THM_HEAD(s5_map) head;
+
+	struct s5 *ep, *elist;
+	int i, nbuckets;
+
+	nbuckets = 1 + n / 1000;
+	elist = malloc(sizeof(struct s5) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT(s5_map, &head, &pool);
+	assert((head.s5_map_head.th_flags & THM_HEAD_DLIST) != 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		ep->key = i % nbuckets;
+		while (THM_INSERT(s5_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_dlist_check(&head, elist, n, nbuckets, 0);
+
+	/* Removes oldest entries, they are at the tail of buckets */
+	for (i = 0; i < n; i++) {
+		if (i % (2 * nbuckets) < nbuckets)
+			THM_REMOVE(s5_map, &head, &elist[i]);
+	}
+	test_dlist_check(&head, elist, n, nbuckets, 1);
+
+	for (i = n - 1; i >= 0; i--) {
+		if (i % (2 * nbuckets) >= nbuckets)
+			THM_REMOVE(s5_map, &head, &elist[i]);
+	}
+
+	assert(THM_EMPTY(s5_map, &head));
+
+	THM_HEAD_DESTROY(s5_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+static u_long
+test_pool_used(struct thm_pool *pool)
+{
+	struct thm_pool_stats ps;
+
+	thm_pool_get_stats(pool, &ps);
+
+	return (ps.tp_slots - ps.tp_slots_free);
+}
+
+/* Removing all but one key leaves the same tree as inserting it alone */
+__unused static void
+test_collapse(int *keys, int n)
+{
+	struct thm_pool pool, xpool;
+	struct thm_cursor cursor, xcursor;
+	THM_HEAD(s3_map) head, xhead;
+
+	struct s3 *ep, *elist;
+	u_long used, xused;
+	int i;
+
+	elist = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_pool_init(&xpool, "thashmap-test");
+
+	THM_HEAD_INIT(s3_map, &head, &pool);
+	THM_HEAD_INIT(s3_map, &xhead, &xpool);
+
+	used = test_pool_used(&pool);
+
+	/* Same first subkey, root slot doesn't grow */
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		ep->key = ((uint64_t)1 << 59) | (uint32_t)keys[i];
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	for (i = 1; i < n; i++)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+
+	while (THM_INSERT(s3_map, &xhead, &elist[0]) == NULL)
+		thm_pool_new_block(&xpool);
+
+	/* Single entry is kept in the root entry, emptied pages are released */
+	xused = test_pool_used(&xpool);
+	assert(test_pool_used(&pool) <= xused);
+	assert(xused == used);
+
+	assert(THM_FIND(s3_map, &head, elist[0].key, &cursor) != NULL);
+	assert(THM_FIND(s3_map, &xhead, elist[0].key, &xcursor) != NULL);
+	assert(cursor.tc_level == xcursor.tc_level);
+	assert(cursor.tc_level == 0);
+
+	THM_REMOVE(s3_map, &head, &elist[0]);
+	assert(THM_EMPTY(s3_map, &head));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+	THM_HEAD_DESTROY(s3_map, &xhead);
+
+	thm_pool_destroy(&pool);
+	thm_pool_destroy(&xpool);
+
+	free(elist);
+}
+
+/* Head with a single entry takes no slots */
+__unused static void
+test_inline(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s3_map) head;
+
+	struct s3 *ep, *elist;
+	THM_BUCKET(s3_map) *bucket;
+	u_long used;
+	int i, j, count, round;
+
+	if (n > 1024)
+		n = 1024;
+	elist = malloc(sizeof(struct s3) * 8 * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	THM_HEAD_INIT(s3_map, &head, &pool);
+
+	used = test_pool_used(&pool);
+
+	for (round = 0; round < 4; round++) {
+		/* Distinct root subkeys */
+		for (i = 0; i < 8; i++) {
+			ep = &elist[i];
+			ep->key = ((uint64_t)i << 60) | (uint32_t)keys[round];
+			while (THM_INSERT(s3_map, &head, ep) == NULL)
+				thm_pool_new_block(&pool);
+			if (i == 0)
+				assert(test_pool_used(&pool) <= used);
+			else
+				assert(test_pool_used(&pool) > used);
+		}
+		for (i = 7; i >= 0; i--) {
+			THM_REMOVE(s3_map, &head, &elist[i]);
+			if (i <= 1)
+				assert(test_pool_used(&pool) <= used);
+			for (j = 0; j < i; j++)
+				assert(THM_FIND(s3_map, &head, elist[j].key,
+				    NULL) != NULL);
+		}
+		assert(THM_EMPTY(s3_map, &head));
+	}
+
+	/* Subtrees under the root survive collapse */
+	for (i = 0; i < 8 * n; i++) {
+		ep = &elist[i];
+		ep->key = ((uint64_t)(i % 8) << 60) | (uint32_t)keys[i / 8];
+		if (THM_FIND(s3_map, &head, ep->key, NULL) != NULL)
+			ep->key = UINT64_MAX;
+		else while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	for (i = 0; i < 8 * n; i++) {
+		if (elist[i].key == UINT64_MAX || i % 8 < 2)
+			continue;
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	}
+	for (i = 0, count = 0; i < 8 * n; i++) {
+		if (elist[i].key == UINT64_MAX || i % 8 >= 2)
+			continue;
+		assert(THM_FIND(s3_map, &head, elist[i].key, NULL) != NULL);
+		count++;
+	}
+	for (bucket = THM_FIRST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_NEXT(s3_map, &cursor))
+		count--;
+	assert(count == 0);
+	for (i = 0; i < 8 * n; i++) {
+		if (elist[i].key == UINT64_MAX || i % 8 >= 2)
+			continue;
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	}
+	assert(THM_EMPTY(s3_map, &head));
+	assert(test_pool_used(&pool) <= used);
+
+	THM_HEAD_DESTROY(s3_map, &head);
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+static void
+test_value_check(struct thm_head *head, uint64_t *vkeys, uintptr_t *values,
+    int n, int removed)
+{
+	struct thm_cursor cursor;
+	uintptr_t value;
+	uint64_t prev = 0;
+	int i, count;
+
+	count = 0;
+	for (value = thm_vfirst(head, &cursor); value != 0;
+	    value = thm_vnext(&cursor)) {
+		assert(count == 0 || prev < thm_vkey(&cursor));
+		prev = thm_vkey(&cursor);
+		count++;
+	}
+
+	for (i = 0; i < n; i++) {
+		value = thm_vfind(head, vkeys[i], &cursor);
+		if (i % 2 == 0 && removed) {
+			assert(value == 0);
+			value = thm_vnfind(head, vkeys[i], &cursor);
+			assert(value == 0 || thm_vkey(&cursor) > vkeys[i]);
+			continue;
+		}
+		assert(value == values[i]);
+		assert(thm_vkey(&cursor) == vkeys[i]);
+		if (thm_value_is_int(value))
+			assert(thm_value_to_int(value) ==
+			    thm_value_to_int(values[i]));
+		else
+			assert(*(uint64_t *)thm_value_to_ptr(value) ==
+			    vkeys[i]);
+		value = thm_vnfind(head, vkeys[i] - 1, &cursor);
+		assert(value != 0 && thm_vkey(&cursor) <= vkeys[i]);
+	}
+
+	assert(count == (removed ? n / 2 : n));
+}
+
+static void
+test_value_flags(int *keys, int n, u_int flags)
+{
+	struct thm_pool pool;
+	struct thm_head head;
+	uint64_t *vkeys;
+	uintptr_t *values;
+	int i;
+
+	vkeys = malloc(sizeof(uint64_t) * n);
+	values = malloc(sizeof(uintptr_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_head_init_flags(&head, &pool, 0,
+	    THM_HEAD_KEY64 | THM_HEAD_VALUE | flags);
+
+	for (i = 0; i < n; i++) {
+		/* Low bits keep keys unique, odd keys are clustered */
+		if (i % 2 == 0)
+			vkeys[i] = ((uint64_t)(uint32_t)keys[i] << 32) |
+			    (uint32_t)i;
+		else
+			vkeys[i] = ((uint64_t)((uint32_t)keys[i] % 5) << 60) |
+			    (uint32_t)i;
+		if (i % 4 < 2)
+			values[i] = thm_value_from_int(vkeys[i] >>
+			    (64 - THM_VALUE_INT_BITS));
+		else
+			values[i] = thm_value_from_ptr(&vkeys[i]);
+		while (thm_vinsert(&head, vkeys[i], values[i]) != 0)
+			thm_pool_new_block(&pool);
+	}
+	test_value_check(&head, vkeys, values, n, 0);
+
+	for (i = 0; i < n; i += 2)
+		assert(thm_vremove(&head, vkeys[i]) == values[i]);
+	test_value_check(&head, vkeys, values, n, 1);
+
+	/* Insert replaces value of existing key */
+	for (i = 0; i < n; i++) {
+		values[i] = thm_value_from_int(i);
+		while (thm_vinsert(&head, vkeys[i], values[i]) != 0)
+			thm_pool_new_block(&pool);
+	}
+	test_value_check(&head, vkeys, values, n, 0);
+
+	for (i = 0; i < n; i++)
+		assert(thm_vremove(&head, vkeys[i]) == values[i]);
+	assert(thm_vremove(&head, vkeys[0]) == 0);
+
+	assert(thm_empty(&head));
+
+	thm_head_destroy(&head);
+
+	thm_pool_destroy(&pool);
+
+	free(vkeys);
+	free(values);
+}
+
+__unused static void
+test_value(int *keys, int n)
+{
+	test_value_flags(keys, n, THM_HEAD_STRIDE4);
+	test_value_flags(keys, n, THM_HEAD_STRIDE5);
+#ifndef THM_SLOT_HEADER
+	if (sizeof(uintptr_t) >= 8)
+		test_value_flags(keys, n, THM_HEAD_STRIDE6);
+#endif
+}
+
+/* Wide root head gives the same results as regular heads */
+static void
+test_wide_flags(int *keys, int n, int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s3_map) head;
+	THM_BUCKET(s3_map) *bucket;
+
+	struct s3 *ep, *elist;
+	uint64_t prev = 0;
+	int i, count;
+
+	elist = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, flags);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Low bits keep keys unique, some keys share first entry */
+		if (i % 4 == 3)
+			ep->key = i;
+		else if (i % 2 == 0)
+			ep->key = ((uint64_t)(uint32_t)keys[i] << 32) |
+			    (uint32_t)i;
+		else
+			ep->key = ((uint64_t)((uint32_t)keys[i] % 5) << 60) |
+			    (uint32_t)i;
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+	/* Table grows with the head, stride 4 is the first to do so */
+	assert(thm_count(&head.s3_map_head) == (u_long)n);
+	assert((flags & THM_HEAD_STRIDE4) == 0 || n < 8192 ||
+	    thm_head_wide(&head.s3_map_head)->tw_levels > 2);
+
+	/* Backwards over sparse occupancy bitmap */
+	count = 0;
+	for (bucket = THM_LAST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_PREV(s3_map, &cursor)) {
+		ep = THM_BUCKET_FIRST(s3_map, bucket);
+		assert(count == 0 || ep->key < prev);
+		prev = ep->key;
+		count++;
+	}
+	assert(count == n);
+
+	for (i = 0; i < n; i += 2)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	test_prefix_check(&head.s3_map_head, elist, n, 1);
+
+	for (i = 0; i < n; i += 2) {
+		while (THM_INSERT(s3_map, &head, &elist[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+
+	assert(THM_EMPTY(s3_map, &head));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+__unused static void
+test_wide(int *keys, int n)
+{
+	test_wide_flags(keys, n, THM_HEAD_WIDE);
+	test_wide_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_WIDE);
+	test_value_flags(keys, n, THM_HEAD_WIDE);
+	test_value_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_WIDE);
+	test_set_flags(keys, n, THM_HEAD_KEY30 | THM_HEAD_WIDE);
+}
+
+/* Runs of consecutive keys, every 64th key is sparse */
+static uint64_t
+test_dense_key(int *keys, int i)
+{
+	if (i % 64 == 63)
+		return (((uint64_t)(uint32_t)keys[i] << 32) | (uint32_t)i);
+
+	return (((uint64_t)((uint32_t)keys[i / 4096 * 4096] % 5 + 1) << 40) |
+	    (uint32_t)i);
+}
+
+/* Dense tables give the same results as slots, using less pool memory */
+static void
+test_dense_flags(int *keys, int n, int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s3_map) head;
+	THM_BUCKET(s3_map) *bucket;
+
+	struct s3 *ep, *elist;
+	uint64_t prev = 0;
+	u_long base, used;
+	int i, count;
+
+	elist = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	for (i = 0; i < n; i++)
+		elist[i].key = test_dense_key(keys, i);
+
+	/* Pool usage of the same keys in slots */
+	THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, flags & ~THM_HEAD_DENSE);
+	base = test_pool_used(&pool);
+	for (i = 0; i < n; i++) {
+		while (THM_INSERT(s3_map, &head, &elist[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	used = test_pool_used(&pool) - base;
+	for (i = 0; i < n; i++)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	assert(THM_EMPTY(s3_map, &head));
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, flags);
+	base = test_pool_used(&pool);
+	for (i = 0; i < n; i++) {
+		while (THM_INSERT(s3_map, &head, &elist[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+	assert(thm_count(&head.s3_map_head) == (u_long)n);
+	assert(n < 4096 || (test_pool_used(&pool) - base) * 2 < used);
+
+	/* Backwards over table occupancy bitmaps */
+	count = 0;
+	for (bucket = THM_LAST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_PREV(s3_map, &cursor)) {
+		ep = THM_BUCKET_FIRST(s3_map, bucket);
+		assert(count == 0 || ep->key < prev);
+		prev = ep->key;
+		count++;
+	}
+	assert(count == n);
+
+	/* Half full tables stay */
+	for (i = 0; i < n; i += 2)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+	test_prefix_check(&head.s3_map_head, elist, n, 1);
+
+	for (i = 0; i < n; i += 2) {
+		while (THM_INSERT(s3_map, &head, &elist[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+	test_prefix_check(&head.s3_map_head, elist, n, 0);
+
+	/* Sparse tables go back to slots */
+	for (i = 0; i < n; i++) {
+		if (i % 8 != 0)
+			THM_REMOVE(s3_map, &head, &elist[i]);
+	}
+	count = 0;
+	for (bucket = THM_FIRST(s3_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_NEXT(s3_map, &cursor)) {
+		ep = THM_BUCKET_FIRST(s3_map, bucket);
+		assert(count == 0 || prev < ep->key);
+		assert((uint32_t)ep->key % 8 == 0);
+		prev = ep->key;
+		count++;
+	}
+	assert(count == (n + 7) / 8);
+	for (i = 0; i < n; i++) {
+		bucket = THM_FIND(s3_map, &head, elist[i].key, NULL);
+		assert((bucket != NULL) == (i % 8 == 0));
+	}
+
+	for (i = 0; i < n; i += 8)
+		THM_REMOVE(s3_map, &head, &elist[i]);
+
+	assert(THM_EMPTY(s3_map, &head));
+	assert(test_pool_used(&pool) == base);
+
+	THM_HEAD_DESTROY(s3_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+static void
+test_dense_value_flags(int *keys, int n, u_int flags)
+{
+	struct thm_pool pool;
+	struct thm_head head;
+	uint64_t *vkeys;
+	uintptr_t *values;
+	int i;
+
+	vkeys = malloc(sizeof(uint64_t) * n);
+	values = malloc(sizeof(uintptr_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_head_init_flags(&head, &pool, 0,
+	    THM_HEAD_KEY64 | THM_HEAD_VALUE | THM_HEAD_DENSE | flags);
+
+	for (i = 0; i < n; i++) {
+		vkeys[i] = test_dense_key(keys, i);
+		values[i] = thm_value_from_int(i);
+		while (thm_vinsert(&head, vkeys[i], values[i]) != 0)
+			thm_pool_new_block(&pool);
+	}
+	test_value_check(&head, vkeys, values, n, 0);
+
+	for (i = 0; i < n; i += 2)
+		assert(thm_vremove(&head, vkeys[i]) == values[i]);
+	test_value_check(&head, vkeys, values, n, 1);
+
+	for (i = 1; i < n; i += 2) {
+		if (i % 8 != 1)
+			assert(thm_vremove(&head, vkeys[i]) == values[i]);
+	}
+	for (i = 0; i < n; i++)
+		assert((thm_vfind(&head, vkeys[i], NULL) != 0) == (i % 8 == 1));
+
+	for (i = 1; i < n; i += 8)
+		assert(thm_vremove(&head, vkeys[i]) == values[i]);
+
+	assert(thm_empty(&head));
+
+	thm_head_destroy(&head);
+
+	thm_pool_destroy(&pool);
+
+	free(vkeys);
+	free(values);
+}
+
+__unused static void
+test_dense(int *keys, int n)
+{
+	test_dense_flags(keys, n, THM_HEAD_DENSE);
+	test_dense_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_DENSE);
+	test_dense_flags(keys, n, THM_HEAD_WIDE | THM_HEAD_DENSE);
+	test_dense_value_flags(keys, n, THM_HEAD_STRIDE4);
+	test_dense_value_flags(keys, n, THM_HEAD_STRIDE5);
+	test_value_flags(keys, n, THM_HEAD_DENSE);
+}
+
+static int
+key_cmp_s3(const void *a, const void *b)
+{
+	const struct s3 *x = *(struct s3 * const *)a;
+	const struct s3 *y = *(struct s3 * const *)b;
+
+	return (x->key < y->key ? -1 : x->key > y->key);
+}
+
+/* Rank and select agree with sorted keys, values follow the entries */
+static void
+test_count_flags(int *keys, int n, int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	struct thm_head vhead;
+	THM_HEAD(s3_map) head;
+	THM_BUCKET(s3_map) *bucket;
+
+	struct s3 *ep, *elist, **sorted;
+	uintptr_t value;
+	int i, m, step;
+
+	elist = malloc(sizeof(struct s3) * n);
+	sorted = malloc(sizeof(struct s3 *) * n);
+	/* Rank walks leaves of an entry, check a few hundred odd keys */
+	step = n / 256 * 2 + 2;
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT_FLAGS(s3_map, &head, &pool, THM_HEAD_WIDE |
+	    THM_HEAD_COUNT | flags);
+	/* Counts are kept in the wide root, heads get one without asking */
+	assert(thm_head_init_flags(&vhead, &pool, 0, THM_HEAD_SKEY |
+	    THM_HEAD_COUNT) == EINVAL);
+	assert(thm_head_init_flags(&vhead, &pool, 0, THM_HEAD_KEY64 |
+	    THM_HEAD_VALUE | THM_HEAD_COUNT | flags) == 0);
+	assert((vhead.th_flags & THM_HEAD_WIDE) != 0);
+
+	assert(thm_count(&vhead) == 0 && thm_vselect(&vhead, 0, NULL) == 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Runs of consecutive keys end up in dense tables */
+		if ((flags & THM_HEAD_DENSE) != 0)
+			ep->key = ((uint64_t)((uint32_t)keys[i / 4096 * 4096] %
+			    5) << 60) | (uint32_t)i;
+		else
+			ep->key = ((uint64_t)(uint32_t)keys[i] << 32) |
+			    (uint32_t)i;
+		sorted[i] = ep;
+		while (THM_INSERT(s3_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&vhead, ep->key,
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+	qsort(sorted, n, sizeof(struct s3 *), key_cmp_s3);
+
+	assert(THM_COUNT(s3_map, &head) == (u_long)n);
+	for (i = 0; i < n; i += step) {
+		ep = sorted[i];
+		assert(THM_RANK(s3_map, &head, ep->key) == (u_long)i);
+		assert(thm_rank(&vhead, ep->key + 1) == (u_long)i + 1);
+		assert(THM_RANK(s3_map, &head, ep->key + 1) == (u_long)i + 1);
+		bucket = THM_SELECT(s3_map, &head, i, &cursor);
+		assert(THM_BUCKET_FIRST(s3_map, bucket) == ep);
+		value = thm_vselect(&vhead, i, NULL);
+		assert(thm_value_to_int(value) == (uint64_t)(ep - elist));
+		m = i + 100 < n ? i + 100 : n - 1;
+		assert(thm_count_range(&vhead, ep->key, sorted[m]->key) ==
+		    (u_long)(m - i + 1));
+	}
+	assert(THM_SELECT(s3_map, &head, n, NULL) == NULL);
+	assert(thm_count_range(&vhead, 0, UINT64_MAX) == (u_long)n);
+
+	for (i = 0; i < n; i += 2) {
+		THM_REMOVE(s3_map, &head, sorted[i]);
+		assert(thm_vremove(&vhead, sorted[i]->key) != 0);
+	}
+	for (i = 1; i < n; i += step) {
+		ep = sorted[i];
+		assert(THM_RANK(s3_map, &head, ep->key) == (u_long)i / 2);
+		assert(thm_rank(&vhead, ep->key) == (u_long)i / 2);
+		value = thm_vselect(&vhead, i / 2, &cursor);
+		assert(thm_value_to_int(value) == (uint64_t)(ep - elist));
+	}
+	assert(thm_count(&vhead) == (u_long)n / 2);
+
+	for (i = 1; i < n; i += 2) {
+		THM_REMOVE(s3_map, &head, sorted[i]);
+		assert(thm_vremove(&vhead, sorted[i]->key) != 0);
+	}
+	assert(THM_EMPTY(s3_map, &head));
+	assert(thm_empty(&vhead));
+
+	THM_HEAD_DESTROY(s3_map, &head);
+	thm_head_destroy(&vhead);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+	free(sorted);
+}
+
+static void
+test_count(int *keys, int n)
+{
+	test_count_flags(keys, n, 0);
+	test_count_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_DENSE);
+}
+
+static uint64_t
+test_aggr_sum_value(struct thm_bucket *bucket)
+{
+	struct s7 *ep;
+	uint64_t sum = 0;
+
+	THM_BUCKET_FOREACH(s7_map, ep, (THM_BUCKET(s7_map) *)bucket)
+		sum += ep->val;
+	return (sum);
+}
+
+static uint64_t
+test_aggr_sum(uint64_t a, uint64_t b)
+{
+	return (a + b);
+}
+
+static uint64_t
+test_aggr_max_value(struct thm_bucket *bucket)
+{
+	return (thm_value_to_int((uintptr_t)bucket));
+}
+
+static uint64_t
+test_aggr_max(uint64_t a, uint64_t b)
+{
+	return (a > b ? a : b);
+}
+
+static const struct thm_aggr test_aggr_sum_ops = {
+	0, test_aggr_sum_value, test_aggr_sum
+};
+
+static const struct thm_aggr test_aggr_max_ops = {
+	0, test_aggr_max_value, test_aggr_max
+};
+
+static int
+key_cmp_s7(const void *a, const void *b)
+{
+	const struct s7 *x = *(struct s7 * const *)a;
+	const struct s7 *y = *(struct s7 * const *)b;
+
+	return (x->key < y->key ? -1 : x->key > y->key);
+}
+
+/* Range sums and maxima agree with sorted keys, bucket sums in bsum */
+static void
+test_aggr_check(THM_HEAD(s7_map) *head, struct thm_head *vhead,
+    struct s7 **sorted, uint64_t *bsum, int n, int step)
+{
+	uint64_t max, sum;
+	int i, j, m;
+
+	for (i = 0; i < n; i += step) {
+		m = i + 100 < n ? i + 100 : n - 1;
+		for (j = i, sum = 0, max = 0; j <= m; j++) {
+			sum += bsum[j];
+			if (sorted[j]->val > max)
+				max = sorted[j]->val;
+		}
+		assert(THM_AGGREGATE(s7_map, head, sorted[i]->key,
+		    sorted[m]->key) == sum);
+		assert(thm_aggregate(vhead, sorted[i]->key,
+		    sorted[m]->key) == max);
+		if (m > i)
+			assert(THM_AGGREGATE(s7_map, head, sorted[i]->key + 1,
+			    sorted[m]->key - 1) == sum - bsum[i] - bsum[m]);
+	}
+	for (j = 0, sum = 0; j < n; j++)
+		sum += bsum[j];
+	assert(THM_AGGREGATE(s7_map, head, 0, UINT64_MAX) == sum);
+}
+
+/* Aggregates follow inserts, duplicates, updates and removes */
+static void
+test_aggr_flags(int *keys, int n, int flags)
+{
+	struct thm_pool pool;
+	struct thm_head vhead;
+	THM_HEAD(s7_map) head;
+
+	struct s7 *ep, *elist, *dlist, **sorted;
+	uint64_t *bsum;
+	int i, j, step;
+
+	elist = malloc(sizeof(struct s7) * n);
+	dlist = malloc(sizeof(struct s7) * n);
+	sorted = malloc(sizeof(struct s7 *) * n);
+	bsum = malloc(sizeof(uint64_t) * n);
+	step = n / 256 * 2 + 2;
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	/* Summaries need the ops, plain init can't set them up */
+	assert(thm_head_init_flags(&vhead, &pool, 0, THM_HEAD_KEY64 |
+	    THM_HEAD_VALUE | THM_HEAD_AGGR) == EINVAL);
+	assert(thm_head_init_flags(&vhead, &pool, 0, THM_HEAD_KEY64 |
+	    THM_HEAD_VALUE | THM_HEAD_DIGEST) == EINVAL);
+	assert(thm_head_init_aggr(&vhead, &pool, 0, THM_HEAD_KEY64 |
+	    THM_HEAD_VALUE, NULL) == EINVAL);
+
+	THM_HEAD_INIT_AGGR(s7_map, &head, &pool, THM_HEAD_WIDE | flags,
+	    &test_aggr_sum_ops);
+	thm_head_init_aggr(&vhead, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    flags, &test_aggr_max_ops);
+
+	assert(THM_AGGREGATE(s7_map, &head, 0, UINT64_MAX) == 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		if ((flags & THM_HEAD_DENSE) != 0)
+			ep->key = ((uint64_t)((uint32_t)keys[i / 4096 * 4096] %
+			    5) << 60) | (uint32_t)i;
+		else
+			ep->key = ((uint64_t)(uint32_t)keys[i] << 32) |
+			    (uint32_t)i;
+		ep->val = (uint32_t)keys[i] % 1000 + 1;
+		sorted[i] = ep;
+		while (THM_INSERT(s7_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&vhead, ep->key,
+		    thm_value_from_int(ep->val)) != 0)
+			thm_pool_new_block(&pool);
+		/* Every 8th key has a duplicate in the bucket */
+		if (i % 8 == 0) {
+			dlist[i].key = ep->key;
+			dlist[i].val = 7;
+			while (THM_INSERT(s7_map, &head, &dlist[i]) == NULL)
+				thm_pool_new_block(&pool);
+		}
+	}
+	qsort(sorted, n, sizeof(struct s7 *), key_cmp_s7);
+
+	for (i = 0; i < n; i++) {
+		j = sorted[i] - elist;
+		bsum[i] = sorted[i]->val + (j % 8 == 0 ? dlist[j].val : 0);
+	}
+	test_aggr_check(&head, &vhead, sorted, bsum, n, step);
+
+	/* Values changed in place, value head through overwrite */
+	for (i = 0; i < n; i += 3) {
+		ep = sorted[i];
+		ep->val += 5;
+		bsum[i] += 5;
+		THM_AGGR_UPDATE(s7_map, &head, ep->key);
+		assert(thm_vinsert(&vhead, ep->key,
+		    thm_value_from_int(ep->val)) == 0);
+	}
+	test_aggr_check(&head, &vhead, sorted, bsum, n, step);
+
+	for (i = 0; i < n; i += 8)
+		THM_REMOVE(s7_map, &head, &dlist[i]);
+	for (i = 0; i < n; i++)
+		bsum[i] = sorted[i]->val;
+	test_aggr_check(&head, &vhead, sorted, bsum, n, step);
+
+	for (i = 0, j = 0; i < n; i++) {
+		if (i % 2 == 0) {
+			THM_REMOVE(s7_map, &head, sorted[i]);
+			assert(thm_vremove(&vhead, sorted[i]->key) != 0);
+		} else
+			sorted[j++] = sorted[i];
+	}
+	for (i = 0; i < j; i++)
+		bsum[i] = sorted[i]->val;
+	test_aggr_check(&head, &vhead, sorted, bsum, j, step);
+
+	for (i = 0; i < j; i++) {
+		THM_REMOVE(s7_map, &head, sorted[i]);
+		assert(thm_vremove(&vhead, sorted[i]->key) != 0);
+	}
+	assert(THM_EMPTY(s7_map, &head));
+	assert(THM_AGGREGATE(s7_map, &head, 0, UINT64_MAX) == 0);
+	assert(thm_aggregate(&vhead, 0, UINT64_MAX) == 0);
+
+	THM_HEAD_DESTROY(s7_map, &head);
+	thm_head_destroy(&vhead);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+	free(dlist);
+	free(sorted);
+	free(bsum);
+}
+
+static void
+test_aggr(int *keys, int n)
+{
+	test_aggr_flags(keys, n, 0);
+	test_aggr_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_DENSE);
+}
+
+static uint64_t
+test_digest_s7(struct thm_bucket *bucket)
+{
+	struct s7 *ep;
+	uint64_t d = 0;
+
+	THM_BUCKET_FOREACH(s7_map, ep, (THM_BUCKET(s7_map) *)bucket)
+		d += ep->val;
+	return (d);
+}
+
+#define	TEST_DIGEST_CHANGES	10
+
+struct test_ranges {
+	uint64_t	lo[TEST_DIGEST_CHANGES];
+	uint64_t	hi[TEST_DIGEST_CHANGES];
+	int		n;
+};
+
+static void
+test_digest_range_cb(void *arg, uint64_t lo, uint64_t hi)
+{
+	struct test_ranges *tr = arg;
+
+	assert(tr->n < TEST_DIGEST_CHANGES && lo <= hi);
+	assert(tr->n == 0 || tr->hi[tr->n - 1] < lo);
+	tr->lo[tr->n] = lo;
+	tr->hi[tr->n] = hi;
+	tr->n++;
+}
+
+/* Heads of different shape with the same keys have the same digests */
+static void
+test_digest(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_head a, b;
+	struct test_ranges tr;
+	THM_HEAD(s7_map) head;
+
+	struct s7 *ep, *elist;
+	uint64_t changed[TEST_DIGEST_CHANGES], d, key, lo, hi;
+	int i, j, k, nchanged, step;
+
+	elist = malloc(sizeof(struct s7) * n);
+	step = n / TEST_DIGEST_CHANGES + 1;
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	thm_head_init_digest(&a, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	thm_head_init_digest(&b, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    THM_HEAD_STRIDE4 | THM_HEAD_DENSE, NULL);
+	THM_HEAD_INIT_DIGEST(s7_map, &head, &pool, THM_HEAD_WIDE,
+	    test_digest_s7);
+
+	assert(thm_digest(&a) == 0);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		ep->key = ((uint64_t)(uint32_t)keys[i] << 32) | (uint32_t)i;
+		ep->val = (uint32_t)keys[i] % 1000;
+		while (thm_vinsert(&a, ep->key,
+		    thm_value_from_int(ep->val)) != 0)
+			thm_pool_new_block(&pool);
+		ep = &elist[n - 1 - i];
+		ep->key = ((uint64_t)(uint32_t)keys[n - 1 - i] << 32) |
+		    (uint32_t)(n - 1 - i);
+		while (thm_vinsert(&b, ep->key,
+		    thm_value_from_int((uint32_t)keys[n - 1 - i] % 1000)) != 0)
+			thm_pool_new_block(&pool);
+		while (THM_INSERT(s7_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	assert(thm_digest(&a) == thm_digest(&b));
+	memset(&tr, 0, sizeof(tr));
+	assert(thm_digest_cmp(&a, &b, test_digest_range_cb, &tr) == 0);
+	for (i = 0; i < n; i += step) {
+		lo = elist[i].key;
+		hi = elist[(i + step) % n].key;
+		assert(thm_digest_range(&a, lo, hi) ==
+		    thm_digest_range(&b, lo, hi));
+		assert(thm_digest_range(&a, lo + 1, hi - 1) ==
+		    thm_digest_range(&b, lo + 1, hi - 1));
+	}
+
+	/* Remove from a, change in b, add to b */
+	for (i = 0, nchanged = 0; i < n; i += step, nchanged++) {
+		ep = &elist[i];
+		switch (nchanged % 3) {
+		case 0:
+			changed[nchanged] = ep->key;
+			assert(thm_vremove(&a, ep->key) != 0);
+			break;
+		case 1:
+			changed[nchanged] = ep->key;
+			assert(thm_vinsert(&b, ep->key,
+			    thm_value_from_int(ep->val + 1)) == 0);
+			break;
+		default:
+			changed[nchanged] = ep->key | 0x80000000;
+			while (thm_vinsert(&b, changed[nchanged],
+			    thm_value_from_int(1)) != 0)
+				thm_pool_new_block(&pool);
+			break;
+		}
+	}
+	assert(thm_digest(&a) != thm_digest(&b));
+	memset(&tr, 0, sizeof(tr));
+	k = thm_digest_cmp(&a, &b, test_digest_range_cb, &tr);
+	assert(k == tr.n && k > 0 && k <= nchanged);
+	for (j = 0; j < nchanged; j++) {
+		for (k = 0; k < tr.n; k++) {
+			if (changed[j] >= tr.lo[k] && changed[j] <= tr.hi[k])
+				break;
+		}
+		assert(k < tr.n);
+	}
+	for (k = 0; k < tr.n; k++)
+		assert(thm_digest_range(&a, tr.lo[k], tr.hi[k]) !=
+		    thm_digest_range(&b, tr.lo[k], tr.hi[k]));
+
+	/* Undo */
+	for (i = 0, j = 0; i < n; i += step, j++) {
+		ep = &elist[i];
+		if (j % 3 == 2)
+			assert(thm_vremove(&b, changed[j]) != 0);
+		else
+			assert(thm_vinsert(j % 3 == 0 ? &a : &b, ep->key,
+			    thm_value_from_int(ep->val)) == 0);
+	}
+	assert(thm_digest(&a) == thm_digest(&b));
+	assert(thm_digest_cmp(&a, &b, test_digest_range_cb, &tr) == 0);
+
+	/* Entry changed in place */
+	d = THM_DIGEST(s7_map, &head);
+	key = elist[n / 2].key;
+	elist[n / 2].val++;
+	THM_DIGEST_UPDATE(s7_map, &head, key);
+	assert(THM_DIGEST(s7_map, &head) != d);
+	assert(THM_DIGEST_RANGE(s7_map, &head, 0, key - 1) +
+	    THM_DIGEST_RANGE(s7_map, &head, key, UINT64_MAX) ==
+	    THM_DIGEST(s7_map, &head));
+	elist[n / 2].val--;
+	THM_DIGEST_UPDATE(s7_map, &head, key);
+	assert(THM_DIGEST(s7_map, &head) == d);
+
+	for (i = 0; i < n; i++) {
+		THM_REMOVE(s7_map, &head, &elist[i]);
+		assert(thm_vremove(&a, elist[i].key) != 0);
+		assert(thm_vremove(&b, elist[i].key) != 0);
+	}
+	assert(thm_digest(&a) == 0 && thm_digest(&b) == 0);
+	assert(THM_DIGEST(s7_map, &head) == 0);
+
+	THM_HEAD_DESTROY(s7_map, &head);
+	thm_head_destroy(&a);
+	thm_head_destroy(&b);
+
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+#define	TEST_DIFF_CHANGES	10
+
+struct test_diff {
+	uint64_t	key[TEST_DIFF_CHANGES];
+	int		side[TEST_DIFF_CHANGES];	/* 1 a, 2 b, 3 both */
+	int		n;
+};
+
+static void
+test_diff_cb(void *arg, uint64_t key, struct thm_bucket *a,
+    struct thm_bucket *b)
+{
+	struct test_diff *td = arg;
+
+	assert(td->n < TEST_DIFF_CHANGES && (a != NULL || b != NULL));
+	assert(td->n == 0 || td->key[td->n - 1] < key);
+	td->key[td->n] = key;
+	td->side[td->n] = (a != NULL) | (b != NULL) << 1;
+	td->n++;
+}
+
+static int
+test_diff_eq_s7(struct thm_bucket *a, struct thm_bucket *b)
+{
+	return (THM_BUCKET_FIRST(s7_map, (THM_BUCKET(s7_map) *)a)->val ==
+	    THM_BUCKET_FIRST(s7_map, (THM_BUCKET(s7_map) *)b)->val);
+}
+
+static void
+test_diff_check(struct thm_head *a, struct thm_head *b, thm_bucket_eq_t *eq,
+    uint64_t *changed, int *side, int nchanged)
+{
+	struct test_diff td;
+	int j, k;
+
+	memset(&td, 0, sizeof(td));
+	assert(thm_diff(a, b, eq, test_diff_cb, &td) == (u_long)nchanged);
+	assert(td.n == nchanged);
+	for (j = 0; j < nchanged; j++) {
+		for (k = 0; k < td.n; k++) {
+			if (td.key[k] == changed[j])
+				break;
+		}
+		assert(k < td.n && td.side[k] == side[j]);
+	}
+}
+
+/* Changes between heads of different shape are found in key order */
+static void
+test_diff(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_head a, b, c, sa, sb;
+	THM_HEAD(s7_map) ha, hb;
+
+	struct s7 *ea, *eb;
+	uint64_t changed[TEST_DIFF_CHANGES], schanged[TEST_DIFF_CHANGES];
+	uint64_t key;
+	int i, j, side[TEST_DIFF_CHANGES], sside[TEST_DIFF_CHANGES], step;
+
+	ea = malloc(sizeof(struct s7) * (n + TEST_DIFF_CHANGES));
+	eb = malloc(sizeof(struct s7) * n);
+	step = n / TEST_DIFF_CHANGES + 1;
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	/* Digest heads skip equal ranges, c has another stride */
+	thm_head_init_digest(&a, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE, NULL);
+	thm_head_init_digest(&b, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    THM_HEAD_WIDE | THM_HEAD_DENSE, NULL);
+	thm_head_init_flags(&c, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE |
+	    THM_HEAD_STRIDE4);
+	thm_head_init_flags(&sa, &pool, 0, THM_HEAD_SET);
+	thm_head_init_flags(&sb, &pool, 0, THM_HEAD_SET | THM_HEAD_DENSE);
+	THM_HEAD_INIT_FLAGS(s7_map, &ha, &pool, THM_HEAD_WIDE);
+	THM_HEAD_INIT(s7_map, &hb, &pool);
+
+	for (i = 0; i < n; i++) {
+		ea[i].key = ((uint64_t)(uint32_t)keys[i] << 32) | (uint32_t)i;
+		ea[i].val = (uint32_t)keys[i] % 1000;
+		eb[i] = ea[i];
+		while (thm_vinsert(&a, ea[i].key,
+		    thm_value_from_int(ea[i].val)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&b, ea[i].key,
+		    thm_value_from_int(ea[i].val)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&c, ea[i].key,
+		    thm_value_from_int(ea[i].val)) != 0)
+			thm_pool_new_block(&pool);
+		while (THM_INSERT(s7_map, &ha, &ea[i]) == NULL)
+			thm_pool_new_block(&pool);
+		while (THM_INSERT(s7_map, &hb, &eb[i]) == NULL)
+			thm_pool_new_block(&pool);
+		while (thm_set_add(&sa, (uint64_t)i * 13) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_set_add(&sb, (uint64_t)i * 13) != 0)
+			thm_pool_new_block(&pool);
+	}
+
+	test_diff_check(&a, &b, NULL, changed, side, 0);
+	test_diff_check(&b, &c, NULL, changed, side, 0);
+	test_diff_check(&sa, &sb, NULL, changed, side, 0);
+	test_diff_check(&ha.s7_map_head, &hb.s7_map_head, test_diff_eq_s7,
+	    changed, side, 0);
+
+	/* Remove from a, change in b, add to a */
+	for (i = 0, j = 0; i < n; i += step, j++) {
+		key = ea[i].key;
+		schanged[j] = (uint64_t)i * 13;
+		switch (j % 3) {
+		case 0:
+			changed[j] = key;
+			side[j] = 2;
+			assert(thm_vremove(&a, key) != 0);
+			THM_REMOVE(s7_map, &ha, &ea[i]);
+			sside[j] = 2;
+			assert(thm_set_remove(&sa, schanged[j]) != 0);
+			break;
+		case 1:
+			changed[j] = key;
+			side[j] = 3;
+			assert(thm_vinsert(&b, key,
+			    thm_value_from_int(ea[i].val + 1)) == 0);
+			assert(thm_vinsert(&c, key,
+			    thm_value_from_int(ea[i].val + 1)) == 0);
+			eb[i].val++;
+			schanged[j]++;
+			sside[j] = 2;
+			while (thm_set_add(&sb, schanged[j]) != 0)
+				thm_pool_new_block(&pool);
+			break;
+		default:
+			changed[j] = key | 0x80000000;
+			side[j] = 1;
+			while (thm_vinsert(&a, changed[j],
+			    thm_value_from_int(1)) != 0)
+				thm_pool_new_block(&pool);
+			ea[n + j].key = changed[j];
+			ea[n + j].val = 1;
+			while (THM_INSERT(s7_map, &ha, &ea[n + j]) == NULL)
+				thm_pool_new_block(&pool);
+			schanged[j] += 2;
+			sside[j] = 1;
+			while (thm_set_add(&sa, schanged[j]) != 0)
+				thm_pool_new_block(&pool);
+			break;
+		}
+	}
+	test_diff_check(&a, &b, NULL, changed, side, j);
+	test_diff_check(&a, &c, NULL, changed, side, j);
+	test_diff_check(&sa, &sb, NULL, schanged, sside, j);
+	test_diff_check(&ha.s7_map_head, &hb.s7_map_head, test_diff_eq_s7,
+	    changed, side, j);
+	for (i = 0; i < j; i++)
+		side[i] = side[i] == 3 ? 3 : 3 - side[i];
+	test_diff_check(&b, &a, NULL, changed, side, j);
+
+	/* Undo */
+	for (i = 0, j = 0; i < n; i += step, j++) {
+		switch (j % 3) {
+		case 0:
+			while (thm_vinsert(&a, ea[i].key,
+			    thm_value_from_int(ea[i].val)) != 0)
+				thm_pool_new_block(&pool);
+			while (THM_INSERT(s7_map, &ha, &ea[i]) == NULL)
+				thm_pool_new_block(&pool);
+			while (thm_set_add(&sa, schanged[j]) != 0)
+				thm_pool_new_block(&pool);
+			break;
+		case 1:
+			assert(thm_vinsert(&b, ea[i].key,
+			    thm_value_from_int(ea[i].val)) == 0);
+			assert(thm_vinsert(&c, ea[i].key,
+			    thm_value_from_int(ea[i].val)) == 0);
+			eb[i].val--;
+			assert(thm_set_remove(&sb, schanged[j]) != 0);
+			break;
+		default:
+			assert(thm_vremove(&a, changed[j]) != 0);
+			THM_REMOVE(s7_map, &ha, &ea[n + j]);
+			assert(thm_set_remove(&sa, schanged[j]) != 0);
+			break;
+		}
+	}
+	test_diff_check(&a, &b, NULL, changed, side, 0);
+	test_diff_check(&a, &c, NULL, changed, side, 0);
+	test_diff_check(&sa, &sb, NULL, changed, side, 0);
+	test_diff_check(&ha.s7_map_head, &hb.s7_map_head, test_diff_eq_s7,
+	    changed, side, 0);
+
+	for (i = 0; i < n; i++) {
+		assert(thm_vremove(&a, ea[i].key) != 0);
+		assert(thm_vremove(&b, ea[i].key) != 0);
+		assert(thm_vremove(&c, ea[i].key) != 0);
+		THM_REMOVE(s7_map, &ha, &ea[i]);
+		THM_REMOVE(s7_map, &hb, &eb[i]);
+		assert(thm_set_remove(&sa, (uint64_t)i * 13) != 0);
+		assert(thm_set_remove(&sb, (uint64_t)i * 13) != 0);
+	}
+	assert(thm_empty(&a) && thm_empty(&b) && thm_empty(&c));
+
+	THM_HEAD_DESTROY(s7_map, &ha);
+	THM_HEAD_DESTROY(s7_map, &hb);
+	thm_head_destroy(&a);
+	thm_head_destroy(&b);
+	thm_head_destroy(&c);
+	thm_head_destroy(&sa);
+	thm_head_destroy(&sb);
+
+	thm_pool_destroy(&pool);
+
+	free(ea);
+	free(eb);
+}
+
+#define	TEST_SETOP_INTERSECT	0
+#define	TEST_SETOP_UNION	1
+#define	TEST_SETOP_DIFFERENCE	2
+
+struct test_setop {
+	struct thm_pool	*pool;
+	struct thm_head	*out;
+	uint64_t	last;
+	u_long		n;
+	int		op;
+};
+
+static int
+test_setop_in(int op, int ina, int inb)
+{
+	switch (op) {
+	case TEST_SETOP_INTERSECT:
+		return (ina && inb);
+	case TEST_SETOP_UNION:
+		return (ina || inb);
+	default:
+		return (ina && !inb);
+	}
+}
+
+/* Result goes to a set head */
+static void
+test_setop_cb(void *arg, uint64_t key, struct thm_bucket *a,
+    struct thm_bucket *b)
+{
+	struct test_setop *ts = arg;
+
+	assert(test_setop_in(ts->op, a != NULL, b != NULL));
+	assert(ts->n == 0 || ts->last < key);
+	ts->last = key;
+	ts->n++;
+	while (thm_set_add(ts->out, key) != 0)
+		thm_pool_new_block(ts->pool);
+}
+
+/* Result of a and b matches members of sets sa and sb */
+static void
+test_setop_check(struct thm_head *a, struct thm_head *b, struct thm_head *sa,
+    struct thm_head *sb, int op, uint64_t *skeys, int n,
+    struct thm_pool *pool)
+{
+	struct thm_cursor cursor;
+	struct thm_head out;
+	struct test_setop ts;
+	uint64_t key;
+	u_long count;
+	int i;
+
+	thm_head_init_flags(&out, pool, 0, THM_HEAD_SET);
+	memset(&ts, 0, sizeof(ts));
+	ts.pool = pool;
+	ts.out = &out;
+	ts.op = op;
+
+	switch (op) {
+	case TEST_SETOP_INTERSECT:
+		count = thm_intersect(a, b, test_setop_cb, &ts);
+		break;
+	case TEST_SETOP_UNION:
+		count = thm_union(a, b, test_setop_cb, &ts);
+		break;
+	default:
+		count = thm_difference(a, b, test_setop_cb, &ts);
+		break;
+	}
+	assert(count == ts.n);
+
+	for (i = 0; i < n; i++)
+		assert(thm_set_member(&out, skeys[i]) == test_setop_in(op,
+		    thm_set_member(sa, skeys[i]), thm_set_member(sb, skeys[i])));
+	for (; thm_set_first(&out, &cursor, &key) != 0; count--) {
+		assert(test_setop_in(op, thm_set_member(sa, key),
+		    thm_set_member(sb, key)));
+		assert(thm_set_remove(&out, key));
+	}
+	assert(count == 0);
+
+	thm_head_destroy(&out);
+}
+
+/* Set operations on set and value heads of different shape */
+static void
+test_setop(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_head sa, sb, va, vb, vc;
+	uint64_t *skeys;
+	int i, op;
+
+	skeys = malloc(sizeof(uint64_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_head_init_flags(&sa, &pool, 0, THM_HEAD_SET);
+	thm_head_init_flags(&sb, &pool, 0, THM_HEAD_SET | THM_HEAD_DENSE);
+	thm_head_init_flags(&va, &pool, 0, THM_HEAD_VALUE);
+	thm_head_init_flags(&vb, &pool, 0, THM_HEAD_VALUE | THM_HEAD_WIDE);
+	thm_head_init_flags(&vc, &pool, 0, THM_HEAD_VALUE | THM_HEAD_STRIDE4);
+
+	/* Half of the keys are dense to fill bitmaps, a and b overlap */
+	for (i = 0; i < n; i++) {
+		skeys[i] = (uint32_t)keys[i] & THM_KEY_MASK;
+		if (i % 2 == 1)
+			skeys[i] &= 0xfff;
+		if (i % 3 != 0) {
+			while (thm_set_add(&sa, skeys[i]) != 0)
+				thm_pool_new_block(&pool);
+			while (thm_vinsert(&va, skeys[i],
+			    thm_value_from_int(i)) != 0)
+				thm_pool_new_block(&pool);
+		}
+		if (i % 4 != 1) {
+			while (thm_set_add(&sb, skeys[i]) != 0)
+				thm_pool_new_block(&pool);
+			while (thm_vinsert(&vb, skeys[i],
+			    thm_value_from_int(i)) != 0)
+				thm_pool_new_block(&pool);
+			while (thm_vinsert(&vc, skeys[i],
+			    thm_value_from_int(i)) != 0)
+				thm_pool_new_block(&pool);
+		}
+	}
+
+	for (op = TEST_SETOP_INTERSECT; op <= TEST_SETOP_DIFFERENCE; op++) {
+		test_setop_check(&sa, &sb, &sa, &sb, op, skeys, n, &pool);
+		test_setop_check(&sb, &sa, &sb, &sa, op, skeys, n, &pool);
+		test_setop_check(&va, &vb, &sa, &sb, op, skeys, n, &pool);
+		test_setop_check(&va, &vc, &sa, &sb, op, skeys, n, &pool);
+		test_setop_check(&sa, &sa, &sa, &sa, op, skeys, n, &pool);
+	}
+
+	for (i = 0; i < n; i++) {
+		thm_set_remove(&sa, skeys[i]);
+		thm_set_remove(&sb, skeys[i]);
+		thm_vremove(&va, skeys[i]);
+		thm_vremove(&vb, skeys[i]);
+		thm_vremove(&vc, skeys[i]);
+	}
+	assert(thm_empty(&sa) && thm_empty(&sb));
+	assert(thm_empty(&va) && thm_empty(&vb) && thm_empty(&vc));
+
+	thm_head_destroy(&sa);
+	thm_head_destroy(&sb);
+	thm_head_destroy(&va);
+	thm_head_destroy(&vb);
+	thm_head_destroy(&vc);
+
+	thm_pool_destroy(&pool);
+
+	free(skeys);
+}
+
+/* Inlined lookup finds the same buckets as the cursor lookup */
+static void
+test_find_inline_flags(int *keys, int n, u_int flags)
+{
+	struct thm_pool pool;
+	struct thm_cursor cursor;
+	THM_HEAD(s1_map) head1;
+	THM_HEAD(s3_map) head3;
+	struct s1 *elist1;
+	struct s3 *elist3;
+	uint64_t key;
+	int i;
+
+	elist1 = malloc(sizeof(struct s1) * n);
+	elist3 = malloc(sizeof(struct s3) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	THM_HEAD_INIT_FLAGS(s1_map, &head1, &pool, flags & ~THM_HEAD_DENSE);
+	THM_HEAD_INIT_FLAGS(s3_map, &head3, &pool, flags);
+
+	for (i = 0; i < n; i++) {
+		elist1[i].key = keys[i];
+		elist3[i].key = test_dense_key(keys, i);
+		while (THM_INSERT(s1_map, &head1, &elist1[i]) == NULL)
+			thm_pool_new_block(&pool);
+		while (THM_INSERT(s3_map, &head3, &elist3[i]) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	for (i = 0; i < n; i++) {
+		assert(THM_FIND(s1_map, &head1, elist1[i].key, NULL) ==
+		    THM_FIND(s1_map, &head1, elist1[i].key, &cursor));
+		assert(THM_FIND(s3_map, &head3, elist3[i].key, NULL) ==
+		    THM_FIND(s3_map, &head3, elist3[i].key, &cursor));
+		assert(THM_FIND(s3_map, &head3, elist3[i].key, NULL) != NULL);
+
+		/* Misses in every slot kind, including high key bits */
+		key = elist3[i].key ^ ((uint64_t)1 << (i % 64));
+		assert(THM_FIND(s3_map, &head3, key, NULL) ==
+		    THM_FIND(s3_map, &head3, key, &cursor));
+		key = (uint32_t)keys[i] ^ ((uint32_t)1 << (i % 32));
+		assert(THM_FIND(s1_map, &head1, key, NULL) ==
+		    THM_FIND(s1_map, &head1, key, &cursor));
+	}
+
+	for (i = 0; i < n; i++) {
+		THM_REMOVE(s1_map, &head1, &elist1[i]);
+		THM_REMOVE(s3_map, &head3, &elist3[i]);
+		assert(THM_FIND(s3_map, &head3, elist3[i].key, NULL) == NULL);
+	}
+	assert(THM_EMPTY(s1_map, &head1));
+	assert(THM_EMPTY(s3_map, &head3));
+
+	THM_HEAD_DESTROY(s1_map, &head1);
+	THM_HEAD_DESTROY(s3_map, &head3);
+	thm_pool_destroy(&pool);
+
+	free(elist1);
+	free(elist3);
+}
+
+__unused static void
+test_find_inline(int *keys, int n)
+{
+	test_find_inline_flags(keys, n, 0);
+	test_find_inline_flags(keys, n, THM_HEAD_STRIDE4 | THM_HEAD_FPRINT);
+	test_find_inline_flags(keys, n,
+	    THM_HEAD_STRIDE4 | THM_HEAD_WIDE | THM_HEAD_DENSE | THM_HEAD_FPRINT);
+}
+
+/* Hashed heads resolve hash collisions by key, duplicate keys don't go in */
+__unused static void
+test_hash(int *keys, int n)
+{
+	struct thm_pool pool;
+	THM_HEAD(s6_map) head;
+	THM_HEAD(s6_map2) head2;
+	struct s6 *ep, *elist;
+	char buf[THM_SLOT_SIZE * 3];
+	int i, count;
+
+	elist = malloc(sizeof(struct s6) * n);
+
+	/* Hash doesn't depend on alignment, trailing zeros change it */
+	for (i = 0; i < (int)sizeof(buf); i++)
+		buf[i] = i * 7;
+	for (i = 1; i < THM_SLOT_SIZE; i++) {
+		assert(thm_hash_bytes(buf, THM_SLOT_SIZE + i) ==
+		    thm_hash_bytes(memcpy(buf + THM_SLOT_SIZE + 1, buf,
+		    THM_SLOT_SIZE + i), THM_SLOT_SIZE + i));
+		memset(buf, 0, sizeof(buf));
+		assert(thm_hash_bytes(buf, i) != thm_hash_bytes(buf, i + 1));
+	}
+
+	/* About four keys per hash in the second head */
+	test_hash_buckets = n / 4 + 1;
+
+	thm_pool_init(&pool, "thashmap-test");
+	THM_HEAD_INIT(s6_map, &head, &pool);
+	THM_HEAD_INIT(s6_map2, &head2, &pool);
+
+	count = 0;
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		snprintf(ep->key, sizeof(ep->key), "%d", keys[i]);
+		while ((ep = THM_HINSERT(s6_map, &head, &elist[i],
+		    elist[i].key)) == NULL)
+			thm_pool_new_block(&pool);
+		if (ep != &elist[i]) {
+			/* Duplicate key, keep it out of both heads */
+			assert(strcmp(ep->key, elist[i].key) == 0);
+			elist[i].key[0] = '\0';
+			continue;
+		}
+		while ((ep = THM_HINSERT(s6_map2, &head2, &elist[i],
+		    elist[i].key)) == NULL)
+			thm_pool_new_block(&pool);
+		assert(ep == &elist[i]);
+		count++;
+	}
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		if (ep->key[0] == '\0')
+			continue;
+		assert(THM_HFIND(s6_map, &head, ep->key) == ep);
+		assert(THM_HFIND(s6_map2, &head2, ep->key) == ep);
+	}
+	assert(THM_HFIND(s6_map, &head, "x") == NULL);
+	assert(THM_HFIND(s6_map2, &head2, "1x") == NULL);
+
+	for (i = 0; i < n; i += 2) {
+		ep = &elist[i];
+		if (ep->key[0] == '\0')
+			continue;
+		assert(THM_HREMOVE(s6_map, &head, ep->key) == ep);
+		assert(THM_HREMOVE(s6_map2, &head2, ep->key) == ep);
+		assert(THM_HREMOVE(s6_map2, &head2, ep->key) == NULL);
+		count--;
+	}
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		if (ep->key[0] == '\0')
+			continue;
+		assert((THM_HFIND(s6_map, &head, ep->key) != NULL) ==
+		    (i % 2 == 1));
+		assert((THM_HFIND(s6_map2, &head2, ep->key) != NULL) ==
+		    (i % 2 == 1));
+		if (i % 2 == 1) {
+			THM_REMOVE(s6_map, &head, ep);
+			THM_REMOVE(s6_map2, &head2, ep);
+			count--;
+		}
+	}
+	assert(count == 0);
+	assert(THM_EMPTY(s6_map, &head));
+	assert(THM_EMPTY(s6_map2, &head2));
+
+	THM_HEAD_DESTROY(s6_map, &head);
+	THM_HEAD_DESTROY(s6_map2, &head2);
+	thm_pool_destroy(&pool);
+
+	free(elist);
+}
+
+static const u_int test_lpm_lens[] = {
+	32, 31, 27, 24, 20, 18, 16, 13, 8, 6, 3, 1, 0
+};
+
+#define	TEST_LPM_NLENS		(sizeof(test_lpm_lens) / sizeof(u_int))
+
+/* Prefix as length marker bit followed by prefix bits */
+static uint64_t
+test_lpm_marker(uint32_t addr, u_int plen)
+{
+	return (((uint64_t)1 << plen) | ((uint64_t)addr >> (32 - plen)));
+}
+
+/* Longest match the slow way, one lookup per prefix length */
+static uintptr_t
+test_lpm_ref(struct thm_head *ref, uint32_t addr, u_int *plenp)
+{
+	uintptr_t value;
+	u_int i;
+
+	for (i = 0; i < TEST_LPM_NLENS; i++) {
+		value = thm_vfind(ref, test_lpm_marker(addr, test_lpm_lens[i]),
+		    NULL);
+		if (value != 0) {
+			*plenp = test_lpm_lens[i];
+			return (value);
+		}
+	}
+
+	return (0);
+}
+
+static void
+test_lpm_check(struct thm_head *head, struct thm_head *ref, uint32_t addr)
+{
+	uintptr_t value;
+	u_int plen, rplen;
+
+	value = thm_lpm(head, addr, &plen);
+	assert(value == test_lpm_ref(ref, addr, &rplen));
+	assert(value == 0 || plen == rplen);
+}
+
+/* Groups of four nested prefixes of the same address */
+__unused static void
+test_lpm(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_head head, ref;
+	uint32_t addr, *addrs;
+	u_int plen;
+	int i;
+
+	addrs = malloc(sizeof(uint32_t) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+	thm_head_init_flags(&head, &pool, 0, THM_HEAD_LPM);
+	thm_head_init_flags(&ref, &pool, 0, THM_HEAD_KEY64 | THM_HEAD_VALUE);
+
+	assert(thm_lpm(&head, 0, NULL) == 0);
+
+	for (i = 0; i < n; i++) {
+		addrs[i] = (uint32_t)keys[i / 4] * 2654435761U;
+		plen = test_lpm_lens[i % TEST_LPM_NLENS];
+		while (thm_lpm_insert(&head, addrs[i], plen,
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+		while (thm_vinsert(&ref, test_lpm_marker(addrs[i], plen),
+		    thm_value_from_int(i)) != 0)
+			thm_pool_new_block(&pool);
+	}
+
+	for (i = 0; i < n; i += 2) {
+		addr = addrs[i] ^ ((uint32_t)1 << (i % 32));
+		test_lpm_check(&head, &ref, addr);
+		if (i % 8 == 0)
+			test_lpm_check(&head, &ref, addrs[i]);
+	}
+
+	for (i = 0; i < n; i += 2) {
+		plen = test_lpm_lens[i % TEST_LPM_NLENS];
+		assert(thm_lpm_remove(&head, addrs[i], plen) ==
+		    thm_vremove(&ref, test_lpm_marker(addrs[i], plen)));
+	}
+	for (i = 0; i < n; i += 8)
+		test_lpm_check(&head, &ref, addrs[i] ^ (uint32_t)i);
+
+	for (i = 1; i < n; i += 2) {
+		plen = test_lpm_lens[i % TEST_LPM_NLENS];
+		assert(thm_lpm_remove(&head, addrs[i], plen) ==
+		    thm_vremove(&ref, test_lpm_marker(addrs[i], plen)));
+	}
+	assert(thm_empty(&head));
+	assert(thm_empty(&ref));
+
+	thm_head_destroy(&head);
+	thm_head_destroy(&ref);
+	thm_pool_destroy(&pool);
+
+	free(addrs);
+}
+
+__unused static void
+test_skey(int *keys, int n)
+{
+	struct thm_pool pool;
+	struct thm_scursor cursor, xcursor;
+	THM_HEAD(s4_map) head;
+	THM_BUCKET(s4_map) *bucket, *xbucket;
+
+	struct s4 *ep, *elist, **sorted;
+	char buf[sizeof(ep->buf) + 1];
+	int i, j;
+
+	elist = malloc(sizeof(struct s4) * n);
+	sorted = malloc(sizeof(struct s4 *) * n);
+
+	thm_pool_init(&pool, "thashmap-test");
+
+	THM_HEAD_INIT(s4_map, &head, &pool);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		/* Variable length keys, some of them prefixes of others */
+		snprintf(ep->buf, sizeof(ep->buf), "k/%x/%d",
+		    keys[i] & 0xfffff, keys[i] >> 24);
+		ep->key.tsk_data = ep->buf;
+		ep->key.tsk_len = strlen(ep->buf) - (keys[i] & 0x3);
+		sorted[i] = ep;
+		while (THM_INSERT(s4_map, &head, ep) == NULL)
+			thm_pool_new_block(&pool);
+	}
+
+	qsort(sorted, n, sizeof(struct s4 *), key_cmp_skey);
+
+	i = 0;
+	for (bucket = THM_SFIRST(s4_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_SNEXT(s4_map, &cursor)) {
+		ep = THM_BUCKET_FIRST(s4_map, bucket);
+		assert(key_cmp_skey(&ep, &sorted[i]) == 0);
+		while (i < n && key_cmp_skey(&ep, &sorted[i]) == 0)
+			i++;
+	}
+	assert(i == n);
+
+	/* Copy of the cursor walks on independently of the original */
+	bucket = THM_SFIRST(s4_map, &head, &cursor);
+	while (bucket != NULL) {
+		xcursor = cursor;
+		xbucket = THM_SNEXT(s4_map, &xcursor);
+		memset(&xcursor, 0, sizeof(xcursor));
+		bucket = THM_SNEXT(s4_map, &cursor);
+		assert(bucket == xbucket);
+	}
+
+	i = n - 1;
+	for (bucket = THM_SLAST(s4_map, &head, &cursor); bucket != NULL;
+	    bucket = THM_SPREV(s4_map, &cursor)) {
+		ep = THM_BUCKET_FIRST(s4_map, bucket);
+		assert(key_cmp_skey(&ep, &sorted[i]) == 0);
+		while (i >= 0 && key_cmp_skey(&ep, &sorted[i]) == 0)
+			i--;
+	}
+	assert(i == -1);
+
+	for (i = 0; i < n; i++) {
+		ep = sorted[i];
+		bucket = THM_SFIND(s4_map, &head, ep->key.tsk_data,
+		    ep->key.tsk_len, NULL);
+		assert(bucket != NULL);
+		assert(key_cmp_skey(&ep,
+		    &(struct s4 *){ THM_BUCKET_FIRST(s4_map, bucket) }) == 0);
+
+		/* Smallest key greater than current one */
+		memcpy(buf, ep->key.tsk_data, ep->key.tsk_len);
+		buf[ep->key.tsk_len] = '\0';
+		bucket = THM_SNFIND(s4_map, &head, buf, ep->key.tsk_len + 1,
+		    &cursor);
+		for (j = i + 1; j < n && key_cmp_skey(&ep, &sorted[j]) == 0;)
+			j++;
+		if (j == n) {
+			assert(bucket == NULL);
+			continue;
+		}
+		assert(bucket != NULL);
+		assert(key_cmp_skey(&sorted[j],
+		    &(struct s4 *){ THM_BUCKET_FIRST(s4_map, bucket) }) == 0);
+	}
+	/* Keys longer than the head takes aren't looked up */
+	assert(THM_SFIND(s4_map, &head, buf, THM_SKEY_MAXLEN + 1,
+	    NULL) == NULL);
+	assert(THM_SNFIND(s4_map, &head, buf, THM_SKEY_MAXLEN + 1,
+	    NULL) == NULL);
+
+	for (i = 0; i < n; i++) {
+		ep = &elist[i];
+		THM_REMOVE(s4_map, &head, ep);
+	}
+
+	assert(THM_EMPTY(s4_map, &head));
+
+	THM_HEAD_DESTROY(s4_map, &head);
+
+	thm_pool_destroy(&pool);
+
+	free(sorted);
+	free(elist);
+}
+
 static void
 test_pool_fragmentation(int n, int chunk, int seedkey)
 {
@@ -1289,6 +3627,26 @@ main(int argc __unused, char **argv __unused)
 		{ test_next, "next", },
 		{ test_prev, "prev", },
 		{ test_nfind, "nfind", },
+		{ test_keywidth, "key width", },
+		{ test_skey, "string keys", },
+		{ test_stride, "stride", },
+		{ test_prefix, "prefix", },
+		{ test_collapse, "collapse", },
+		{ test_inline, "inline", },
+		{ test_value, "value", },
+		{ test_fprint, "fingerprint", },
+		{ test_set, "set", },
+		{ test_dlist, "dlist", },
+		{ test_wide, "wide root", },
+		{ test_dense, "dense", },
+		{ test_find_inline, "inline find", },
+		{ test_hash, "hash", },
+		{ test_lpm, "longest prefix match", },
+		{ test_count, "order statistics", },
+		{ test_aggr, "aggregate", },
+		{ test_digest, "digest", },
+		{ test_diff, "diff", },
+		{ test_setop, "set operations", },
 		{ NULL, NULL },
 	};
 
@@ -28,15 +28,22 @@
 
 #if defined(_KERNEL)
 #include <sys/systm.h>
+#include <sys/errno.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
 
 #define	ASSERT(cond)			MPASS(cond)
 
 #define	THM_POOL_LOCK(pool)		mtx_lock(&(pool)->tp_mtx)
 #define	THM_POOL_UNLOCK(pool)		mtx_unlock(&(pool)->tp_mtx)
 
+static MALLOC_DEFINE(M_THASHMAP, "thashmap", "thashmap wide roots");
+
 #else
 
 #include <assert.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -56,6 +63,14 @@
 #define	__unused
 #endif
 
+#if !defined(__noinline)
+#define	__noinline			__attribute__ ((__noinline__))
+#endif
+
+#if !defined(nitems)
+#define	nitems(x)			(sizeof((x)) / sizeof((x)[0]))
+#endif
+
 #define	THM_POOL_LOCK(pool)		((void)0)
 #define	THM_POOL_UNLOCK(pool)		((void)0)
 
@@ -73,18 +88,143 @@
 
 #define	THM_PTR_MASK_PAGE		(~(uintptr_t)(THM_PAGE_SIZE - 1))
 
-#define	THM_SLOT_SIZE			\
-	(THM_SLOT_MIN_ENTRIES * (int)sizeof(uintptr_t))
-#define	THM_SLOT_MAX_ENTRIES		32
-#define	THM_SLOT_MIN_ENTRIES		4
+#define	THM_SLOT_MAX_ENTRIES		(NBBY * (int)sizeof(uintptr_t))
+
+/*
+ * Set heads are value mode heads over key >> stride, the leaf value is a
+ * bitmap of the last subkey shifted to keep slot bits clear. Bitmaps sit
+ * in slots with a tail like other value leaves, a sparse set takes about
+ * two words per bitmap.
+ */
+#define	THM_SET_SHIFT			2
+
+/*
+ * LPM heads take THM_LPM_BITS address bits per level, upper half of the
+ * fanout holds prefixes ending within the level. Prefix with r bits past
+ * the level boundary goes to subkey THM_LPM_MARK | 1 << r | bits, the rest
+ * of its key is zero. Last level only has /32 prefixes.
+ */
+#define	THM_LPM_BITS			4
+#define	THM_LPM_MARK			(1U << THM_LPM_BITS)
+#define	THM_LPM_LEVELS			(32 / THM_LPM_BITS + 1)
+
+/*
+ * Wide root heads replace root slot and the levels below it with a direct
+ * indexed table allocated with the head, it starts with fanout^2 entries.
+ * Table grows by a level once there are THM_WIDE_GROW leaves per entry of
+ * the larger table, slots of the level absorbed are freed. It never
+ * shrinks. Entries are preceded by struct thm_wide and followed by
+ * occupancy bitmap, sparse table is scanned a word at a time.
+ */
+#define	THM_WIDE_LEVELS			2
+#define	THM_WIDE_GROW			2
+#define	THM_WIDE_FANOUT_MAX		(1U << 18)
+#define	THM_WIDE_FANOUT(head)		\
+	(1U << (thm_wide_levels(head) * (head)->th_stride))
+#define	THM_WIDE_SIZE(fanout)		\
+	((fanout) * sizeof(uintptr_t) + (fanout) / NBBY)
+
+/*
+ * Counting heads keep a Fenwick tree of leaf counts per wide root entry
+ * after the bitmap. Slots keep no counts, rank and select take the tree
+ * in O(log fanout) and then walk the leaves of the wide root entry holding
+ * the key. An entry has about n / fanout of them for spread out keys, and
+ * fanout stops growing at THM_WIDE_FANOUT_MAX. Keys under a single entry
+ * are all walked.
+ */
+#define	THM_WIDE_COUNT_SIZE(fanout)	((fanout) * sizeof(u_long))
+
+/*
+ * Aggregate heads keep a segment tree of wide root entry summaries after
+ * the counts, its root is at index 1 and entry summaries start at fanout.
+ * Removed leaves can't be taken out of a summary, the entry subtree is
+ * summarized again. Slots keep no summaries, removes and range queries
+ * walk the leaves of one or two wide root entries as rank does.
+ */
+#define	THM_WIDE_AGGR_SIZE(fanout)	(2 * (fanout) * sizeof(uint64_t))
+
+/*
+ * Digest heads keep a segment tree of wide root entry digests after
+ * aggregates, laid out like the aggregate one. It's followed by a bitmap
+ * of tree nodes with an entry below changed since their digest was taken.
+ * Digest is a sum of leaf hashes, it doesn't depend on the tree shape.
+ */
+#define	THM_WIDE_DIGEST_SIZE(fanout)	\
+	(2 * (fanout) * sizeof(uint64_t) + 2 * (fanout) / NBBY)
+
+/*
+ * Dense heads replace the last two levels of a subtree by a direct indexed
+ * table once THM_DENSE_PROMOTE of its keys are used, table goes back to
+ * slots below THM_DENSE_DEMOTE. Tables are allocated outside of the pool
+ * like the wide root and referenced at half slot offset, pool slots are
+ * slot aligned. Entries are preceded by used entry count and followed by
+ * occupancy bitmap.
+ */
+#define	THM_DENSE_PROMOTE(head)		(THM_DENSE_FANOUT(head) / 4 * 3)
+#define	THM_DENSE_DEMOTE(head)		(THM_DENSE_FANOUT(head) / 4)
+#define	THM_DENSE_SIZE(head)		\
+	(THM_DENSE_OFFSET + THM_WIDE_SIZE(THM_DENSE_FANOUT(head)))
+
+/*
+ * Free entries left in a slot after shrinking, keeps slots from bouncing
+ * between two sizes on alternating insert and remove.
+ */
+#define	THM_SLOT_SHRINK_SLACK		2
+
+/*
+ * Slot fanout is defined by head stride. Slots with fanout entries are
+ * direct indexed (slotmax) and span THM_SLOTMAX_SLEN() units, it's encoded
+ * as THM_SLEN_MAX if it doesn't fit. Compressed slots are at most
+ * THM_SLEN_MAX - 1 units long.
+ */
+#define	THM_SLOTMAX_SLEN_MAX		\
+	(THM_SLOT_MAX_ENTRIES / THM_SLOT_MIN_ENTRIES)
+
+/*
+ * By default slot length minus one is spread over slen bits of the first
+ * three entries, these are rewritten whenever entries shift. With
+ * THM_SLOT_HEADER compressed slots keep it in the map word above the
+ * fanout bits together with prefix slot type, slotmax slots are tagged by
+ * slen bit of the second word. Limited to 64-bit and stride 5.
+ */
+#ifdef THM_SLOT_HEADER
+#define	THM_SLOT_SLEN_ENTRIES		0
+#else
+#define	THM_SLOT_SLEN_ENTRIES		3
+#endif
 
-#define	THM_SUBKEY(k, n)		\
-	(((k) >> (THM_SUBKEY_SHIFT * (5 - n))) & THM_SUBKEY_MASK)
-#define	THM_SUBKEY_MASK			(THM_SLOT_MAX_ENTRIES - 1)
-#define	THM_SUBKEY_BITIND(ind)		(((ind) - 2) / 5)
+#define	THM_SUBKEY(head, k, n)		\
+	(((k) >> ((head)->th_stride * ((head)->th_levels - 1 - (n)))) & \
+	    (THM_FANOUT(head) - 1))
 #define	THM_SUBKEY_SHIFT		5
 
-#define	THM_KEY_BIT(ind)		(1ULL << (ind))
+/*
+ * Prefix slot replaces a chain of single entry slots. It's a single unit
+ * slot with empty map, ts_entry[0] points to the child slot, ts_entry[1]
+ * holds skipped subkeys (first subkey in the lowest bits) and ts_entry[2]
+ * their number. Both are shifted to keep slen bits clear. In value mode
+ * ts_entry[0] may hold the leaf value, the subkeys are then the key residual
+ * down to the last level.
+ */
+#define	THM_PREFIX_MAX(head)		\
+	((NBBY * sizeof(uintptr_t) - THM_PREFIX_SHIFT) / (head)->th_stride)
+
+/*
+ * Byte string keys are split into 4-bit symbols tagged with
+ * THM_SKEY_SYMBOL, end of key is encoded as subkey 0 and sorts before any
+ * byte value.
+ */
+#define	THM_SKEY_SYMBOL			0x10
+
+#define	THM_LEVELS_MAX			MAX(THM_SUBKEY_MAX, THM_SKEY_LEVELS)
+
+#define	THM_KEY_BIT(ind)		((uintptr_t)1 << (ind))
+
+#define	THM_HASH_LANES			4
+#define	THM_HASH_BLOCK			(THM_HASH_LANES * sizeof(uint64_t))
+#define	THM_HASH_SEED			0x27d4eb2f165667c5ULL
+#define	THM_HASH_PRIME1			0x9e3779b185ebca87ULL
+#define	THM_HASH_PRIME2			0xc2b2ae3d27d4eb4fULL
 
 #define	THM_COUNT_1BITS_32(a)		__builtin_popcount((a))
 #define	THM_COUNT_1BITS_64(a)		__builtin_popcountll((a))
@@ -92,6 +232,8 @@
 #define	THM_COUNT_LEADING_0BITS_64(a)	__builtin_clzll((a))
 #define	THM_COUNT_TRAILING_0BITS_32(a)	__builtin_ctz((a))
 #define	THM_COUNT_TRAILING_0BITS_64(a)	__builtin_ctzll((a))
+#define	THM_COUNT_1BITS_MAP(a)		__builtin_popcountl((a))
+#define	THM_COUNT_TRAILING_0BITS_MAP(a)	__builtin_ctzl((a))
 
 #define	MASK_01010101			0x5555555555555555ULL
 #define	MASK_01000100			0x4444444444444444ULL
@@ -102,6 +244,8 @@
 #define	MASK_00010000			0x1010101010101010ULL
 #define	MASK_00100000			0x2020202020202020ULL
 #define	MASK_01000000			0x4040404040404040ULL
+#define	MASK_0000000011111111		0x00ff00ff00ff00ffULL
+#define	MASK_1111111100000000		0xff00ff00ff00ff00ULL
 
 
 #if !defined(CTASSERT) && defined(_Static_assert)
@@ -120,13 +264,10 @@ struct thm_page {
 	uintptr_t	*tp_q_prevp;
 };
 
-struct thm_slot {
-	uintptr_t	ts_map;
-	uintptr_t	ts_entry[0];
-};
-
-struct thm_slotmax {
-	uintptr_t	ts_entry[0];
+struct thm_key {
+	uint64_t	tk_val;
+	const u_char	*tk_str;
+	size_t		tk_len;
 };
 
 static struct thm_slot *thm_slot_alloc(struct thm_pool *pool, u_int slen,
@@ -139,10 +280,15 @@ static int thm_slot_tryextend(struct thm_pool *pool, struct thm_slot *slot,
     u_int slen_old, u_int slen_new);
 static void thm_slot_shrink(struct thm_pool *pool, struct thm_slot *slot,
     u_int slen_old, u_int slen_new);
-static void thm_slotmax_fix_extend(struct thm_slot *slot_old,
-    struct thm_slotmax *slotmax);
+static void thm_slotmax_fix_extend(struct thm_head *head,
+    struct thm_slot *slot_old, struct thm_slotmax *slotmax);
+static void thm_slotmax_fix_shrink(struct thm_head *head,
+    struct thm_slotmax *slotmax, struct thm_slot *slot_new, u_int slen_new);
 
-static __inline u_int thm_slot_get_slen(struct thm_slot *slot);
+static __inline u_int thm_slot_get_slen(struct thm_head *head,
+    struct thm_slot *slot);
+static __inline size_t thm_wide_size(struct thm_head *head, u_int fanout);
+static void thm_wide_aggr_build(struct thm_head *head);
 
 static struct thm_page *thm_page_alloc(struct thm_pool *pool);
 static void thm_page_free(struct thm_pool *pool, struct thm_page *);
@@ -158,6 +304,11 @@ static __inline void thm_pool_remove(struct thm_pool *pool, u_int rank,
     struct thm_page *page);
 
 CTASSERT(THM_PAGE_STRUCT_SLOTS == 0x1 || THM_PAGE_STRUCT_SLOTS == 0x3);
+/* Wide root table stays slot aligned after struct thm_wide */
+CTASSERT(sizeof(struct thm_wide) == THM_SLOT_SIZE);
+#ifdef THM_SLOT_HEADER
+CTASSERT(sizeof(uintptr_t) == 8);
+#endif
 
 void
 thm_pool_init(struct thm_pool *pool, const char *name __unused)
@@ -210,14 +361,228 @@ thm_pool_new_block(struct thm_pool *pool)
 	THM_POOL_UNLOCK(pool);
 }
 
+/*
+ * Slot aligned zeroed memory for wide root and dense tables, NULL on
+ * failure. Only kernel callers that wait always get it.
+ */
+static void *
+thm_table_alloc(size_t size, int wait __unused)
+{
+	void *table;
+
+#if defined(_KERNEL)
+	table = malloc(size, M_THASHMAP, (wait ? M_WAITOK : M_NOWAIT) | M_ZERO);
+#else
+	if (posix_memalign(&table, THM_SLOT_SIZE, size) != 0)
+		return (NULL);
+	memset(table, 0, size);
+#endif
+	ASSERT(((uintptr_t)table & (THM_SLOT_SIZE - 1)) == 0);
+
+	return (table);
+}
+
+static void
+thm_table_free(void *table)
+{
+#if defined(_KERNEL)
+	free(table, M_THASHMAP);
+#else
+	free(table);
+#endif
+}
+
+/* Key levels the wide root table takes */
+static __inline u_int
+thm_wide_levels(struct thm_head *head)
+{
+	return (thm_head_wide(head)->tw_levels);
+}
+
 void
 thm_head_init(struct thm_head *head, struct thm_pool *pool, int keyoffset)
 {
+	int error __unused;
+
+	error = thm_head_init_flags(head, pool, keyoffset, THM_HEAD_KEY30);
+	ASSERT(error == 0);
+}
+
+/* Aggregate and digest flags come from their own init functions only */
+static int
+thm_head_init_impl(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags)
+{
+	struct thm_wide *tw;
+	u_int levels, stride, width;
+
 	ASSERT((keyoffset & 0x3) == 0);
 
+	/* Head keeps both in 16 bits */
+	if (keyoffset / 4 != (short)(keyoffset / 4) ||
+	    flags != (u_short)flags)
+		return (EINVAL);
+	/* Counts, aggregates and digests are kept per wide root entry */
+	if ((flags & (THM_HEAD_COUNT | THM_HEAD_AGGR | THM_HEAD_DIGEST)) != 0)
+		flags |= THM_HEAD_WIDE;
+
+	switch (flags & THM_HEAD_KEYWIDTH) {
+	case THM_HEAD_KEY64:
+		width = 64;
+		break;
+	case THM_HEAD_KEY32:
+		width = 32;
+		break;
+	case THM_HEAD_KEY30:
+		width = 30;
+		break;
+	default:
+		return (EINVAL);
+	}
+
+	switch (flags & THM_HEAD_STRIDE) {
+	case THM_HEAD_STRIDE4:
+		stride = 4;
+		break;
+	case THM_HEAD_STRIDE5:
+		stride = THM_SUBKEY_SHIFT;
+		break;
+	case THM_HEAD_STRIDE6:
+		stride = 6;
+		break;
+	default:
+		return (EINVAL);
+	}
+	/* Slotmax slots hold the whole fanout in pool sized runs */
+	if ((1U << stride) > THM_SLOT_MAX_ENTRIES)
+		return (EINVAL);
+#ifdef THM_SLOT_HEADER
+	/* Slot header takes map word bits above the fanout */
+	if ((1U << stride) > THM_SLOT_HDR_SLEN_SHIFT)
+		return (EINVAL);
+#endif
+	levels = howmany(width, stride);
+
+	/* Value mode restores keys from the path, integer keys only */
+	if ((flags & THM_HEAD_VALUE) != 0 && (flags & THM_HEAD_SKEY) != 0)
+		return (EINVAL);
+	/* Fingerprints take top pointer bits of entry heads */
+	if ((flags & THM_HEAD_FPRINT) != 0 &&
+	    ((flags & (THM_HEAD_SKEY | THM_HEAD_VALUE)) != 0 ||
+	    sizeof(uintptr_t) < 8))
+		return (EINVAL);
+	if ((flags & THM_HEAD_SET) != 0) {
+		/* Last level is the leaf bitmap */
+		if ((flags & (THM_HEAD_SKEY | THM_HEAD_VALUE |
+		    THM_HEAD_FPRINT)) != 0 ||
+		    (1U << stride) + THM_SET_SHIFT > NBBY * sizeof(uintptr_t))
+			return (EINVAL);
+		levels--;
+	}
+	if ((flags & THM_HEAD_LPM) != 0) {
+		if ((flags & (THM_HEAD_SKEY | THM_HEAD_SET | THM_HEAD_FPRINT |
+		    THM_HEAD_WIDE | THM_HEAD_DENSE | THM_HEAD_KEYWIDTH)) != 0 ||
+		    stride != THM_LPM_BITS + 1)
+			return (EINVAL);
+		levels = THM_LPM_LEVELS;
+	}
+	if ((flags & THM_HEAD_SKEY) != 0) {
+		/* Symbols are THM_SUBKEY_SHIFT bits wide */
+		if ((flags & (THM_HEAD_KEYWIDTH | THM_HEAD_STRIDE |
+		    THM_HEAD_WIDE | THM_HEAD_DENSE)) != 0)
+			return (EINVAL);
+		levels = THM_SKEY_LEVELS;
+	}
+	ASSERT(levels <= THM_LEVELS_MAX);
+	if ((flags & THM_HEAD_WIDE) != 0 && levels <= THM_WIDE_LEVELS)
+		return (EINVAL);
+	/* Set leaves hold many keys */
+	if ((flags & (THM_HEAD_COUNT | THM_HEAD_AGGR | THM_HEAD_DIGEST)) != 0 &&
+	    (flags & THM_HEAD_SET) != 0)
+		return (EINVAL);
+	/* Root is never dense, wide root table stays above */
+	if ((flags & THM_HEAD_DENSE) != 0 && (levels <= THM_DENSE_LEVELS ||
+	    ((flags & THM_HEAD_WIDE) != 0 &&
+	    levels < THM_WIDE_LEVELS + THM_DENSE_LEVELS)))
+		return (EINVAL);
+
 	head->th_pool = pool;
-	head->th_keyoffset = keyoffset / sizeof(uint32_t);
-	head->th_root = (uintptr_t)thm_slot_alloc_zero(pool, 1, NULL);
+	head->th_flags = flags;
+	head->th_levels = levels;
+	head->th_stride = stride;
+	head->th_keyoffset = keyoffset / 4;
+	head->th_root = 0;
+
+	if ((flags & THM_HEAD_SKEY) != 0)
+		head->th_keybits = 0;
+	else if ((flags & THM_HEAD_LPM) != 0)
+		head->th_keybits = THM_LPM_LEVELS * stride;
+	else
+		head->th_keybits = width;
+	if ((flags & (THM_HEAD_SET | THM_HEAD_LPM)) != 0)
+		head->th_flags |= THM_HEAD_VALUE;
+
+	if ((flags & THM_HEAD_WIDE) != 0) {
+		tw = thm_table_alloc(sizeof(*tw) + thm_wide_size(head,
+		    1U << (THM_WIDE_LEVELS * stride)), 1);
+		if (tw == NULL)
+			return (ENOMEM);
+		tw->tw_levels = THM_WIDE_LEVELS;
+		head->th_root = (uintptr_t)(tw + 1);
+	}
+
+	return (0);
+}
+
+int
+thm_head_init_flags(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags)
+{
+	if ((flags & (THM_HEAD_AGGR | THM_HEAD_DIGEST)) != 0)
+		return (EINVAL);
+
+	return (thm_head_init_impl(head, pool, keyoffset, flags));
+}
+
+/* Aggregate heads summarize wide root entries, see struct thm_aggr */
+int
+thm_head_init_aggr(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags, const struct thm_aggr *aggr)
+{
+	int error;
+
+	if (aggr == NULL || (flags & THM_HEAD_DIGEST) != 0)
+		return (EINVAL);
+	error = thm_head_init_impl(head, pool, keyoffset,
+	    flags | THM_HEAD_AGGR);
+	if (error != 0)
+		return (error);
+	thm_head_wide(head)->tw_aggr = aggr;
+	thm_wide_aggr_build(head);
+
+	return (0);
+}
+
+/*
+ * Digest heads hash leaves with digest of their bucket, value heads hash
+ * values if digest is NULL.
+ */
+int
+thm_head_init_digest(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags, thm_digest_t *digest)
+{
+	int error;
+
+	if ((digest == NULL && (flags & THM_HEAD_VALUE) == 0) ||
+	    (flags & THM_HEAD_AGGR) != 0)
+		return (EINVAL);
+	error = thm_head_init_impl(head, pool, keyoffset,
+	    flags | THM_HEAD_DIGEST);
+	if (error != 0)
+		return (error);
+	thm_head_wide(head)->tw_digest = digest;
+
+	return (0);
 }
 
 void
@@ -226,10 +591,29 @@ thm_head_destroy(struct thm_head *head)
 	struct thm_slot *slot = thm_ptr_get_value(head->th_root);
 	u_int slen;
 
-	slen = thm_slot_get_slen(slot);
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		thm_table_free(thm_head_wide(head));
+		return;
+	}
+	if ((head->th_root & THM_PTR_MASK_SLOT) == 0)
+		return;
+	slen = thm_slot_get_slen(head, slot);
 	thm_slot_free(head->th_pool, slot, slen);
 }
 
+/* Head and wide root are not in the pool, don't use them as hints */
+static __inline void *
+thm_slot_hint(struct thm_head *head, void *hint)
+{
+	if ((uintptr_t)hint - (uintptr_t)head < sizeof(*head))
+		return (NULL);
+	if ((head->th_flags & THM_HEAD_WIDE) != 0 &&
+	    (uintptr_t)hint - head->th_root <
+	    THM_WIDE_FANOUT(head) * sizeof(uintptr_t))
+		return (NULL);
+	return (hint);
+}
+
 static __inline struct thm_page *
 thm_ptr_get_page(uintptr_t ptr)
 {
@@ -274,34 +658,134 @@ thm_ptr_set_value(uintptr_t *ptr, void *value)
 	*ptr = (*ptr & THM_PTR_MASK_SLEN) | (uintptr_t)value;
 }
 
+/* Copy slot pointer or leaf value, keep slen bit of the destination */
+static __inline void
+thm_ptr_copy(uintptr_t *ptr, uintptr_t src)
+{
+	*ptr = (*ptr & THM_PTR_MASK_SLEN) | (src & ~THM_PTR_MASK_SLEN);
+}
+
 static __inline struct thm_page *
 thm_addr_get_page(void *addr)
 {
 	return (thm_ptr_get_page((uintptr_t)addr));
 }
 
+static __inline uint64_t
+thm_entry_get_ikey(struct thm_head *head, struct thm_entry *entry)
+{
+	uint32_t *keyp;
+
+	keyp = (uint32_t *)entry + head->th_keyoffset;
+
+	if ((head->th_flags & THM_HEAD_KEY64) != 0)
+		return (*(uint64_t *)keyp);
+
+	return (*keyp & thm_head_keymask(head));
+}
+
 static __inline void
-thm_bucket_set(uintptr_t *ptr, struct thm_entry *entry)
+thm_entry_get_key(struct thm_head *head, struct thm_entry *entry,
+    struct thm_key *key)
 {
-	/* Dont trash entry->te_next */
-	thm_ptr_set_value(ptr, entry);
+	struct thm_skey *skey;
+
+	if ((head->th_flags & THM_HEAD_SKEY) == 0) {
+		key->tk_val = thm_entry_get_ikey(head, entry);
+		return;
+	}
+
+	skey = (struct thm_skey *)((uint32_t *)entry + head->th_keyoffset);
+	ASSERT(skey->tsk_len <= THM_SKEY_MAXLEN);
+	key->tk_str = skey->tsk_data;
+	key->tk_len = skey->tsk_len;
+}
+
+static __inline void *
+thm_leaf_get_value(struct thm_head *head, uintptr_t ptr)
+{
+	if ((head->th_flags & THM_HEAD_FPRINT) != 0)
+		ptr = (intptr_t)(ptr << THM_FPRINT_BITS) >> THM_FPRINT_BITS;
+
+	return (thm_ptr_get_value(ptr));
+}
+
+/* Key fingerprint doesn't match the leaf, no need to look at entries */
+static __inline int
+thm_leaf_fprint_miss(struct thm_head *head, uintptr_t ptr, uint64_t ikey)
+{
+	return ((head->th_flags & THM_HEAD_FPRINT) != 0 &&
+	    (ptr >> THM_FPRINT_SHIFT) != thm_key_fprint(ikey));
 }
 
 static __inline void
-thm_bucket_insert(uintptr_t *ptr, struct thm_entry *entry)
+thm_leaf_set_value(struct thm_head *head, uintptr_t *ptr,
+    struct thm_entry *entry)
 {
-	entry->te_next = thm_ptr_get_value(*ptr);
 	thm_ptr_set_value(ptr, entry);
+	if ((head->th_flags & THM_HEAD_FPRINT) != 0 && entry != NULL) {
+		ASSERT(thm_leaf_get_value(head, *ptr) == entry);
+		*ptr = (*ptr & ~((uintptr_t)-1 << THM_FPRINT_SHIFT)) |
+		    (thm_key_fprint(thm_entry_get_ikey(head, entry)) <<
+		    THM_FPRINT_SHIFT);
+	}
+}
+
+static __inline void
+thm_bucket_set(struct thm_head *head, uintptr_t *ptr,
+    struct thm_entry *entry)
+{
+	/* Dont trash entry->te_next */
+	thm_leaf_set_value(head, ptr, entry);
+}
+
+static __inline struct thm_dentry *
+thm_dentry(struct thm_entry *entry)
+{
+	return ((struct thm_dentry *)entry);
+}
+
+static __inline void
+thm_bucket_insert(struct thm_head *head, uintptr_t *ptr,
+    struct thm_entry *entry)
+{
+	entry->te_next = thm_leaf_get_value(head, *ptr);
+	if ((head->th_flags & THM_HEAD_DLIST) != 0) {
+		thm_dentry(entry)->tde_prev = NULL;
+		if (entry->te_next != NULL)
+			thm_dentry(entry->te_next)->tde_prev = entry;
+	}
+	thm_leaf_set_value(head, ptr, entry);
+}
+
+/* Unlink entry that isn't first in the bucket */
+static __inline void
+thm_bucket_unlink(struct thm_entry *prev, struct thm_entry *entry)
+{
+	prev->te_next = entry->te_next;
+	if (entry->te_next != NULL)
+		thm_dentry(entry->te_next)->tde_prev = prev;
 }
 
 static __inline void
-thm_bucket_remove(uintptr_t *ptr, struct thm_entry *entry)
+thm_bucket_remove(struct thm_head *head, uintptr_t *ptr,
+    struct thm_entry *entry)
 {
 	struct thm_entry *i;
 
-	i = thm_ptr_get_value(*ptr);
+	if ((head->th_flags & THM_HEAD_DLIST) != 0) {
+		i = thm_dentry(entry)->tde_prev;
+		if (i != NULL) {
+			thm_bucket_unlink(i, entry);
+			return;
+		}
+		if (entry->te_next != NULL)
+			thm_dentry(entry->te_next)->tde_prev = NULL;
+	}
+
+	i = thm_leaf_get_value(head, *ptr);
 	if (entry == i) {
-		thm_ptr_set_value(ptr, entry->te_next);
+		thm_leaf_set_value(head, ptr, entry->te_next);
 		return;
 	}
 
@@ -310,40 +794,107 @@ thm_bucket_remove(uintptr_t *ptr, struct thm_entry *entry)
 	i->te_next = entry->te_next;
 }
 
-static __inline uint32_t
-thm_entry_get_key(struct thm_head *head, struct thm_entry *entry)
+static __inline u_int
+thm_key_subkey(struct thm_head *head, const struct thm_key *key, u_int n)
 {
-	uint32_t *keyp;
+	u_char c;
 
-	keyp = (uint32_t *)entry + head->th_keyoffset;
+	if ((head->th_flags & THM_HEAD_SKEY) == 0)
+		return (THM_SUBKEY(head, key->tk_val, n));
 
-	return (*keyp & THM_KEY_MASK);
+	if (n / 2 >= key->tk_len) {
+		ASSERT(n == key->tk_len * 2);
+		return (0);
+	}
+	c = key->tk_str[n / 2];
+	if ((n & 1) == 0)
+		c >>= 4;
+
+	return (THM_SKEY_SYMBOL | (c & 0x0f));
 }
 
-static __inline uintptr_t *
-thm_slotmax_entry(struct thm_slot *slot, u_int ind)
+static __inline int
+thm_skey_cmp(const struct thm_key *key1, const struct thm_key *key2)
+{
+	int r;
+
+	r = memcmp(key1->tk_str, key2->tk_str, MIN(key1->tk_len, key2->tk_len));
+	if (r != 0)
+		return (r);
+	if (key1->tk_len == key2->tk_len)
+		return (0);
+	return (key1->tk_len < key2->tk_len ? -1 : 1);
+}
+
+static __inline int
+thm_key_cmp_entry(struct thm_head *head, const struct thm_key *key,
+    struct thm_entry *entry)
 {
-	struct thm_slotmax *slotmax = (struct thm_slotmax *)slot;
+	struct thm_key ekey;
+	uint64_t ikey;
+
+	if ((head->th_flags & THM_HEAD_SKEY) == 0) {
+		ikey = thm_entry_get_ikey(head, entry);
+		if (key->tk_val == ikey)
+			return (0);
+		return (key->tk_val < ikey ? -1 : 1);
+	}
 
-	return (&slotmax->ts_entry[ind]);
+	thm_entry_get_key(head, entry, &ekey);
+
+	return (thm_skey_cmp(key, &ekey));
 }
 
+/* Level of the first subkey that differs */
 static __inline u_int
-thm_slot_get_slen(struct thm_slot *slot)
+thm_key_difflevel(struct thm_head *head, const struct thm_key *key1,
+    const struct thm_key *key2)
 {
-	u_int slen;
+	size_t i, len;
+	u_int bit;
+
+	if ((head->th_flags & THM_HEAD_SKEY) == 0) {
+		ASSERT(key1->tk_val != key2->tk_val);
+		bit = 63 - THM_COUNT_LEADING_0BITS_64(key1->tk_val ^
+		    key2->tk_val);
+		return (head->th_levels - 1 - bit / head->th_stride);
+	}
 
-	slen = (((slot->ts_entry[0] & THM_PTR_MASK_SLEN) >> 1) |
-	    (slot->ts_entry[1] & THM_PTR_MASK_SLEN) |
-	    ((slot->ts_entry[2] & THM_PTR_MASK_SLEN) << 1)) + 1;
+	len = MIN(key1->tk_len, key2->tk_len);
+	for (i = 0; i < len; i++) {
+		if (key1->tk_str[i] == key2->tk_str[i])
+			continue;
+		if (((key1->tk_str[i] ^ key2->tk_str[i]) & 0xf0) != 0)
+			return (i * 2);
+		return (i * 2 + 1);
+	}
+	ASSERT(key1->tk_len != key2->tk_len);
 
-	return (slen);
+	return (len * 2);
+}
+
+#ifdef THM_SLOT_HEADER
+
+static __inline void
+thm_slot_set_slen(struct thm_head *head, struct thm_slot *slot, u_int slen)
+{
+	if (slen == THM_SLOTMAX_SLEN(head)) {
+		slot->ts_entry[0] |= THM_PTR_MASK_SLEN;
+		return;
+	}
+
+	ASSERT(slen < THM_SLEN_MAX);
+	slot->ts_map = (slot->ts_map & THM_SLOT_HDR_MAP) |
+	    ((uintptr_t)(slen - 1) << THM_SLOT_HDR_SLEN_SHIFT);
+	slot->ts_entry[0] &= ~THM_PTR_MASK_SLEN;
 }
 
+#else /* !THM_SLOT_HEADER */
+
 static __inline void
-thm_slot_set_slen(struct thm_slot *slot, u_int slen)
+thm_slot_set_slen(struct thm_head *head, struct thm_slot *slot, u_int slen)
 {
-	slen -= 1;
+	slen = MIN(slen, THM_SLEN_MAX) - 1;
 
 	slot->ts_entry[0] = (slot->ts_entry[0] & ~THM_PTR_MASK_SLEN) |
 	    ((slen << 1) & THM_PTR_MASK_SLEN);
@@ -353,732 +904,4105 @@ thm_slot_set_slen(struct thm_slot *slot, u_int slen)
 	    ((slen >> 1) & THM_PTR_MASK_SLEN);
 }
 
-static __inline void
-thm_cursor_push(struct thm_cursor *cr, uintptr_t *entp)
-{
-	cr->tc_level++;
-	ASSERT(cr->tc_level < THM_SUBKEY_MAX + 1);
-	cr->tc_path[cr->tc_level] = entp;
-}
+#endif /* THM_SLOT_HEADER */
 
-int
-thm_empty(struct thm_head *head)
+/* Slot length to grow compressed slot to */
+static __inline u_int
+thm_slot_next_slen(struct thm_head *head, u_int slen)
 {
-	struct thm_slot *slot;
-	uintptr_t *entp;
+	ASSERT(slen < THM_SLOTMAX_SLEN(head));
 
-	slot = thm_ptr_get_value(head->th_root);
+	if (slen + 1 >= MIN(THM_SLOTMAX_SLEN(head), THM_SLEN_MAX))
+		return (THM_SLOTMAX_SLEN(head));
 
-	if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-		for (u_int i = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
-			entp = thm_slotmax_entry(slot, i);
-			if (thm_ptr_get_value(*entp) != NULL)
-				return (0);
-		}
+	return (slen + 1);
+}
 
-		return (1);
-	}
+/* Wide root has no slot header, check for it before looking at one */
+static __inline int
+thm_slot_is_wide(struct thm_head *head, struct thm_slot *slot)
+{
+	return ((head->th_flags & THM_HEAD_WIDE) != 0 &&
+	    (uintptr_t)slot == head->th_root);
+}
 
-	return (slot->ts_map == 0);
+/* Root entry of entry heads may hold a lone leaf, empty heads have 0 */
+static __inline int
+thm_root_is_slot(struct thm_head *head)
+{
+	return ((head->th_root & THM_PTR_MASK_SLOT) != 0 ||
+	    (head->th_flags & THM_HEAD_WIDE) != 0);
 }
 
-static struct thm_bucket *
-thm_first_impl(struct thm_cursor *cr)
+/* Number of entries of direct indexed slot, 0 for compressed slots */
+static __inline u_int
+thm_slot_direct(struct thm_head *head, struct thm_slot *slot)
 {
-	struct thm_slot *slot;
-	void *entval;
-	uintptr_t *entp;
+	if (__predict_false(thm_slot_is_wide(head, slot)))
+		return (THM_WIDE_FANOUT(head));
+	if (__predict_false(thm_slot_is_dense(head, slot)))
+		return (THM_DENSE_FANOUT(head));
+	if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head))
+		return (THM_FANOUT(head));
+	return (0);
+}
 
-	entval = thm_ptr_get_value(*cr->tc_path[cr->tc_level]);
+/* Wide root per entry data follows the bitmap in flag order */
+static __inline size_t
+thm_wide_offset(struct thm_head *head, u_int fanout, u_int flag)
+{
+	size_t off = THM_WIDE_SIZE(fanout);
 
-	do {
-		slot = entval;
-		if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-			for (int i = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
-				entp = thm_slotmax_entry(slot, i);
-				if (thm_ptr_get_value(*entp) != NULL)
-					goto found;
-			}
-			return (NULL);
-		}
+	if (flag > THM_HEAD_COUNT && (head->th_flags & THM_HEAD_COUNT) != 0)
+		off += THM_WIDE_COUNT_SIZE(fanout);
+	if (flag > THM_HEAD_AGGR && (head->th_flags & THM_HEAD_AGGR) != 0)
+		off += THM_WIDE_AGGR_SIZE(fanout);
+	if (flag > THM_HEAD_DIGEST && (head->th_flags & THM_HEAD_DIGEST) != 0)
+		off += THM_WIDE_DIGEST_SIZE(fanout);
 
-		if (slot->ts_map == 0)
-			return (NULL);
-		entp = &slot->ts_entry[0];
-found:
-		thm_cursor_push(cr, entp);
-		entval = thm_ptr_get_value(*entp);
-	} while ((*entp & THM_PTR_MASK_SLOT) != 0);
+	return (off);
+}
 
-	return (entval);
+static __inline size_t
+thm_wide_size(struct thm_head *head, u_int fanout)
+{
+	return (thm_wide_offset(head, fanout, ~0U));
 }
 
-struct thm_bucket *
-thm_first(struct thm_head *head, struct thm_cursor *cr)
+static __inline u_int
+thm_wide_index(struct thm_head *head, uint64_t ikey)
 {
-	struct thm_cursor xcr;
-	struct thm_bucket *bucket;
+	return ((ikey >> (head->th_stride *
+	    (head->th_levels - thm_wide_levels(head)))) &
+	    (THM_WIDE_FANOUT(head) - 1));
+}
 
-	if (cr == NULL)
-		cr = &xcr;
+static __inline uintptr_t *
+thm_wide_entry(struct thm_head *head, const struct thm_key *key)
+{
+	return ((uintptr_t *)head->th_root + thm_wide_index(head, key->tk_val));
+}
 
-	cr->tc_level = 0;
-	cr->tc_path[0] = &head->th_root;
+static __inline u_long *
+thm_wide_counts(struct thm_head *head)
+{
+	return ((u_long *)(head->th_root + thm_wide_offset(head,
+	    THM_WIDE_FANOUT(head), THM_HEAD_COUNT)));
+}
 
-	bucket = thm_first_impl(cr);
-	ASSERT(bucket != NULL || cr->tc_level == 0);
+static __inline void
+thm_wide_count_add(struct thm_head *head, u_int ind, long delta)
+{
+	u_long *counts = thm_wide_counts(head);
+	u_int fanout = THM_WIDE_FANOUT(head);
 
-	return (bucket);
+	for (ind++; ind <= fanout; ind += ind & -ind)
+		counts[ind - 1] += delta;
 }
 
-static struct thm_bucket *
-thm_last_impl(struct thm_cursor *cr)
+/* Leaves below wide root entries before ind */
+static __inline u_long
+thm_wide_count_sum(struct thm_head *head, u_int ind)
 {
-	struct thm_slot *slot;
-	void *entval;
-	uintptr_t *entp;
-	int i;
+	u_long *counts = thm_wide_counts(head);
+	u_long sum;
 
-	entval = thm_ptr_get_value(*cr->tc_path[cr->tc_level]);
+	for (sum = 0; ind > 0; ind &= ind - 1)
+		sum += counts[ind - 1];
 
-	do {
-		slot = entval;
-		if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-			for (i = THM_SLOT_MAX_ENTRIES - 1; i >= 0; i--) {
-				entp = thm_slotmax_entry(slot, i);
-				if (thm_ptr_get_value(*entp) != NULL)
-					goto found;
-			}
-			return (NULL);
-		}
+	return (sum);
+}
 
-		if (slot->ts_map == 0)
-			return (NULL);
-		i = THM_COUNT_1BITS_32(slot->ts_map);
-		entp = &slot->ts_entry[i - 1];
-found:
-		thm_cursor_push(cr, entp);
-		entval = thm_ptr_get_value(*entp);
-	} while ((*entp & THM_PTR_MASK_SLOT) != 0);
+static __inline uint64_t *
+thm_wide_aggrs(struct thm_head *head)
+{
+	return ((uint64_t *)(head->th_root + thm_wide_offset(head,
+	    THM_WIDE_FANOUT(head), THM_HEAD_AGGR)));
+}
 
-	return (entval);
+/* Combine leaf summary into the entry and the tree above it */
+static __inline void
+thm_wide_aggr_add(struct thm_head *head, u_int ind, uint64_t value)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	uint64_t *tree = thm_wide_aggrs(head);
+
+	for (ind += THM_WIDE_FANOUT(head); ind > 0; ind >>= 1)
+		tree[ind] = aggr->ta_combine(tree[ind], value);
 }
 
-struct thm_bucket *
-thm_last(struct thm_head *head, struct thm_cursor *cr)
+static __inline uint64_t *
+thm_wide_digests(struct thm_head *head)
 {
-	struct thm_cursor xcr;
-	struct thm_bucket *bucket;
+	return ((uint64_t *)(head->th_root + thm_wide_offset(head,
+	    THM_WIDE_FANOUT(head), THM_HEAD_DIGEST)));
+}
 
-	if (cr == NULL)
-		cr = &xcr;
+/*
+ * Digests of the entry and the tree above it are taken again when they're
+ * asked for, nodes above a dirty node are dirty already.
+ */
+static __inline void
+thm_wide_digest_dirty(struct thm_head *head, u_int ind)
+{
+	uint64_t *dirty = thm_wide_digests(head) + 2 * THM_WIDE_FANOUT(head);
 
-	cr->tc_level = 0;
-	cr->tc_path[0] = &head->th_root;
+	for (ind += THM_WIDE_FANOUT(head); ind > 0 &&
+	    (dirty[ind / 64] & ((uint64_t)1 << (ind % 64))) == 0; ind >>= 1)
+		dirty[ind / 64] |= (uint64_t)1 << (ind % 64);
+}
 
-	bucket = thm_last_impl(cr);
-	ASSERT(bucket != NULL || cr->tc_level == 0);
+/* Occupancy bitmap of wide root or dense table with n entries */
+static __inline uint64_t *
+thm_table_map(void *table, u_int n)
+{
+	return ((uint64_t *)((uintptr_t *)table + n));
+}
 
-	return (bucket);
+/* Update occupancy bit after table entry was set or cleared */
+static __inline void
+thm_table_map_update(void *table, u_int n, uintptr_t *entp)
+{
+	uint64_t *map = thm_table_map(table, n);
+	u_int ind;
+
+	ind = entp - (uintptr_t *)table;
+	ASSERT(ind < n);
+	if (thm_ptr_get_value(*entp) != NULL)
+		map[ind / 64] |= (uint64_t)1 << (ind % 64);
+	else
+		map[ind / 64] &= ~((uint64_t)1 << (ind % 64));
 }
 
-static uintptr_t *
-thm_next_step(struct thm_slot *slot, uintptr_t *entp)
+static __inline void
+thm_wide_map_update(struct thm_head *head, uintptr_t *entp)
 {
-	int count, i;
+	thm_table_map_update((void *)head->th_root, THM_WIDE_FANOUT(head),
+	    entp);
+}
 
-	if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-		i = entp - thm_slotmax_entry(slot, 0);
-		ASSERT(i >= 0 && i < THM_SLOT_MAX_ENTRIES);
-		for (i += 1; i < THM_SLOT_MAX_ENTRIES; i++) {
-			entp = thm_slotmax_entry(slot, i);
-			if (thm_ptr_get_value(*entp) != NULL)
-				return (entp);
+static __inline u_long *
+thm_dense_count(struct thm_slot *slot)
+{
+	return ((u_long *)slot - 1);
+}
+
+static __inline uintptr_t *
+thm_dense_entry(struct thm_head *head, struct thm_slot *slot,
+    const struct thm_key *key)
+{
+	return ((uintptr_t *)slot +
+	    (key->tk_val & (THM_DENSE_FANOUT(head) - 1)));
+}
+
+/* Account dense table entry set or cleared, returns used entries */
+static __inline u_long
+thm_dense_update(struct thm_head *head, struct thm_slot *slot,
+    uintptr_t *entp)
+{
+	u_long *countp = thm_dense_count(slot);
+
+	thm_table_map_update(slot, THM_DENSE_FANOUT(head), entp);
+	if (thm_ptr_get_value(*entp) != NULL)
+		(*countp)++;
+	else
+		(*countp)--;
+
+	return (*countp);
+}
+
+/* First used entry of direct indexed slot at or after ind, -1 if none */
+static __inline int
+thm_direct_next(struct thm_head *head, struct thm_slot *slot, int n, int ind)
+{
+	uint64_t *map, m;
+
+	if (n == (int)THM_FANOUT(head)) {
+		for (; ind < n; ind++) {
+			if (thm_ptr_get_value(*thm_slotmax_entry(slot, ind)) !=
+			    NULL)
+				return (ind);
 		}
-		return (NULL);
+		return (-1);
 	}
 
-	count = THM_COUNT_1BITS_32(slot->ts_map);
-	i = entp - slot->ts_entry;
-	ASSERT(i >= 0 && i < count);
-	if (i + 1 >= count)
-		return (NULL);
-	entp = &slot->ts_entry[i + 1];
+	if (ind >= n)
+		return (-1);
+	map = thm_table_map(slot, n);
+	m = map[ind / 64] & ~(((uint64_t)1 << (ind % 64)) - 1);
+	for (ind /= 64; m == 0; m = map[ind]) {
+		if (++ind >= n / 64)
+			return (-1);
+	}
 
-	return (entp);
+	return (ind * 64 + THM_COUNT_TRAILING_0BITS_64(m));
 }
 
-struct thm_bucket *
-thm_next(struct thm_cursor *cr)
+/* Last used entry of direct indexed slot at or before ind, -1 if none */
+static __inline int
+thm_direct_prev(struct thm_head *head, struct thm_slot *slot, int n, int ind)
 {
-	struct thm_slot *slot;
-	uintptr_t *entp;
-
-	ASSERT(cr->tc_level > 0 && cr->tc_level < THM_SUBKEY_MAX + 1);
+	uint64_t *map, m;
 
-	for (; cr->tc_level > 0; cr->tc_level--) {
-		ASSERT(*cr->tc_path[cr->tc_level - 1] & THM_PTR_MASK_SLOT ||
-		    cr->tc_level == 1);
-		slot = thm_ptr_get_value(*cr->tc_path[cr->tc_level - 1]);
-		entp = thm_next_step(slot, cr->tc_path[cr->tc_level]);
-		if (entp == NULL)
-			continue;
+	if (n == (int)THM_FANOUT(head)) {
+		for (; ind >= 0; ind--) {
+			if (thm_ptr_get_value(*thm_slotmax_entry(slot, ind)) !=
+			    NULL)
+				return (ind);
+		}
+		return (-1);
+	}
 
-		cr->tc_path[cr->tc_level] = entp;
-		if ((*entp & THM_PTR_MASK_SLOT) == 0)
-			return (thm_ptr_get_value(*entp));
-		else
-			return (thm_first_impl(cr));
+	if (ind < 0)
+		return (-1);
+	map = thm_table_map(slot, n);
+	m = map[ind / 64];
+	if (ind % 64 != 63)
+		m &= ((uint64_t)1 << (ind % 64 + 1)) - 1;
+	for (ind /= 64; m == 0; m = map[ind]) {
+		if (--ind < 0)
+			return (-1);
 	}
 
-	return (NULL);
+	return (ind * 64 + 63 - THM_COUNT_LEADING_0BITS_64(m));
 }
 
-static uintptr_t *
-thm_prev_step(struct thm_slot *slot, uintptr_t *entp)
+static __inline struct thm_slot *
+thm_prefix_child(struct thm_slot *slot)
 {
-	int i;
+	ASSERT((slot->ts_entry[0] & THM_PTR_MASK_SLOT) != 0);
 
-	if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-		i = entp - thm_slotmax_entry(slot, 0);
-		ASSERT(i >= 0 && i < THM_SLOT_MAX_ENTRIES);
-		for (i -= 1; i >= 0; i--) {
-			entp = thm_slotmax_entry(slot, i);
-			if (thm_ptr_get_value(*entp) != NULL)
-				return (entp);
+	return (thm_ptr_get_value(slot->ts_entry[0]));
+}
+
+/* Child is either tagged slot pointer or leaf value, 0 if set later */
+static __inline void
+thm_prefix_init(struct thm_head *head, struct thm_slot *slot,
+    uintptr_t subkeys, u_int count, uintptr_t child)
+{
+	ASSERT(count > 0 && count <= THM_PREFIX_MAX(head));
+
+#ifdef THM_SLOT_HEADER
+	slot->ts_map = THM_SLOT_HDR_PREFIX;
+#else
+	slot->ts_map = 0;
+#endif
+	slot->ts_entry[0] = child & ~THM_PTR_MASK_SLEN;
+	slot->ts_entry[1] = subkeys << THM_PREFIX_SHIFT;
+	slot->ts_entry[2] = count << THM_PREFIX_SHIFT;
+}
+
+/* Pack count subkeys of the key starting at level */
+static __inline uintptr_t
+thm_prefix_pack(struct thm_head *head, const struct thm_key *key,
+    u_int level, u_int count)
+{
+	uintptr_t subkeys = 0;
+	u_int i;
+
+	for (i = 0; i < count; i++)
+		subkeys |= (uintptr_t)thm_key_subkey(head, key, level + i) <<
+		    (i * head->th_stride);
+
+	return (subkeys);
+}
+
+/* Number of prefix subkeys matching the key starting at level */
+static __inline u_int
+thm_prefix_match(struct thm_head *head, struct thm_slot *slot,
+    const struct thm_key *key, u_int level)
+{
+	uintptr_t subkeys;
+	u_int count, i;
+
+	subkeys = thm_prefix_subkeys(slot);
+	count = thm_prefix_count(slot);
+	if ((head->th_flags & THM_HEAD_SKEY) == 0) {
+		u_int shift;
+
+		/* Integer key subkeys are consecutive bit fields */
+		shift = head->th_stride * (head->th_levels - 1 - level);
+		for (i = 0; i < count; i++, subkeys >>= head->th_stride,
+		    shift -= head->th_stride) {
+			if (((subkeys ^ (key->tk_val >> shift)) &
+			    (THM_FANOUT(head) - 1)) != 0)
+				break;
 		}
-		return (NULL);
+		return (i);
+	}
+	for (i = 0; i < count; i++, subkeys >>= head->th_stride) {
+		if ((subkeys & (THM_FANOUT(head) - 1)) !=
+		    thm_key_subkey(head, key, level + i))
+			break;
 	}
 
-	i = entp - slot->ts_entry;
-	ASSERT(i >= 0);
-	if (i == 0)
-		return (NULL);
-	entp = &slot->ts_entry[i - 1];
+	return (i);
+}
 
-	return (entp);
+/*
+ * Value heads keep a leaf in the compressed slot of the level where its key
+ * becomes unique, the key bits below the slot (tail) are packed into words
+ * at the end of the slot. Tails fill them backwards in the order of their
+ * leaves, lowest bits first, and are shifted like prefix subkeys. Leaves of
+ * direct indexed slots and of levels with tails longer than a prefix stay
+ * below prefix slots. Wide root and LPM heads don't use tails.
+ */
+static __inline int
+thm_head_tails(struct thm_head *head)
+{
+	return ((head->th_flags & (THM_HEAD_VALUE | THM_HEAD_WIDE |
+	    THM_HEAD_LPM)) == THM_HEAD_VALUE);
 }
 
-struct thm_bucket *
-thm_prev(struct thm_cursor *cr)
+/* Key bits in tails of the slot at level, 0 if its leaves have none */
+static __inline u_int
+thm_tail_bits(struct thm_head *head, u_int level)
 {
-	struct thm_slot *slot;
-	uintptr_t *entp;
+	if (!thm_head_tails(head) || level + 1 >= head->th_levels ||
+	    head->th_levels - 1 - level > THM_PREFIX_MAX(head))
+		return (0);
 
-	ASSERT(cr->tc_level > 0 && cr->tc_level < THM_SUBKEY_MAX + 1);
+	return ((head->th_levels - 1 - level) * head->th_stride);
+}
 
-	for (; cr->tc_level > 0; cr->tc_level--) {
-		ASSERT(*cr->tc_path[cr->tc_level - 1] & THM_PTR_MASK_SLOT ||
-		    cr->tc_level == 1);
-		slot = thm_ptr_get_value(*cr->tc_path[cr->tc_level - 1]);
-		entp = thm_prev_step(slot, cr->tc_path[cr->tc_level]);
-		if (entp == NULL)
-			continue;
+/* Tails of a slot are packed into words, none of them spans two words */
+static __inline u_int
+thm_tail_per_word(u_int bits)
+{
+	return ((NBBY * sizeof(uintptr_t) - THM_PREFIX_SHIFT) / bits);
+}
 
-		cr->tc_path[cr->tc_level] = entp;
-		if ((*entp & THM_PTR_MASK_SLOT) == 0)
-			return (thm_ptr_get_value(*entp));
-		else
-			return (thm_last_impl(cr));
+/* Words taken by n tails */
+static __inline u_int
+thm_tail_words(u_int bits, u_int n)
+{
+	if (bits == 0)
+		return (0);
+
+	return (howmany(n, thm_tail_per_word(bits)));
+}
+
+/* Tail index of leaf entry, one for each leaf before it */
+static __inline u_int
+thm_tail_index(struct thm_slot *slot, uintptr_t *entp)
+{
+	uintptr_t *p;
+	u_int i;
+
+	for (p = slot->ts_entry, i = 0; p < entp; p++) {
+		if ((*p & THM_PTR_MASK_SLOT) == 0)
+			i++;
 	}
 
-	return (NULL);
+	return (i);
 }
 
-static uintptr_t *
-thm_find_step(struct thm_slot *slot, u_int key)
+/* Word of i-th tail counting back from the end of the slot */
+static __inline uintptr_t *
+thm_tail_word(struct thm_head *head, struct thm_slot *slot, u_int bits,
+    u_int i, u_int *shiftp)
 {
-	uintptr_t *entp;
-	uint32_t keybit, smap;
-	u_int keyind, slen;
+	u_int per = thm_tail_per_word(bits);
 
-	ASSERT(key < THM_SLOT_MAX_ENTRIES);
+	*shiftp = THM_PREFIX_SHIFT + (i % per) * bits;
 
-	slen = thm_slot_get_slen(slot);
-	if (slen == THM_SLEN_MAX) {
-		 entp = thm_slotmax_entry(slot, key);
-		 if (thm_ptr_get_value(*entp) == NULL)
-			 return (NULL);
-		 return (entp);
-	}
+	return (&slot->ts_entry[thm_slot_get_slen(head, slot) *
+	    THM_SLOT_MIN_ENTRIES - 2 - i / per]);
+}
 
-	smap = slot->ts_map;
+static __inline uint64_t
+thm_tail_get_index(struct thm_head *head, struct thm_slot *slot, u_int bits,
+    u_int i)
+{
+	uintptr_t *tailp;
+	u_int shift;
 
-	keybit = THM_KEY_BIT(key);
-	if ((smap & keybit) == 0)
-		return (NULL);
+	tailp = thm_tail_word(head, slot, bits, i, &shift);
 
-	smap &= keybit - 1;
-	keyind = THM_COUNT_1BITS_32(smap);
+	return ((*tailp >> shift) & (((uint64_t)1 << bits) - 1));
+}
 
-	return (&slot->ts_entry[keyind]);
+/* Slen bits below THM_PREFIX_SHIFT are left alone */
+static __inline void
+thm_tail_set_index(struct thm_head *head, struct thm_slot *slot, u_int bits,
+    u_int i, uint64_t tail)
+{
+	uintptr_t *tailp;
+	u_int shift;
+
+	tailp = thm_tail_word(head, slot, bits, i, &shift);
+	*tailp = (*tailp & ~((uintptr_t)(((uint64_t)1 << bits) - 1) << shift)) |
+	    ((uintptr_t)tail << shift);
 }
 
-static struct thm_bucket *
-thm_find_impl(struct thm_head *head, uint32_t key, struct thm_cursor *cr)
+static __inline uint64_t
+thm_tail_get(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    u_int bits)
 {
-	uintptr_t *entp;
-	void *entval;
+	return (thm_tail_get_index(head, slot, bits,
+	    thm_tail_index(slot, entp)));
+}
 
-	cr->tc_path[0] = &head->th_root;
-	entval = thm_ptr_get_value(head->th_root);
+static __inline void
+thm_tail_set(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    u_int bits, uint64_t tail)
+{
+	thm_tail_set_index(head, slot, bits, thm_tail_index(slot, entp), tail);
+}
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 0));
-	if (entp == NULL) {
-		cr->tc_level = 0;
-		return (NULL);
-	}
-	cr->tc_path[1] = entp;
-	entval = thm_ptr_get_value(*entp);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		cr->tc_level = 1;
-		goto found;
-	}
+/* Number of tails in the slot, leaves of a slot above the last level */
+static __inline u_int
+thm_tail_count(struct thm_head *head, struct thm_slot *slot)
+{
+	u_int count, i, n;
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 1));
-	if (entp == NULL) {
-		cr->tc_level = 1;
-		return (NULL);
-	}
-	cr->tc_path[2] = entp;
-	entval = thm_ptr_get_value(*entp);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		cr->tc_level = 2;
-		goto found;
+	if (thm_slot_direct(head, slot) != 0 || thm_slot_is_prefix(head, slot))
+		return (0);
+	count = THM_COUNT_1BITS_MAP(thm_slot_map(slot));
+	for (i = 0, n = 0; i < count; i++) {
+		if ((slot->ts_entry[i] & THM_PTR_MASK_SLOT) == 0)
+			n++;
 	}
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 2));
-	if (entp == NULL) {
-		cr->tc_level = 2;
-		return (NULL);
-	}
-	cr->tc_path[3] = entp;
-	entval = thm_ptr_get_value(*entp);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		cr->tc_level = 3;
-		goto found;
-	}
+	return (n);
+}
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 3));
-	if (entp == NULL) {
-		cr->tc_level = 3;
-		return (NULL);
-	}
-	cr->tc_path[4] = entp;
-	entval = thm_ptr_get_value(*entp);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		cr->tc_level = 4;
-		goto found;
-	}
+/* Slot has room for another leaf with a tail and stays compressed */
+static __inline int
+thm_tail_fits(struct thm_head *head, struct thm_slot *slot, u_int bits)
+{
+	if (thm_slot_direct(head, slot) != 0)
+		return (0);
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 4));
-	if (entp == NULL) {
-		cr->tc_level = 4;
-		return (NULL);
-	}
-	cr->tc_path[5] = entp;
-	entval = thm_ptr_get_value(*entp);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		cr->tc_level = 5;
-		goto found;
-	}
+	return (THM_COUNT_1BITS_MAP(thm_slot_map(slot)) + 1 +
+	    thm_tail_words(bits, thm_tail_count(head, slot) + 1) + 1 <=
+	    (MIN(THM_SLOTMAX_SLEN(head), THM_SLEN_MAX) - 1) *
+	    THM_SLOT_MIN_ENTRIES);
+}
 
-	entp = thm_find_step(entval, THM_SUBKEY(key, 5));
-	if (entp == NULL) {
-		cr->tc_level = 5;
-		return (NULL);
-	}
-	cr->tc_path[6] = entp;
-	entval = thm_ptr_get_value(*entp);
-	ASSERT((*entp & THM_PTR_MASK_SLOT) == 0);
-	cr->tc_level = 6;
+/* Move n tail words to the end of the slot resized from slen_old units */
+static void
+thm_tail_move(struct thm_slot *slot, u_int n, u_int slen_old, u_int slen_new)
+{
+	uintptr_t *from, *to;
 
-found:
-	if (key != thm_entry_get_key(head, entval)) {
-		cr->tc_level--;
-		return (NULL);
-	}
+	from = &slot->ts_entry[slen_old * THM_SLOT_MIN_ENTRIES - 1 - n];
+	to = &slot->ts_entry[slen_new * THM_SLOT_MIN_ENTRIES - 1 - n];
+	memmove(to, from, n * sizeof(uintptr_t));
+	if (to > from)
+		memset(from, 0, MIN(n, (u_int)(to - from)) * sizeof(uintptr_t));
+}
 
-	return (entval);
+/*
+ * Open zero tail for leaf entry among n tails of the slot, entries are in
+ * place already and there is room for the word it may take.
+ */
+static void
+thm_tail_open(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    u_int bits, u_int n)
+{
+	uintptr_t *tailp;
+	u_int i, j, shift;
+
+	i = thm_tail_index(slot, entp);
+	if (n % thm_tail_per_word(bits) == 0) {
+		tailp = thm_tail_word(head, slot, bits, n, &shift);
+		*tailp &= THM_PTR_MASK_SLEN;
+	}
+	for (j = n; j > i; j--)
+		thm_tail_set_index(head, slot, bits, j,
+		    thm_tail_get_index(head, slot, bits, j - 1));
+	thm_tail_set_index(head, slot, bits, i, 0);
 }
 
-struct thm_bucket *
-thm_find(struct thm_head *head, uint32_t key, struct thm_cursor *cr)
+/* Drop tail of leaf entry among n tails of the slot, unused bits are zero */
+static void
+thm_tail_close(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    u_int bits, u_int n)
 {
-	struct thm_cursor xcr;
+	u_int j;
 
-	key &= THM_KEY_MASK;
+	for (j = thm_tail_index(slot, entp); j + 1 < n; j++)
+		thm_tail_set_index(head, slot, bits, j,
+		    thm_tail_get_index(head, slot, bits, j + 1));
+	thm_tail_set_index(head, slot, bits, n - 1, 0);
+}
 
-	if (cr == NULL)
-		cr = &xcr;
+/* String cursor path runs on from tc_path into tsc_path */
+CTASSERT(offsetof(struct thm_scursor, tsc_path) ==
+    offsetof(struct thm_scursor, tsc_cursor.tc_path) +
+    sizeof(((struct thm_cursor *)NULL)->tc_path));
 
-	return (thm_find_impl(head, key, cr));
+/* Path is addressed from the cursor base to cover both cursor kinds */
+static __inline uintptr_t **
+thm_cursor_path(struct thm_cursor *cr)
+{
+	return ((uintptr_t **)(void *)((char *)cr +
+	    offsetof(struct thm_cursor, tc_path)));
 }
 
-struct thm_bucket *
-thm_nfind(struct thm_head *head, uint32_t key, struct thm_cursor *cr)
+static __inline void
+thm_cursor_init(struct thm_head *head, struct thm_cursor *cr)
 {
-	struct thm_cursor xcr;
-	struct thm_slot *slot;
-	uintptr_t *entp;
-	void *entval;
-	uint32_t keybit, smap;
-	u_int subkey;
-	int count, i;
+	ASSERT((head->th_flags & THM_HEAD_SKEY) == 0);
 
-	if (cr == NULL)
-		cr = &xcr;
+	cr->tc_head = head;
+	cr->tc_depth = nitems(cr->tc_path);
+}
 
-	key &= THM_KEY_MASK;
+static __inline struct thm_cursor *
+thm_scursor_init(struct thm_head *head, struct thm_scursor *scr)
+{
+	struct thm_cursor *cr = &scr->tsc_cursor;
 
-	entval = thm_find_impl(head, key, cr);
-	if (entval != NULL)
-		return (entval);
+	ASSERT((head->th_flags & THM_HEAD_SKEY) != 0);
 
-restart:
-	subkey = THM_SUBKEY(key, cr->tc_level);
-	slot = thm_ptr_get_value(*cr->tc_path[cr->tc_level]);
+	cr->tc_head = head;
+	cr->tc_depth = nitems(cr->tc_path) + nitems(scr->tsc_path);
 
-	if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
-		entp = thm_slotmax_entry(slot, subkey);
-		if (thm_ptr_get_value(*entp) != NULL)
-			goto found_eq;
-		for (i = subkey + 1; i < THM_SLOT_MAX_ENTRIES; i++) {
-			entp = thm_slotmax_entry(slot, i);
-			if (thm_ptr_get_value(*entp) != NULL)
-				goto found_gt;
+	return (cr);
+}
+
+static __inline void
+thm_cursor_push(struct thm_cursor *cr, uintptr_t *entp)
+{
+	cr->tc_level++;
+	ASSERT(cr->tc_level < cr->tc_depth);
+	thm_cursor_path(cr)[cr->tc_level] = entp;
+}
+
+/*
+ * Subkeys along the cursor path down to depth, levelp gets the key level
+ * reached.
+ */
+static uint64_t
+thm_cursor_prefix(struct thm_cursor *cr, u_int depth, u_int *levelp)
+{
+	struct thm_head *head = cr->tc_head;
+	struct thm_slot *slot;
+	uintptr_t *entp, smap, subkeys;
+	uint64_t ikey = 0;
+	u_int d, i, level = 0;
+
+	for (d = 0; d < depth; d++) {
+		slot = thm_ptr_get_value(*thm_cursor_path(cr)[d]);
+		entp = thm_cursor_path(cr)[d + 1];
+		if (thm_slot_is_wide(head, slot)) {
+			ikey = entp - thm_slotmax_entry(slot, 0);
+			level += thm_wide_levels(head);
+			continue;
 		}
-	} else {
-		smap = slot->ts_map;
-		if (smap == 0) {
-			ASSERT(cr->tc_level == 0);
-			return (NULL);
+		if (thm_slot_is_dense(head, slot)) {
+			i = entp - thm_slotmax_entry(slot, 0);
+			ikey = (ikey << (THM_DENSE_LEVELS * head->th_stride)) | i;
+			level += THM_DENSE_LEVELS;
+			continue;
 		}
-		count = THM_COUNT_1BITS_32(smap);
-		keybit = THM_KEY_BIT(subkey);
-		i = THM_COUNT_1BITS_32(smap & (keybit - 1));
-		if (i < count) {
-			entp = &slot->ts_entry[i];
-			if ((smap & keybit) != 0)
-				goto found_eq;
-			else
-				goto found_gt;
+		if (thm_slot_is_prefix(head, slot)) {
+			subkeys = thm_prefix_subkeys(slot);
+			for (i = 0; i < thm_prefix_count(slot); i++, level++) {
+				ikey = (ikey << head->th_stride) |
+				    (subkeys & (THM_FANOUT(head) - 1));
+				subkeys >>= head->th_stride;
+			}
+			continue;
+		}
+		if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+			i = entp - thm_slotmax_entry(slot, 0);
+		} else {
+			smap = thm_slot_map(slot);
+			for (i = entp - slot->ts_entry; i > 0; i--)
+				smap &= smap - 1;
+			i = THM_COUNT_TRAILING_0BITS_MAP(smap);
+		}
+		ikey = (ikey << head->th_stride) | i;
+		level++;
+	}
+	*levelp = level;
+
+	return (ikey);
+}
+
+/* Restore value mode key from subkeys along the cursor path */
+static uint64_t
+thm_cursor_ikey(struct thm_cursor *cr)
+{
+	struct thm_head *head = cr->tc_head;
+	uint64_t ikey;
+	u_int bits, level;
+
+	ikey = thm_cursor_prefix(cr, cr->tc_level, &level);
+	ASSERT(level <= head->th_levels);
+	if (level < head->th_levels) {
+		/* Leaf above the last level, the rest is in its tail */
+		bits = (head->th_levels - level) * head->th_stride;
+		ikey = (ikey << bits) | thm_tail_get(head,
+		    thm_ptr_get_value(*thm_cursor_path(cr)[cr->tc_level - 1]),
+		    thm_cursor_path(cr)[cr->tc_level], bits);
+	}
+
+	return (ikey & thm_head_keymask(head));
+}
+
+/* Compare key with the leaf cursor points to */
+static __inline int
+thm_key_cmp_leaf(struct thm_head *head, const struct thm_key *key,
+    void *entval, struct thm_cursor *cr)
+{
+	uint64_t ikey;
+
+	if ((head->th_flags & THM_HEAD_VALUE) == 0)
+		return (thm_key_cmp_entry(head, key, entval));
+
+	ikey = thm_cursor_ikey(cr);
+	if (key->tk_val == ikey)
+		return (0);
+	return (key->tk_val < ikey ? -1 : 1);
+}
+
+int
+thm_empty(struct thm_head *head)
+{
+	struct thm_slot *slot;
+	u_int n;
+
+	if (!thm_root_is_slot(head))
+		return (head->th_root == 0);
+
+	/* Value heads keep root slot left empty by failed insert */
+	slot = thm_ptr_get_value(head->th_root);
+	if ((n = thm_slot_direct(head, slot)) != 0)
+		return (thm_direct_next(head, slot, n, 0) < 0);
+
+	return (thm_slot_map(slot) == 0 && !thm_slot_is_prefix(head, slot));
+}
+
+static struct thm_bucket *
+thm_first_impl(struct thm_cursor *cr)
+{
+	struct thm_head *head = cr->tc_head;
+	struct thm_slot *slot;
+	void *entval;
+	uintptr_t *entp;
+	u_int n;
+	int i;
+
+	entval = thm_ptr_get_value(*thm_cursor_path(cr)[cr->tc_level]);
+
+	do {
+		slot = entval;
+		if ((n = thm_slot_direct(head, slot)) != 0) {
+			i = thm_direct_next(head, slot, n, 0);
+			if (i < 0)
+				return (NULL);
+			entp = thm_slotmax_entry(slot, i);
+			goto found;
+		}
+
+		if (thm_slot_map(slot) == 0 && !thm_slot_is_prefix(head, slot))
+			return (NULL);
+		entp = &slot->ts_entry[0];
+found:
+		thm_cursor_push(cr, entp);
+		entval = thm_ptr_get_value(*entp);
+	} while ((*entp & THM_PTR_MASK_SLOT) != 0);
+
+	return (thm_leaf_get_value(head, *entp));
+}
+
+struct thm_bucket *
+thm_first(struct thm_head *head, struct thm_cursor *cr)
+{
+	struct thm_cursor xcr;
+	struct thm_bucket *bucket;
+
+	if (cr == NULL)
+		cr = &xcr;
+
+	thm_cursor_init(head, cr);
+	cr->tc_level = 0;
+	thm_cursor_path(cr)[0] = &head->th_root;
+	if (!thm_root_is_slot(head))
+		return (thm_leaf_get_value(head, head->th_root));
+
+	bucket = thm_first_impl(cr);
+	ASSERT(bucket != NULL || cr->tc_level == 0);
+
+	return (bucket);
+}
+
+static struct thm_bucket *
+thm_last_impl(struct thm_cursor *cr)
+{
+	struct thm_head *head = cr->tc_head;
+	struct thm_slot *slot;
+	void *entval;
+	uintptr_t *entp;
+	u_int n;
+	int i;
+
+	entval = thm_ptr_get_value(*thm_cursor_path(cr)[cr->tc_level]);
+
+	do {
+		slot = entval;
+		if ((n = thm_slot_direct(head, slot)) != 0) {
+			i = thm_direct_prev(head, slot, n, n - 1);
+			if (i < 0)
+				return (NULL);
+			entp = thm_slotmax_entry(slot, i);
+			goto found;
+		}
+
+		if (thm_slot_map(slot) == 0) {
+			if (!thm_slot_is_prefix(head, slot))
+				return (NULL);
+			entp = &slot->ts_entry[0];
+			goto found;
+		}
+		i = THM_COUNT_1BITS_MAP(thm_slot_map(slot));
+		entp = &slot->ts_entry[i - 1];
+found:
+		thm_cursor_push(cr, entp);
+		entval = thm_ptr_get_value(*entp);
+	} while ((*entp & THM_PTR_MASK_SLOT) != 0);
+
+	return (thm_leaf_get_value(head, *entp));
+}
+
+struct thm_bucket *
+thm_last(struct thm_head *head, struct thm_cursor *cr)
+{
+	struct thm_cursor xcr;
+	struct thm_bucket *bucket;
+
+	if (cr == NULL)
+		cr = &xcr;
+
+	thm_cursor_init(head, cr);
+	cr->tc_level = 0;
+	thm_cursor_path(cr)[0] = &head->th_root;
+	if (!thm_root_is_slot(head))
+		return (thm_leaf_get_value(head, head->th_root));
+
+	bucket = thm_last_impl(cr);
+	ASSERT(bucket != NULL || cr->tc_level == 0);
+
+	return (bucket);
+}
+
+static uintptr_t *
+thm_next_step(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp)
+{
+	int count, i, n;
+
+	if ((n = thm_slot_direct(head, slot)) != 0) {
+		i = entp - thm_slotmax_entry(slot, 0);
+		ASSERT(i >= 0 && i < n);
+		i = thm_direct_next(head, slot, n, i + 1);
+		if (i < 0)
+			return (NULL);
+		return (thm_slotmax_entry(slot, i));
+	}
+
+	if (thm_slot_is_prefix(head, slot)) {
+		ASSERT(entp == &slot->ts_entry[0]);
+		return (NULL);
+	}
+
+	count = THM_COUNT_1BITS_MAP(thm_slot_map(slot));
+	i = entp - slot->ts_entry;
+	ASSERT(i >= 0 && i < count);
+	if (i + 1 >= count)
+		return (NULL);
+	entp = &slot->ts_entry[i + 1];
+
+	return (entp);
+}
+
+struct thm_bucket *
+thm_next(struct thm_cursor *cr)
+{
+	struct thm_slot *slot;
+	uintptr_t **path, *entp;
+
+	ASSERT(cr->tc_level < cr->tc_depth);
+
+	path = thm_cursor_path(cr);
+	for (; cr->tc_level > 0; cr->tc_level--) {
+		ASSERT(*path[cr->tc_level - 1] & THM_PTR_MASK_SLOT ||
+		    cr->tc_level == 1);
+		slot = thm_ptr_get_value(*path[cr->tc_level - 1]);
+		entp = thm_next_step(cr->tc_head, slot, path[cr->tc_level]);
+		if (entp == NULL)
+			continue;
+
+		path[cr->tc_level] = entp;
+		if ((*entp & THM_PTR_MASK_SLOT) == 0)
+			return (thm_leaf_get_value(cr->tc_head, *entp));
+		else
+			return (thm_first_impl(cr));
+	}
+
+	return (NULL);
+}
+
+static uintptr_t *
+thm_prev_step(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp)
+{
+	int i, n;
+
+	if ((n = thm_slot_direct(head, slot)) != 0) {
+		i = entp - thm_slotmax_entry(slot, 0);
+		ASSERT(i >= 0 && i < n);
+		i = thm_direct_prev(head, slot, n, i - 1);
+		if (i < 0)
+			return (NULL);
+		return (thm_slotmax_entry(slot, i));
+	}
+
+	i = entp - slot->ts_entry;
+	ASSERT(i >= 0);
+	ASSERT(i == 0 || !thm_slot_is_prefix(head, slot));
+	if (i == 0)
+		return (NULL);
+	entp = &slot->ts_entry[i - 1];
+
+	return (entp);
+}
+
+struct thm_bucket *
+thm_prev(struct thm_cursor *cr)
+{
+	struct thm_slot *slot;
+	uintptr_t **path, *entp;
+
+	ASSERT(cr->tc_level < cr->tc_depth);
+
+	path = thm_cursor_path(cr);
+	for (; cr->tc_level > 0; cr->tc_level--) {
+		ASSERT(*path[cr->tc_level - 1] & THM_PTR_MASK_SLOT ||
+		    cr->tc_level == 1);
+		slot = thm_ptr_get_value(*path[cr->tc_level - 1]);
+		entp = thm_prev_step(cr->tc_head, slot, path[cr->tc_level]);
+		if (entp == NULL)
+			continue;
+
+		path[cr->tc_level] = entp;
+		if ((*entp & THM_PTR_MASK_SLOT) == 0)
+			return (thm_leaf_get_value(cr->tc_head, *entp));
+		else
+			return (thm_last_impl(cr));
+	}
+
+	return (NULL);
+}
+
+static __inline uintptr_t *
+thm_find_step(struct thm_head *head, struct thm_slot *slot, u_int key)
+{
+	uintptr_t *entp;
+	uintptr_t keybit, smap;
+	u_int keyind, slen;
+
+	ASSERT(key < THM_FANOUT(head));
+
+	slen = thm_slot_get_slen(head, slot);
+	if (slen == THM_SLOTMAX_SLEN(head)) {
+		 entp = thm_slotmax_entry(slot, key);
+		 if (thm_ptr_get_value(*entp) == NULL)
+			 return (NULL);
+		 return (entp);
+	}
+
+	smap = thm_slot_map(slot);
+
+	keybit = THM_KEY_BIT(key);
+	if ((smap & keybit) == 0)
+		return (NULL);
+
+	smap &= keybit - 1;
+	keyind = THM_COUNT_1BITS_MAP(smap);
+
+	return (&slot->ts_entry[keyind]);
+}
+
+/*
+ * On failure cursor points to the last slot visited, levelp is set to key
+ * level of the slot.
+ */
+static struct thm_bucket *
+thm_find_impl(struct thm_head *head, const struct thm_key *key,
+    struct thm_cursor *cr, u_int *levelp)
+{
+	struct thm_slot *slot;
+	uintptr_t *entp;
+	void *entval;
+	u_int bits, count, depth, level;
+
+	thm_cursor_path(cr)[0] = &head->th_root;
+	entval = thm_ptr_get_value(head->th_root);
+	slot = NULL;
+	depth = 0;
+	level = 0;
+
+	if (!thm_root_is_slot(head)) {
+		/* Empty head or lone leaf in the root entry */
+		cr->tc_level = 0;
+		if (levelp != NULL)
+			*levelp = 0;
+		if (entval == NULL ||
+		    thm_leaf_fprint_miss(head, head->th_root, key->tk_val))
+			return (NULL);
+		entval = thm_leaf_get_value(head, head->th_root);
+		if (thm_key_cmp_entry(head, key, entval) != 0)
+			return (NULL);
+		return (entval);
+	}
+
+	/* Wide root entry replaces first tw_levels steps */
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		count = thm_wide_levels(head);
+		entp = thm_wide_entry(head, key);
+		if (thm_ptr_get_value(*entp) == NULL)
+			goto notfound;
+		thm_cursor_path(cr)[1] = entp;
+		entval = thm_ptr_get_value(*entp);
+		if ((*entp & THM_PTR_MASK_SLOT) == 0)
+			goto leaf;
+		depth++;
+		level += count;
+	}
+
+	for (; ; depth++) {
+		ASSERT(level < head->th_levels && depth + 1 < cr->tc_depth);
+		slot = entval;
+		if (__predict_false(thm_slot_is_dense(head, slot))) {
+			/* Dense table entry replaces the last two steps */
+			count = THM_DENSE_LEVELS;
+			entp = thm_dense_entry(head, slot, key);
+			if (thm_ptr_get_value(*entp) == NULL)
+				goto notfound;
+		} else if (__predict_false(thm_slot_map(slot) == 0) &&
+		    thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			if (thm_prefix_match(head, slot, key, level) != count)
+				goto notfound;
+			entp = &slot->ts_entry[0];
+		} else {
+			count = 1;
+			entp = thm_find_step(head, slot,
+			    thm_key_subkey(head, key, level));
+			if (entp == NULL)
+				goto notfound;
+		}
+		thm_cursor_path(cr)[depth + 1] = entp;
+		entval = thm_ptr_get_value(*entp);
+		if ((*entp & THM_PTR_MASK_SLOT) == 0)
+			break;
+		level += count;
+	}
+leaf:
+	cr->tc_level = depth + 1;
+
+	/* Path matches value mode key down to the leaf, tail holds the rest */
+	if ((head->th_flags & THM_HEAD_VALUE) != 0) {
+		if (level + count < head->th_levels) {
+			bits = thm_tail_bits(head, level);
+			if (thm_tail_get(head, slot, entp, bits) !=
+			    (key->tk_val & (((uint64_t)1 << bits) - 1)))
+				goto notfound;
+		}
+		return (entval);
+	}
+	if (thm_leaf_fprint_miss(head, *entp, key->tk_val))
+		goto notfound;
+	entval = thm_leaf_get_value(head, *entp);
+	if (thm_key_cmp_entry(head, key, entval) == 0)
+		return (entval);
+
+notfound:
+	cr->tc_level = depth;
+	if (levelp != NULL)
+		*levelp = level;
+	return (NULL);
+}
+
+struct thm_bucket *
+thm_find(struct thm_head *head, uint64_t key, struct thm_cursor *cr)
+{
+	struct thm_cursor xcr;
+	struct thm_key xkey;
+
+	xkey.tk_val = key & thm_head_keymask(head);
+
+	if (cr == NULL)
+		cr = &xcr;
+	thm_cursor_init(head, cr);
+
+	return (thm_find_impl(head, &xkey, cr, NULL));
+}
+
+/* Number of leaves below the entry */
+static u_long
+thm_subtree_leaves(struct thm_head *head, uintptr_t ent)
+{
+	struct thm_slot *slot;
+	uintptr_t smap;
+	u_long count;
+	u_int k;
+
+	if ((ent & THM_PTR_MASK_SLOT) == 0)
+		return (thm_ptr_get_value(ent) != NULL);
+
+	slot = thm_ptr_get_value(ent);
+	if (thm_slot_is_dense(head, slot))
+		return (*thm_dense_count(slot));
+	if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot))
+		return (thm_subtree_leaves(head, slot->ts_entry[0]));
+
+	count = 0;
+	if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+		for (k = 0; k < THM_FANOUT(head); k++)
+			count += thm_subtree_leaves(head,
+			    *thm_slotmax_entry(slot, k));
+		return (count);
+	}
+	smap = thm_slot_map(slot);
+	for (k = 0; smap != 0; k++, smap &= smap - 1)
+		count += thm_subtree_leaves(head, slot->ts_entry[k]);
+
+	return (count);
+}
+
+/*
+ * Number of leaves, distinct keys but in set heads. Only wide root heads
+ * keep the count, others walk the tree.
+ */
+u_long
+thm_count(struct thm_head *head)
+{
+	if ((head->th_flags & THM_HEAD_WIDE) == 0)
+		return (thm_subtree_leaves(head, head->th_root));
+
+	return (thm_head_wide(head)->tw_leaves);
+}
+
+/* Used dense table entries before ind */
+static __inline u_long
+thm_dense_rank(struct thm_head *head, struct thm_slot *slot, u_int ind)
+{
+	uint64_t *map;
+	u_long rank;
+	u_int i;
+
+	map = thm_table_map(slot, THM_DENSE_FANOUT(head));
+	for (i = 0, rank = 0; i < ind / 64; i++)
+		rank += THM_COUNT_1BITS_64(map[i]);
+	if (ind % 64 != 0)
+		rank += THM_COUNT_1BITS_64(map[i] &
+		    (((uint64_t)1 << (ind % 64)) - 1));
+
+	return (rank);
+}
+
+/*
+ * Number of keys less than key. Wide root entries before the key are
+ * summed up by the Fenwick tree, below the entry counts of subtrees left
+ * of the key path are added up. Dense tables keep their count, other
+ * slots are walked down to the leaves, see THM_WIDE_COUNT_SIZE() for the
+ * cost.
+ */
+u_long
+thm_rank(struct thm_head *head, uint64_t key)
+{
+	struct thm_key xkey;
+	struct thm_slot *slot;
+	uintptr_t ent, *entp, subkeys;
+	u_long rank;
+	u_int count, i, ind, level, sub;
+
+	ASSERT((head->th_flags & THM_HEAD_COUNT) != 0);
+
+	memset(&xkey, 0, sizeof(xkey));
+	xkey.tk_val = key & thm_head_keymask(head);
+	ind = thm_wide_index(head, xkey.tk_val);
+	rank = thm_wide_count_sum(head, ind);
+	ent = ((uintptr_t *)head->th_root)[ind];
+
+	for (level = thm_wide_levels(head); thm_ptr_get_value(ent) != NULL; ) {
+		if ((ent & THM_PTR_MASK_SLOT) == 0) {
+			/* Value mode leaf is at the last level, key matches */
+			if ((head->th_flags & THM_HEAD_VALUE) != 0)
+				break;
+			if (thm_entry_get_ikey(head,
+			    thm_leaf_get_value(head, ent)) < xkey.tk_val)
+				rank++;
+			break;
+		}
+		slot = thm_ptr_get_value(ent);
+		if (thm_slot_is_dense(head, slot)) {
+			entp = thm_dense_entry(head, slot, &xkey);
+			rank += thm_dense_rank(head, slot,
+			    entp - (uintptr_t *)slot);
+			ent = *entp;
+			level += THM_DENSE_LEVELS;
+			continue;
+		}
+		if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			i = thm_prefix_match(head, slot, &xkey, level);
+			if (i == count) {
+				ent = slot->ts_entry[0];
+				level += count;
+				continue;
+			}
+			subkeys = thm_prefix_subkeys(slot) >>
+			    (i * head->th_stride);
+			if (THM_SUBKEY(head, xkey.tk_val, level + i) >
+			    (subkeys & (THM_FANOUT(head) - 1)))
+				rank += thm_subtree_leaves(head,
+				    slot->ts_entry[0]);
+			break;
+		}
+		sub = THM_SUBKEY(head, xkey.tk_val, level);
+		for (i = 0; i < sub; i++) {
+			if ((entp = thm_find_step(head, slot, i)) != NULL)
+				rank += thm_subtree_leaves(head, *entp);
+		}
+		if ((entp = thm_find_step(head, slot, sub)) == NULL)
+			break;
+		ent = *entp;
+		level++;
+	}
+
+	return (rank);
+}
+
+/* Key of rank k counting from 0, found the same way as thm_rank does */
+struct thm_bucket *
+thm_select(struct thm_head *head, u_long k, struct thm_cursor *cr)
+{
+	struct thm_slot *slot;
+	uintptr_t ent, *entp, subkeys;
+	uint64_t *map, ikey, m;
+	u_long *counts, n;
+	u_int count, fanout, i, ind, level, step;
+
+	ASSERT((head->th_flags & THM_HEAD_COUNT) != 0);
+
+	if (k >= thm_head_wide(head)->tw_leaves)
+		return (NULL);
+
+	/* Fenwick tree descent to the entry holding the key */
+	counts = thm_wide_counts(head);
+	fanout = THM_WIDE_FANOUT(head);
+	ind = 0;
+	for (step = fanout; step != 0; step >>= 1) {
+		if (ind + step <= fanout && counts[ind + step - 1] <= k) {
+			ind += step;
+			k -= counts[ind - 1];
+		}
+	}
+	ASSERT(ind < fanout);
+	level = thm_wide_levels(head);
+	ikey = (uint64_t)ind << (head->th_stride * (head->th_levels - level));
+	ent = ((uintptr_t *)head->th_root)[ind];
+
+	while ((ent & THM_PTR_MASK_SLOT) != 0) {
+		slot = thm_ptr_get_value(ent);
+		if (thm_slot_is_dense(head, slot)) {
+			map = thm_table_map(slot, THM_DENSE_FANOUT(head));
+			for (i = 0; (n = THM_COUNT_1BITS_64(map[i])) <= k; i++)
+				k -= n;
+			for (m = map[i]; k > 0; k--)
+				m &= m - 1;
+			ind = i * 64 + THM_COUNT_TRAILING_0BITS_64(m);
+			ikey |= ind;
+			ent = ((uintptr_t *)slot)[ind];
+			break;
+		}
+		if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			subkeys = thm_prefix_subkeys(slot);
+			for (i = 0; i < count; i++, level++,
+			    subkeys >>= head->th_stride)
+				ikey |= (uint64_t)(subkeys &
+				    (THM_FANOUT(head) - 1)) <<
+				    (head->th_stride * (head->th_levels - 1 -
+				    level));
+			ent = slot->ts_entry[0];
+			continue;
+		}
+		for (i = 0; ; i++) {
+			ASSERT(i < THM_FANOUT(head));
+			if ((entp = thm_find_step(head, slot, i)) == NULL)
+				continue;
+			n = thm_subtree_leaves(head, *entp);
+			if (k < n)
+				break;
+			k -= n;
+		}
+		ikey |= (uint64_t)i <<
+		    (head->th_stride * (head->th_levels - 1 - level));
+		ent = *entp;
+		level++;
+	}
+	ASSERT(k == 0 && thm_ptr_get_value(ent) != NULL);
+
+	if ((head->th_flags & THM_HEAD_VALUE) == 0)
+		ikey = thm_entry_get_ikey(head, thm_leaf_get_value(head, ent));
+
+	return (thm_find(head, ikey, cr));
+}
+
+/* Number of keys from lo to hi inclusive */
+u_long
+thm_count_range(struct thm_head *head, uint64_t lo, uint64_t hi)
+{
+	u_long count;
+
+	lo &= thm_head_keymask(head);
+	hi &= thm_head_keymask(head);
+	if (lo > hi)
+		return (0);
+
+	count = hi == thm_head_keymask(head) ? thm_head_wide(head)->tw_leaves :
+	    thm_rank(head, hi + 1);
+
+	return (count - thm_rank(head, lo));
+}
+
+/* Summary of leaves below the entry, walked like thm_subtree_leaves() */
+static uint64_t
+thm_subtree_aggr(struct thm_head *head, uintptr_t ent)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	struct thm_slot *slot;
+	uintptr_t smap;
+	uint64_t *map, m, sum;
+	u_int i, k;
+
+	if ((ent & THM_PTR_MASK_SLOT) == 0) {
+		if (thm_ptr_get_value(ent) == NULL)
+			return (aggr->ta_identity);
+		return (aggr->ta_value(thm_leaf_get_value(head, ent)));
+	}
+
+	slot = thm_ptr_get_value(ent);
+	sum = aggr->ta_identity;
+	if (thm_slot_is_dense(head, slot)) {
+		map = thm_table_map(slot, THM_DENSE_FANOUT(head));
+		for (i = 0; i < THM_DENSE_FANOUT(head) / 64; i++) {
+			for (m = map[i]; m != 0; m &= m - 1) {
+				k = i * 64 + THM_COUNT_TRAILING_0BITS_64(m);
+				sum = aggr->ta_combine(sum, thm_subtree_aggr(head,
+				    ((uintptr_t *)slot)[k]));
+			}
+		}
+		return (sum);
+	}
+	if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot))
+		return (thm_subtree_aggr(head, slot->ts_entry[0]));
+	if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+		for (k = 0; k < THM_FANOUT(head); k++)
+			sum = aggr->ta_combine(sum, thm_subtree_aggr(head,
+			    *thm_slotmax_entry(slot, k)));
+		return (sum);
+	}
+	smap = thm_slot_map(slot);
+	for (k = 0; smap != 0; k++, smap &= smap - 1)
+		sum = aggr->ta_combine(sum, thm_subtree_aggr(head,
+		    slot->ts_entry[k]));
+
+	return (sum);
+}
+
+/* Summarize wide root entry again and fix the tree above it */
+static void
+thm_wide_aggr_refresh(struct thm_head *head, u_int ind)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	uint64_t *tree = thm_wide_aggrs(head);
+
+	tree[THM_WIDE_FANOUT(head) + ind] = thm_subtree_aggr(head,
+	    ((uintptr_t *)head->th_root)[ind]);
+	for (ind = (THM_WIDE_FANOUT(head) + ind) / 2; ind > 0; ind /= 2)
+		tree[ind] = aggr->ta_combine(tree[2 * ind], tree[2 * ind + 1]);
+}
+
+/* Segment tree built bottom up */
+static void
+thm_wide_aggr_build(struct thm_head *head)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	uintptr_t *table = (uintptr_t *)head->th_root;
+	uint64_t *tree = thm_wide_aggrs(head);
+	u_int fanout = THM_WIDE_FANOUT(head);
+	u_int i;
+
+	for (i = 0; i < fanout; i++)
+		tree[fanout + i] = thm_subtree_aggr(head, table[i]);
+	for (i = fanout - 1; i > 0; i--)
+		tree[i] = aggr->ta_combine(tree[2 * i], tree[2 * i + 1]);
+}
+
+/* Bucket or value of the key changed in place */
+static __inline void
+thm_leaf_changed(struct thm_head *head, uint64_t ikey)
+{
+	if ((head->th_flags & THM_HEAD_AGGR) != 0)
+		thm_wide_aggr_refresh(head, thm_wide_index(head, ikey));
+	if ((head->th_flags & THM_HEAD_DIGEST) != 0)
+		thm_wide_digest_dirty(head, thm_wide_index(head, ikey));
+}
+
+/* Integer key of the bucket cursor points to */
+static __inline uint64_t
+thm_leaf_ikey(struct thm_head *head, struct thm_cursor *cr,
+    struct thm_bucket *bucket)
+{
+	if ((head->th_flags & THM_HEAD_VALUE) != 0)
+		return (thm_cursor_ikey(cr));
+
+	return (thm_entry_get_ikey(head, (struct thm_entry *)bucket));
+}
+
+/* Combine keys from lo to hi, the range is within a wide root entry */
+static uint64_t
+thm_aggr_walk(struct thm_head *head, uint64_t lo, uint64_t hi, uint64_t sum)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	struct thm_cursor cr;
+	struct thm_bucket *bucket;
+
+	for (bucket = thm_nfind(head, lo, &cr); bucket != NULL;
+	    bucket = thm_next(&cr)) {
+		if (thm_leaf_ikey(head, &cr, bucket) > hi)
+			break;
+		sum = aggr->ta_combine(sum, aggr->ta_value(bucket));
+	}
+
+	return (sum);
+}
+
+/*
+ * Summary of keys from lo to hi inclusive. Wide root entries between the
+ * boundary entries are combined from the segment tree in O(log fanout),
+ * keys of boundary entries are walked from thm_nfind().
+ */
+uint64_t
+thm_aggregate(struct thm_head *head, uint64_t lo, uint64_t hi)
+{
+	const struct thm_aggr *aggr = thm_head_wide(head)->tw_aggr;
+	uint64_t *tree, sum;
+	u_int ihi, ilo, shift;
+
+	ASSERT((head->th_flags & THM_HEAD_AGGR) != 0);
+
+	lo &= thm_head_keymask(head);
+	hi &= thm_head_keymask(head);
+	if (lo > hi)
+		return (aggr->ta_identity);
+
+	ilo = thm_wide_index(head, lo);
+	ihi = thm_wide_index(head, hi);
+	if (ilo == ihi)
+		return (thm_aggr_walk(head, lo, hi, aggr->ta_identity));
+
+	shift = head->th_stride * (head->th_levels - thm_wide_levels(head));
+	sum = thm_aggr_walk(head, lo,
+	    ((uint64_t)ilo << shift) | (((uint64_t)1 << shift) - 1),
+	    aggr->ta_identity);
+
+	tree = thm_wide_aggrs(head);
+	for (ilo += THM_WIDE_FANOUT(head) + 1, ihi += THM_WIDE_FANOUT(head);
+	    ilo < ihi; ilo /= 2, ihi /= 2) {
+		if ((ilo & 1) != 0)
+			sum = aggr->ta_combine(sum, tree[ilo++]);
+		if ((ihi & 1) != 0)
+			sum = aggr->ta_combine(sum, tree[--ihi]);
+	}
+
+	return (thm_aggr_walk(head, (uint64_t)thm_wide_index(head, hi) << shift,
+	    hi, sum));
+}
+
+/* Summary of the key changed without insert or remove */
+void
+thm_aggr_update(struct thm_head *head, uint64_t key)
+{
+	ASSERT((head->th_flags & THM_HEAD_AGGR) != 0);
+
+	thm_leaf_changed(head, key & thm_head_keymask(head));
+}
+
+struct thm_bucket *
+thm_sfind(struct thm_head *head, const void *key, size_t len,
+    struct thm_scursor *scr)
+{
+	struct thm_scursor xscr;
+	struct thm_key xkey;
+
+	if (len > THM_SKEY_MAXLEN)
+		return (NULL);
+
+	xkey.tk_str = key;
+	xkey.tk_len = len;
+
+	if (scr == NULL)
+		scr = &xscr;
+
+	return (thm_find_impl(head, &xkey, thm_scursor_init(head, scr),
+	    NULL));
+}
+
+struct thm_bucket *
+thm_sfirst(struct thm_head *head, struct thm_scursor *scr)
+{
+	struct thm_cursor *cr;
+	struct thm_bucket *bucket;
+
+	cr = thm_scursor_init(head, scr);
+	cr->tc_level = 0;
+	thm_cursor_path(cr)[0] = &head->th_root;
+	if (!thm_root_is_slot(head))
+		return (thm_leaf_get_value(head, head->th_root));
+
+	bucket = thm_first_impl(cr);
+	ASSERT(bucket != NULL || cr->tc_level == 0);
+
+	return (bucket);
+}
+
+struct thm_bucket *
+thm_slast(struct thm_head *head, struct thm_scursor *scr)
+{
+	struct thm_cursor *cr;
+	struct thm_bucket *bucket;
+
+	cr = thm_scursor_init(head, scr);
+	cr->tc_level = 0;
+	thm_cursor_path(cr)[0] = &head->th_root;
+	if (!thm_root_is_slot(head))
+		return (thm_leaf_get_value(head, head->th_root));
+
+	bucket = thm_last_impl(cr);
+	ASSERT(bucket != NULL || cr->tc_level == 0);
+
+	return (bucket);
+}
+
+static struct thm_bucket *
+thm_nfind_impl(struct thm_head *head, const struct thm_key *key,
+    struct thm_cursor *cr)
+{
+	struct thm_slot *slot;
+	uintptr_t *entp;
+	void *entval;
+	uintptr_t keybit, smap;
+	u_int level, n, subkey;
+	int count, i;
+
+	entval = thm_find_impl(head, key, cr, &level);
+	if (entval != NULL)
+		return (entval);
+	if (!thm_root_is_slot(head)) {
+		entval = thm_leaf_get_value(head, head->th_root);
+		if (entval == NULL || thm_key_cmp_entry(head, key, entval) > 0)
+			return (NULL);
+		return (entval);
+	}
+
+restart:
+	slot = thm_ptr_get_value(*thm_cursor_path(cr)[cr->tc_level]);
+
+	if (thm_slot_is_wide(head, slot)) {
+		/* Levels below are consumed with the first one */
+		subkey = thm_wide_entry(head, key) - thm_slotmax_entry(slot, 0);
+		level += thm_wide_levels(head) - 1;
+		n = THM_WIDE_FANOUT(head);
+		goto direct;
+	}
+
+	if (thm_slot_is_dense(head, slot)) {
+		subkey = thm_dense_entry(head, slot, key) -
+		    thm_slotmax_entry(slot, 0);
+		level += THM_DENSE_LEVELS - 1;
+		n = THM_DENSE_FANOUT(head);
+		goto direct;
+	}
+
+	if (thm_slot_is_prefix(head, slot)) {
+		entp = &slot->ts_entry[0];
+		count = thm_prefix_count(slot);
+		n = thm_prefix_match(head, slot, key, level);
+		if (n == (u_int)count) {
+			level += count - 1;
+			goto found_eq;
+		}
+		subkey = (thm_prefix_subkeys(slot) >> (n * head->th_stride)) &
+		    (THM_FANOUT(head) - 1);
+		if (thm_key_subkey(head, key, level + n) < subkey)
+			goto found_gt;
+		goto backtrack;
+	}
+
+	subkey = thm_key_subkey(head, key, level);
+
+	if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+		n = THM_FANOUT(head);
+direct:
+		entp = thm_slotmax_entry(slot, subkey);
+		if (thm_ptr_get_value(*entp) != NULL)
+			goto found_eq;
+		i = thm_direct_next(head, slot, n, subkey + 1);
+		if (i >= 0) {
+			entp = thm_slotmax_entry(slot, i);
+			goto found_gt;
+		}
+	} else {
+		smap = thm_slot_map(slot);
+		if (smap == 0) {
+			ASSERT(cr->tc_level == 0);
+			return (NULL);
+		}
+		count = THM_COUNT_1BITS_MAP(smap);
+		keybit = THM_KEY_BIT(subkey);
+		i = THM_COUNT_1BITS_MAP(smap & (keybit - 1));
+		if (i < count) {
+			entp = &slot->ts_entry[i];
+			if ((smap & keybit) != 0)
+				goto found_eq;
+			else
+				goto found_gt;
+		}
+	}
+
+backtrack:
+	/* Nothing greater in the tree if the miss was at root */
+	entval = cr->tc_level > 0 ? thm_next(cr) : NULL;
+	goto done;
+
+found_gt:
+	thm_cursor_push(cr, entp);
+	if ((*entp & THM_PTR_MASK_SLOT) != 0)
+		entval = thm_first_impl(cr);
+	else
+		entval = thm_leaf_get_value(head, *entp);
+	goto done;
+
+found_eq:
+	thm_cursor_push(cr, entp);
+	if ((*entp & THM_PTR_MASK_SLOT) != 0) {
+		level++;
+		goto restart;
+	}
+	else {
+		entval = thm_leaf_get_value(head, *entp);
+		if (thm_key_cmp_leaf(head, key, entval, cr) > 0)
+			entval = thm_next(cr);
+	}
+
+done:
+	ASSERT(entval == NULL || thm_key_cmp_leaf(head, key, entval, cr) < 0);
+	return (entval);
+}
+
+struct thm_bucket *
+thm_nfind(struct thm_head *head, uint64_t key, struct thm_cursor *cr)
+{
+	struct thm_cursor xcr;
+	struct thm_key xkey;
+
+	xkey.tk_val = key & thm_head_keymask(head);
+
+	if (cr == NULL)
+		cr = &xcr;
+	thm_cursor_init(head, cr);
+
+	return (thm_nfind_impl(head, &xkey, cr));
+}
+
+struct thm_bucket *
+thm_snfind(struct thm_head *head, const void *key, size_t len,
+    struct thm_scursor *scr)
+{
+	struct thm_scursor xscr;
+	struct thm_key xkey;
+
+	if (len > THM_SKEY_MAXLEN)
+		return (NULL);
+
+	xkey.tk_str = key;
+	xkey.tk_len = len;
+
+	if (scr == NULL)
+		scr = &xscr;
+
+	return (thm_nfind_impl(head, &xkey, thm_scursor_init(head, scr)));
+}
+
+/*
+ * Returns entry for the key, new entries are empty. Bits is the tail width
+ * if the new entry is a leaf taking a zero tail, slot must stay compressed.
+ */
+static uintptr_t *
+thm_insert_step(struct thm_head *head, uintptr_t *slotp, u_int key,
+    u_int bits)
+{
+	struct thm_pool *pool = head->th_pool;
+	struct thm_slot *slot, *oslot;
+	uintptr_t keybit, smap, *entp;
+	u_int count, keyind, nslen, ntails, nwords, slen, used;
+
+	ASSERT(key < THM_FANOUT(head));
+
+	slot = thm_ptr_get_value(*slotp);
+	slen = thm_slot_get_slen(head, slot);
+	if (slen == THM_SLOTMAX_SLEN(head)) {
+		ASSERT(bits == 0);
+		return (thm_slotmax_entry(slot, key));
+	}
+
+	smap = thm_slot_map(slot);
+	keybit = THM_KEY_BIT(key);
+	keyind = THM_COUNT_1BITS_MAP(smap & (keybit - 1));
+
+	if ((smap & keybit) != 0)
+		return (&slot->ts_entry[keyind]);
+
+	/* Insert new entry */
+	count = THM_COUNT_1BITS_MAP(smap);
+	ntails = bits != 0 ? thm_tail_count(head, slot) : 0;
+	nwords = thm_tail_words(bits, ntails);
+	used = count + 1 + thm_tail_words(bits, ntails + 1);
+	ASSERT(count + nwords + 1 <= slen * THM_SLOT_MIN_ENTRIES);
+
+	nslen = thm_slot_next_slen(head, slen);
+	if (used + 1 > slen * THM_SLOT_MIN_ENTRIES &&
+	    thm_slot_tryextend(pool, slot, slen, nslen)) {
+		if (nslen == THM_SLOTMAX_SLEN(head)) {
+			ASSERT(bits == 0);
+			thm_slotmax_fix_extend(head, slot,
+			    (struct thm_slotmax *)slot);
+			return (thm_slotmax_entry(slot, key));
+		}
+		thm_tail_move(slot, nwords, slen, nslen);
+		slen = nslen;
+		thm_slot_set_slen(head, slot, slen);
+		nslen = thm_slot_next_slen(head, slen);
+	}
+	if (used + 1 <= slen * THM_SLOT_MIN_ENTRIES) {
+		slot->ts_map |= keybit;
+		for (u_int i = count; i > keyind; i--)
+			slot->ts_entry[i] = slot->ts_entry[i - 1];
+		slot->ts_entry[keyind] = 0;
+		if (keyind < THM_SLOT_SLEN_ENTRIES)
+			thm_slot_set_slen(head, slot, slen);
+		if (bits != 0)
+			thm_tail_open(head, slot, &slot->ts_entry[keyind],
+			    bits, ntails);
+		ASSERT((u_int)THM_COUNT_1BITS_MAP(thm_slot_map(slot)) + 1 <=
+		    slen * THM_SLOT_MIN_ENTRIES);
+		return (&slot->ts_entry[keyind]);
+	}
+
+	/* Allocate larger slot */
+	ASSERT(bits == 0 || nslen != THM_SLOTMAX_SLEN(head));
+	oslot = slot;
+	slot = thm_slot_alloc(pool, nslen, oslot);
+	if (slot == NULL)
+		return (NULL);
+
+	thm_ptr_set_slot(slotp, slot);
+
+	if (nslen == THM_SLOTMAX_SLEN(head)) {
+		thm_slotmax_fix_extend(head, oslot,
+		    (struct thm_slotmax *)slot);
+		thm_slot_free(pool, oslot, slen);
+		return (thm_slotmax_entry(slot, key));
+	}
+
+	slot->ts_map = oslot->ts_map | keybit;
+	for (u_int i = 0; i < keyind; i++)
+		slot->ts_entry[i] = oslot->ts_entry[i];
+	slot->ts_entry[keyind] = 0;
+	for (u_int i = keyind; i < count; i++)
+		slot->ts_entry[i + 1] = oslot->ts_entry[i];
+	if (bits != 0) {
+		entp = &slot->ts_entry[nslen * THM_SLOT_MIN_ENTRIES - 1 -
+		    nwords];
+		memcpy(entp, &oslot->ts_entry[slen * THM_SLOT_MIN_ENTRIES -
+		    1 - nwords], nwords * sizeof(uintptr_t));
+	}
+	thm_slot_set_slen(head, slot, nslen);
+	if (bits != 0)
+		thm_tail_open(head, slot, &slot->ts_entry[keyind], bits,
+		    ntails);
+	thm_slot_free(pool, oslot, slen);
+
+	ASSERT((u_int)THM_COUNT_1BITS_MAP(thm_slot_map(slot)) + 1 <=
+	    nslen * THM_SLOT_MIN_ENTRIES);
+
+	return (&slot->ts_entry[keyind]);
+}
+
+static uintptr_t *
+thm_insert_mkslot(struct thm_head *head, uintptr_t *slotp, u_int subkey_n,
+    struct thm_entry *entry1, const struct thm_key *key1,
+    struct thm_entry *entry2, const struct thm_key *key2)
+{
+	struct thm_slot *chunk[howmany(THM_LEVELS_MAX, THM_SLEN_MAX)];
+	struct thm_slot *slot;
+	uintptr_t *ent1, *ent2;
+	u_int i, left, n, nskip, nslots, subkey1, subkey2;
+
+	/* Shared subkeys are skipped by prefix slots */
+	nskip = thm_key_difflevel(head, key1, key2) - subkey_n;
+	nslots = howmany(nskip, THM_PREFIX_MAX(head)) + 1;
+
+	/* Chained slots may not fit into single allocation for long keys */
+	for (i = 0, left = nslots; left > 0; i++, left -= n) {
+		n = MIN(left, THM_SLEN_MAX);
+		chunk[i] = thm_slot_alloc(head->th_pool, n,
+		    i == 0 ? thm_slot_hint(head, slotp) : chunk[i - 1]);
+		if (chunk[i] == NULL) {
+			while (i-- > 0)
+				thm_slot_free(head->th_pool, chunk[i],
+				    THM_SLEN_MAX);
+			return (NULL);
+		}
+		memset(chunk[i], 0, n * THM_SLOT_SIZE);
+	}
+
+	for (i = 0; ; i++, subkey_n += n, nskip -= n) {
+		slot = (struct thm_slot *)((uintptr_t *)chunk[i / THM_SLEN_MAX] +
+		    (i % THM_SLEN_MAX) * THM_SLOT_MIN_ENTRIES);
+		if (nskip == 0)
+			break;
+		n = MIN(nskip, THM_PREFIX_MAX(head));
+		thm_prefix_init(head, slot,
+		    thm_prefix_pack(head, key1, subkey_n, n), n, 0);
+		thm_ptr_set_slot(slotp, slot);
+		slotp = &slot->ts_entry[0];
+	}
+	ASSERT(i + 1 == nslots);
+
+	subkey1 = thm_key_subkey(head, key1, subkey_n);
+	subkey2 = thm_key_subkey(head, key2, subkey_n);
+	ASSERT(subkey1 != subkey2);
+
+	slot->ts_map = THM_KEY_BIT(subkey1) | THM_KEY_BIT(subkey2);
+	thm_ptr_set_slot(slotp, slot);
+	if (subkey1 < subkey2) {
+		ent1 = &slot->ts_entry[0];
+		ent2 = &slot->ts_entry[1];
+	} else {
+		ent1 = &slot->ts_entry[1];
+		ent2 = &slot->ts_entry[0];
+	}
+	thm_bucket_insert(head, ent1, entry1);
+	thm_bucket_set(head, ent2, entry2);
+
+	return (ent1);
+}
+
+/*
+ * Split prefix slot at the first subkey not matching the key, returns empty
+ * entry for the key in the new branch slot.
+ */
+static uintptr_t *
+thm_prefix_split(struct thm_head *head, uintptr_t *slotp, u_int n,
+    const struct thm_key *key, u_int level)
+{
+	struct thm_slot *slot, *branch, *lower;
+	uintptr_t child, subkeys, *entp, *lowerp;
+	u_int count, psubkey, ksubkey;
+
+	slot = thm_ptr_get_value(*slotp);
+	subkeys = thm_prefix_subkeys(slot);
+	count = thm_prefix_count(slot);
+	child = slot->ts_entry[0];
+	ASSERT(n < count);
+
+	psubkey = (subkeys >> (n * head->th_stride)) & (THM_FANOUT(head) - 1);
+	ksubkey = thm_key_subkey(head, key, level + n);
+	ASSERT(psubkey != ksubkey);
+
+	branch = thm_slot_alloc_zero(head->th_pool, 1, slot);
+	if (branch == NULL)
+		return (NULL);
+
+	/* Subkeys below the split point */
+	lower = NULL;
+	if (n + 1 < count) {
+		if (n == 0)
+			lower = slot;
+		else {
+			lower = thm_slot_alloc(head->th_pool, 1, slot);
+			if (lower == NULL) {
+				thm_slot_free(head->th_pool, branch, 1);
+				return (NULL);
+			}
+		}
+		thm_prefix_init(head, lower,
+		    subkeys >> ((n + 1) * head->th_stride), count - n - 1,
+		    child);
+	}
+
+	branch->ts_map = THM_KEY_BIT(psubkey) | THM_KEY_BIT(ksubkey);
+	if (psubkey < ksubkey) {
+		lowerp = &branch->ts_entry[0];
+		entp = &branch->ts_entry[1];
+	} else {
+		lowerp = &branch->ts_entry[1];
+		entp = &branch->ts_entry[0];
+	}
+	if (lower != NULL)
+		thm_ptr_set_slot(lowerp, lower);
+	else
+		thm_ptr_copy(lowerp, child);
+
+	if (n > 0) {
+		/* Keep upper subkeys in place */
+		thm_prefix_init(head, slot,
+		    subkeys & ((THM_KEY_BIT(n * head->th_stride)) - 1), n,
+		    (uintptr_t)branch | THM_PTR_MASK_SLOT);
+	} else {
+		thm_ptr_set_slot(slotp, branch);
+		if (lower != slot)
+			thm_slot_free(head->th_pool, slot, 1);
+	}
+
+	return (entp);
+}
+
+/*
+ * Add a level to the wide root table. Each entry of the old table becomes
+ * fanout entries of the new one taking the child slot apart, prefix slots
+ * lose their first subkey. Best effort, the table is kept on failure.
+ */
+static void
+thm_wide_grow(struct thm_head *head)
+{
+	struct thm_wide *tw;
+	struct thm_slot *slot;
+	struct thm_key key;
+	uintptr_t *otable, *table, *entp, smap, subkeys;
+	uint64_t *map;
+	u_long *counts;
+	u_int count, fanout, i, k, level, ofanout, slen;
+
+	level = thm_wide_levels(head);
+	ofanout = THM_WIDE_FANOUT(head);
+	fanout = ofanout << head->th_stride;
+	otable = (uintptr_t *)head->th_root;
+	tw = thm_table_alloc(sizeof(*tw) + thm_wide_size(head, fanout), 0);
+	if (tw == NULL)
+		return;
+	*tw = *thm_head_wide(head);
+	tw->tw_levels++;
+	table = (uintptr_t *)(tw + 1);
+
+	for (i = 0; i < ofanout; i++) {
+		if (thm_ptr_get_value(otable[i]) == NULL)
+			continue;
+		entp = table + (i << head->th_stride);
+		if ((otable[i] & THM_PTR_MASK_SLOT) == 0) {
+			/* Value leaves are at the last level */
+			ASSERT((head->th_flags & THM_HEAD_VALUE) == 0);
+			thm_entry_get_key(head,
+			    thm_leaf_get_value(head, otable[i]), &key);
+			entp[thm_key_subkey(head, &key, level)] = otable[i];
+			continue;
+		}
+		slot = thm_ptr_get_value(otable[i]);
+		if (thm_slot_is_prefix(head, slot)) {
+			subkeys = thm_prefix_subkeys(slot);
+			count = thm_prefix_count(slot);
+			entp += subkeys & (THM_FANOUT(head) - 1);
+			if (count == 1) {
+				*entp = slot->ts_entry[0] & ~THM_PTR_MASK_SLEN;
+				thm_slot_free(head->th_pool, slot, 1);
+			} else {
+				thm_prefix_init(head, slot,
+				    subkeys >> head->th_stride, count - 1,
+				    slot->ts_entry[0]);
+				*entp = otable[i];
+			}
+			continue;
+		}
+		slen = thm_slot_get_slen(head, slot);
+		if (slen == THM_SLOTMAX_SLEN(head)) {
+			for (k = 0; k < THM_FANOUT(head); k++)
+				entp[k] = *thm_slotmax_entry(slot, k) &
+				    ~THM_PTR_MASK_SLEN;
+		} else {
+			smap = thm_slot_map(slot);
+			for (k = 0; smap != 0; k++, smap &= smap - 1)
+				entp[THM_COUNT_TRAILING_0BITS_MAP(smap)] =
+				    slot->ts_entry[k] & ~THM_PTR_MASK_SLEN;
+		}
+		thm_slot_free(head->th_pool, slot, slen);
+	}
+
+	map = thm_table_map(table, fanout);
+	for (i = 0; i < fanout; i++) {
+		if (thm_ptr_get_value(table[i]) != NULL)
+			map[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+
+	head->th_root = (uintptr_t)table;
+	thm_table_free((struct thm_wide *)otable - 1);
+
+	if ((head->th_flags & THM_HEAD_COUNT) != 0) {
+		/* Fenwick tree built bottom up */
+		counts = thm_wide_counts(head);
+		for (i = 0; i < fanout; i++)
+			counts[i] += thm_subtree_leaves(head, table[i]);
+		for (i = 1; i <= fanout; i++) {
+			k = i + (i & -i);
+			if (k <= fanout)
+				counts[k - 1] += counts[i - 1];
+		}
+	}
+	if ((head->th_flags & THM_HEAD_AGGR) != 0)
+		thm_wide_aggr_build(head);
+	if ((head->th_flags & THM_HEAD_DIGEST) != 0)
+		memset(thm_wide_digests(head) + 2 * fanout, 0xff,
+		    2 * fanout / NBBY);
+}
+
+/* Slot length fitting count entries, the same sizes insert grows through */
+static __inline u_int
+thm_slot_fit_slen(struct thm_head *head, u_int count)
+{
+	u_int slen;
+
+	slen = howmany(count + 1, THM_SLOT_MIN_ENTRIES);
+	if (slen >= MIN(THM_SLOTMAX_SLEN(head), THM_SLEN_MAX))
+		return (THM_SLOTMAX_SLEN(head));
+
+	return (slen);
+}
+
+/*
+ * Replace slot at level th_levels - 2 and the last level slots below it
+ * with a dense table. Rows are leaves pulled up into the slot, value leaves
+ * with a tail, value mode prefix slots or last level slots. Best effort,
+ * the slots are kept if the keys are too sparse or on allocation failure.
+ */
+static void
+thm_dense_promote(struct thm_head *head, uintptr_t *slotp)
+{
+	struct thm_slot *slot, *row;
+	struct thm_key key;
+	uintptr_t *entp, *rowp, *table;
+	uint64_t *map;
+	u_long count;
+	u_int i, k, n;
+
+	n = THM_FANOUT(head);
+	slot = thm_ptr_get_value(*slotp);
+	for (count = 0, i = 0; i < n; i++) {
+		if ((rowp = thm_find_step(head, slot, i)) == NULL)
+			continue;
+		row = thm_ptr_get_value(*rowp);
+		if ((*rowp & THM_PTR_MASK_SLOT) == 0 ||
+		    thm_slot_is_prefix(head, row))
+			count++;
+		else if (thm_slot_get_slen(head, row) ==
+		    THM_SLOTMAX_SLEN(head)) {
+			for (k = 0; k < n; k++) {
+				if (thm_ptr_get_value(
+				    *thm_slotmax_entry(row, k)) != NULL)
+					count++;
+			}
+		} else
+			count += THM_COUNT_1BITS_MAP(thm_slot_map(row));
+	}
+	if (count < THM_DENSE_PROMOTE(head))
+		return;
+
+	table = thm_table_alloc(THM_DENSE_SIZE(head), 0);
+	if (table == NULL)
+		return;
+	table = (uintptr_t *)((char *)table + THM_DENSE_OFFSET);
+
+	for (i = 0; i < n; i++) {
+		if ((rowp = thm_find_step(head, slot, i)) == NULL)
+			continue;
+		entp = table + (i << head->th_stride);
+		if ((*rowp & THM_PTR_MASK_SLOT) == 0) {
+			if ((head->th_flags & THM_HEAD_VALUE) != 0)
+				k = thm_tail_get(head, slot, rowp,
+				    head->th_stride);
+			else {
+				thm_entry_get_key(head,
+				    thm_leaf_get_value(head, *rowp), &key);
+				k = thm_key_subkey(head, &key,
+				    head->th_levels - 1);
+			}
+			entp[k] = *rowp & ~THM_PTR_MASK_SLEN;
+			continue;
+		}
+		row = thm_ptr_get_value(*rowp);
+		if (thm_slot_is_prefix(head, row)) {
+			ASSERT(thm_prefix_count(row) == 1);
+			entp[thm_prefix_subkeys(row)] =
+			    row->ts_entry[0] & ~THM_PTR_MASK_SLEN;
+			thm_slot_free(head->th_pool, row, 1);
+			continue;
+		}
+		for (k = 0; k < n; k++) {
+			if ((rowp = thm_find_step(head, row, k)) != NULL)
+				entp[k] = *rowp & ~THM_PTR_MASK_SLEN;
+		}
+		thm_slot_free(head->th_pool, row,
+		    thm_slot_get_slen(head, row));
+	}
+	thm_slot_free(head->th_pool, slot, thm_slot_get_slen(head, slot));
+
+	map = thm_table_map(table, THM_DENSE_FANOUT(head));
+	for (i = 0; i < THM_DENSE_FANOUT(head); i++) {
+		if (thm_ptr_get_value(table[i]) != NULL)
+			map[i / 64] |= (uint64_t)1 << (i % 64);
+	}
+	*thm_dense_count((struct thm_slot *)table) = count;
+	thm_ptr_set_slot(slotp, (struct thm_slot *)table);
+}
+
+/* New leaf went into last level slot under slotp, promote once it's full */
+static void
+thm_dense_check(struct thm_head *head, uintptr_t *slotp, uintptr_t *rowp)
+{
+	struct thm_slot *slot, *row;
+	u_int i;
+
+	row = thm_ptr_get_value(*rowp);
+	if (thm_slot_get_slen(head, row) != THM_SLOTMAX_SLEN(head))
+		return;
+	for (i = 0; i < THM_FANOUT(head); i++) {
+		if (thm_ptr_get_value(*thm_slotmax_entry(row, i)) == NULL)
+			return;
+	}
+
+	slot = thm_ptr_get_value(*slotp);
+	if (thm_slot_is_wide(head, slot) || thm_slot_is_prefix(head, slot))
+		return;
+	thm_dense_promote(head, slotp);
+}
+
+/* Occupancy of dense table row, entries sharing the upper subkey */
+static __inline uintptr_t
+thm_dense_rowmap(struct thm_head *head, struct thm_slot *slot, u_int row)
+{
+	uint64_t *map, m;
+	u_int n = THM_FANOUT(head);
+
+	map = thm_table_map(slot, THM_DENSE_FANOUT(head));
+	m = map[row * n / 64] >> (row * n % 64);
+	if (n < 64)
+		m &= ((uint64_t)1 << n) - 1;
+
+	return ((uintptr_t)m);
+}
+
+/* Allocate slot for count entries, zeroed to keep unused entries clear */
+static struct thm_slot *
+thm_dense_slot_alloc(struct thm_head *head, u_int count)
+{
+	struct thm_slot *slot;
+	u_int slen;
+
+	slen = thm_slot_fit_slen(head, count);
+	slot = thm_slot_alloc(head->th_pool, slen, NULL);
+	if (slot != NULL)
+		memset(slot, 0, slen * THM_SLOT_SIZE);
+
+	return (slot);
+}
+
+/* Fill slot allocated by thm_dense_slot_alloc() with entries of the map */
+static void
+thm_dense_slot_fill(struct thm_head *head, struct thm_slot *slot,
+    uintptr_t smap, uintptr_t *ents)
+{
+	u_int count, i, k;
+
+	count = THM_COUNT_1BITS_MAP(smap);
+	if (thm_slot_fit_slen(head, count) != THM_SLOTMAX_SLEN(head))
+		slot->ts_map = smap;
+	for (k = 0; smap != 0; smap &= smap - 1, k++) {
+		i = THM_COUNT_TRAILING_0BITS_MAP(smap);
+		if (thm_slot_fit_slen(head, count) == THM_SLOTMAX_SLEN(head))
+			*thm_slotmax_entry(slot, i) = ents[i];
+		else
+			slot->ts_entry[k] = ents[i];
+	}
+	thm_slot_set_slen(head, slot, thm_slot_fit_slen(head, count));
+}
+
+/*
+ * Turn dense table back into slots, inverse of thm_dense_promote(). Rows
+ * with a single leaf are pulled up into the slot, in value mode they go
+ * into prefix slots. Slots are allocated before the table is touched.
+ */
+static int
+thm_dense_demote(struct thm_head *head, uintptr_t *slotp)
+{
+	struct thm_slot *rows[THM_SLOT_MAX_ENTRIES], *slot, *table;
+	uintptr_t ents[THM_SLOT_MAX_ENTRIES], rowmap, smap;
+	u_int count, i, k, n;
+
+	n = THM_FANOUT(head);
+	table = thm_ptr_get_value(*slotp);
+
+	smap = 0;
+	for (i = 0; i < n; i++) {
+		rows[i] = NULL;
+		rowmap = thm_dense_rowmap(head, table, i);
+		if (rowmap == 0)
+			continue;
+		smap |= THM_KEY_BIT(i);
+		count = THM_COUNT_1BITS_MAP(rowmap);
+		if (count == 1) {
+			k = THM_COUNT_TRAILING_0BITS_MAP(rowmap);
+			ents[i] = *thm_slotmax_entry(table, i * n + k);
+			if ((head->th_flags & THM_HEAD_VALUE) == 0)
+				continue;
+			rows[i] = thm_slot_alloc(head->th_pool, 1, NULL);
+			if (rows[i] == NULL)
+				goto fail;
+			thm_prefix_init(head, rows[i], k, 1, ents[i]);
+		} else {
+			rows[i] = thm_dense_slot_alloc(head, count);
+			if (rows[i] == NULL)
+				goto fail;
+			thm_dense_slot_fill(head, rows[i], rowmap,
+			    thm_slotmax_entry(table, i * n));
+		}
+		ents[i] = (uintptr_t)rows[i] | THM_PTR_MASK_SLOT;
+	}
+
+	slot = thm_dense_slot_alloc(head, THM_COUNT_1BITS_MAP(smap));
+	if (slot == NULL)
+		goto fail;
+	thm_dense_slot_fill(head, slot, smap, ents);
+
+	thm_ptr_set_slot(slotp, slot);
+	thm_table_free((char *)table - THM_DENSE_OFFSET);
+
+	return (0);
+
+fail:
+	while (i-- > 0) {
+		if (rows[i] != NULL)
+			thm_slot_free(head->th_pool, rows[i],
+			    thm_slot_get_slen(head, rows[i]));
+	}
+	return (ENOMEM);
+}
+
+/* Account new leaf, wide root table grows with the head */
+static __inline void
+thm_leaf_added(struct thm_head *head, const struct thm_key *key, void *leaf)
+{
+	struct thm_wide *tw;
+
+	if ((head->th_flags & THM_HEAD_WIDE) == 0)
+		return;
+	tw = thm_head_wide(head);
+	tw->tw_leaves++;
+	if ((head->th_flags & THM_HEAD_COUNT) != 0)
+		thm_wide_count_add(head, thm_wide_index(head, key->tk_val), 1);
+	if ((head->th_flags & THM_HEAD_AGGR) != 0)
+		thm_wide_aggr_add(head, thm_wide_index(head, key->tk_val),
+		    tw->tw_aggr->ta_value(leaf));
+	if ((head->th_flags & THM_HEAD_DIGEST) != 0)
+		thm_wide_digest_dirty(head, thm_wide_index(head, key->tk_val));
+	if (__predict_false(tw->tw_leaves >= (u_long)THM_WIDE_GROW *
+	    (THM_WIDE_FANOUT(head) << head->th_stride)) &&
+	    tw->tw_levels + 1 < head->th_levels &&
+	    (THM_WIDE_FANOUT(head) << head->th_stride) <= THM_WIDE_FANOUT_MAX &&
+	    ((head->th_flags & THM_HEAD_DENSE) == 0 ||
+	    tw->tw_levels + 1 + THM_DENSE_LEVELS <= head->th_levels))
+		thm_wide_grow(head);
+}
+
+struct thm_bucket *
+thm_insert(struct thm_head *head, struct thm_entry *entry)
+{
+	struct thm_entry *xentry;
+	struct thm_slot *slot;
+	struct thm_key key, xkey;
+	uintptr_t *gparentp, *parentp, *entp;
+	u_int count, level, n, subkey_n;
+
+	ASSERT((head->th_flags & THM_HEAD_VALUE) == 0);
+
+	thm_entry_get_key(head, entry, &key);
+
+	gparentp = NULL;
+	parentp = &head->th_root;
+	subkey_n = 0;
+	if (!thm_root_is_slot(head)) {
+		/* Empty head or lone leaf, slots are made below the root */
+		entp = parentp;
+		level = 0;
+		goto leaf;
+	}
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		entp = thm_wide_entry(head, &key);
+		subkey_n = thm_wide_levels(head) - 1;
+		if ((*entp & THM_PTR_MASK_SLOT) == 0) {
+			/* Leaf insert below can't fail */
+			if (*entp == 0) {
+				thm_bucket_insert(head, entp, entry);
+				thm_wide_map_update(head, entp);
+				thm_leaf_added(head, &key, entry);
+				return ((struct thm_bucket *)entry);
+			}
+			level = subkey_n + 1;
+			goto leaf;
+		}
+		gparentp = parentp;
+		parentp = entp;
+		subkey_n++;
+	}
+
+	for (; ; subkey_n++) {
+		ASSERT(subkey_n < head->th_levels);
+		slot = thm_ptr_get_value(*parentp);
+		if (__predict_false(thm_slot_is_dense(head, slot))) {
+			entp = thm_dense_entry(head, slot, &key);
+			subkey_n += THM_DENSE_LEVELS - 1;
+			if (*entp == 0) {
+				thm_bucket_insert(head, entp, entry);
+				thm_dense_update(head, slot, entp);
+				thm_leaf_added(head, &key, entry);
+				return ((struct thm_bucket *)entry);
+			}
+			level = subkey_n + 1;
+			goto leaf;
+		}
+		if (__predict_false(thm_slot_map(slot) == 0) &&
+		    thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			n = thm_prefix_match(head, slot, &key, subkey_n);
+			if (n < count) {
+				entp = thm_prefix_split(head, parentp, n, &key,
+				    subkey_n);
+				if (entp == NULL)
+					return (NULL);
+				break;
+			}
+			gparentp = parentp;
+			parentp = &slot->ts_entry[0];
+			subkey_n += count - 1;
+			continue;
+		}
+		entp = thm_insert_step(head, parentp,
+		    thm_key_subkey(head, &key, subkey_n), 0);
+		if (entp == NULL)
+			return (NULL);
+		if ((*entp & THM_PTR_MASK_SLOT) == 0)
+			break;
+		gparentp = parentp;
+		parentp = entp;
+	}
+	level = subkey_n + 1;
+
+leaf:
+	/* Slots split off the leaf start at level */
+	if ((xentry = thm_leaf_get_value(head, *entp)) != NULL &&
+	    thm_key_cmp_entry(head, &key, xentry) != 0) {
+		thm_entry_get_key(head, xentry, &xkey);
+		entp = thm_insert_mkslot(head, entp, level,
+		    entry, &key, xentry, &xkey);
+		if (entp == NULL)
+			return (NULL);
+		xentry = NULL;
+	} else
+		thm_bucket_insert(head, entp, entry);
+
+	/* New entry is the first one in the bucket */
+	if (xentry == NULL) {
+		if ((head->th_flags & THM_HEAD_DENSE) != 0 &&
+		    level == head->th_levels)
+			thm_dense_check(head, gparentp, parentp);
+		thm_leaf_added(head, &key, entry);
+	} else
+		thm_leaf_changed(head, key.tk_val);
+
+	return ((struct thm_bucket *)entry);
+}
+
+/* Returns number of entries left in the slot, bits of tails it keeps */
+static u_int
+thm_remove_step(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    u_int bits)
+{
+	uintptr_t keybit;
+	u_int count, keyind, nslen, ntails, slen;
+
+	if (thm_slot_is_prefix(head, slot)) {
+		ASSERT(entp == &slot->ts_entry[0]);
+		return (0);
+	}
+
+	slen = thm_slot_get_slen(head, slot);
+	ntails = 0;
+	if (slen == THM_SLOTMAX_SLEN(head)) {
+		struct thm_slotmax *slotmax = (struct thm_slotmax *)slot;
+
+		ASSERT(entp >= slotmax->ts_entry &&
+		    entp < slotmax->ts_entry + THM_FANOUT(head));
+
+		thm_ptr_set_value(entp, NULL);
+		for (count = 0, entp = slotmax->ts_entry;
+		    entp < slotmax->ts_entry + THM_FANOUT(head); entp++) {
+			if (thm_ptr_get_value(*entp) != NULL)
+				count++;
+		}
+	} else {
+		keyind = entp - slot->ts_entry;
+
+		ASSERT(entp >= slot->ts_entry &&
+		    keyind < slen * THM_SLOT_MIN_ENTRIES);
+		ASSERT(keyind < (u_int)THM_COUNT_1BITS_MAP(thm_slot_map(slot)));
+
+		if (bits != 0 && (ntails = thm_tail_count(head, slot)) != 0 &&
+		    (*entp & THM_PTR_MASK_SLOT) == 0) {
+			thm_tail_close(head, slot, entp, bits, ntails);
+			ntails--;
+		}
+
+		/* Find keyind-th bit set */
+		keybit = thm_slot_map(slot);
+		for (u_int i = 0; i < keyind; i++)
+			keybit &= keybit - 1;
+		keybit &= -keybit;
+
+		slot->ts_map &= ~keybit;
+		count = THM_COUNT_1BITS_MAP(thm_slot_map(slot));
+
+		for (u_int i = keyind; i < count; i++)
+			slot->ts_entry[i] = slot->ts_entry[i + 1];
+		/* Empty root must not look like prefix slot */
+		slot->ts_entry[count] = 0;
+		if (keyind < THM_SLOT_SLEN_ENTRIES)
+			thm_slot_set_slen(head, slot, slen);
+	}
+
+	if (count == 0)
+		return (0);
+
+	if (slen == THM_SLOTMAX_SLEN(head))
+		nslen = MIN(slen, THM_SLEN_MAX) - 1;
+	else
+		nslen = slen - 1;
+	ntails = thm_tail_words(bits, ntails);
+	if (slen > 1 && count + ntails + 1 + THM_SLOT_SHRINK_SLACK <=
+	    nslen * THM_SLOT_MIN_ENTRIES) {
+		if (slen == THM_SLOTMAX_SLEN(head))
+			thm_slotmax_fix_shrink(head, (struct thm_slotmax *)slot,
+			    slot, nslen);
+		else {
+			thm_tail_move(slot, ntails, slen, nslen);
+			thm_slot_set_slen(head, slot, nslen);
+		}
+		thm_slot_shrink(head->th_pool, slot, slen, nslen);
+	}
+
+	return (count);
+}
+
+/* Returns the only entry of the slot, NULL if there are more */
+static uintptr_t *
+thm_slot_single(struct thm_head *head, struct thm_slot *slot, u_int *subkeyp)
+{
+	uintptr_t *entp = NULL;
+	u_int i;
+
+	if (thm_slot_get_slen(head, slot) != THM_SLOTMAX_SLEN(head)) {
+		if (THM_COUNT_1BITS_MAP(thm_slot_map(slot)) != 1)
+			return (NULL);
+		*subkeyp = THM_COUNT_TRAILING_0BITS_MAP(thm_slot_map(slot));
+		return (&slot->ts_entry[0]);
+	}
+
+	for (i = 0; i < THM_FANOUT(head); i++) {
+		if (thm_ptr_get_value(*thm_slotmax_entry(slot, i)) == NULL)
+			continue;
+		if (entp != NULL)
+			return (NULL);
+		entp = thm_slotmax_entry(slot, i);
+		*subkeyp = i;
+	}
+
+	return (entp);
+}
+
+/*
+ * Turn slot left with a single child slot into prefix slot and merge it
+ * with adjacent prefix slots. Value mode heads pass lone leaves here too.
+ */
+static void
+thm_prefix_merge(struct thm_head *head, struct thm_cursor *cr, u_int depth,
+    uintptr_t *entp, u_int subkey)
+{
+	struct thm_slot *slot, *parent;
+	uintptr_t child, subkeys;
+	u_int count, pcount, slen;
+
+	ASSERT(depth > 0);
+
+	slot = thm_ptr_get_value(*thm_cursor_path(cr)[depth]);
+	slen = thm_slot_get_slen(head, slot);
+	ASSERT((*entp & THM_PTR_MASK_SLOT) != 0 ||
+	    (head->th_flags & THM_HEAD_VALUE) != 0);
+
+	child = *entp;
+	subkeys = subkey;
+	count = 1;
+	if ((child & THM_PTR_MASK_SLOT) != 0 &&
+	    !thm_slot_is_dense(head, thm_ptr_get_value(child)) &&
+	    thm_slot_is_prefix(head, thm_ptr_get_value(child)) &&
+	    thm_prefix_count(thm_ptr_get_value(child)) + count <=
+	    THM_PREFIX_MAX(head)) {
+		parent = thm_ptr_get_value(child);
+		subkeys |= thm_prefix_subkeys(parent) << head->th_stride;
+		count += thm_prefix_count(parent);
+		child = parent->ts_entry[0];
+		thm_slot_free(head->th_pool, parent, 1);
+	}
+	thm_prefix_init(head, slot, subkeys, count, child);
+	if (slen > 1)
+		thm_slot_shrink(head->th_pool, slot, slen, 1);
+
+	parent = thm_ptr_get_value(*thm_cursor_path(cr)[depth - 1]);
+	if (thm_slot_is_wide(head, parent) || !thm_slot_is_prefix(head, parent))
+		return;
+	pcount = thm_prefix_count(parent);
+	if (pcount + count > THM_PREFIX_MAX(head))
+		return;
+	thm_prefix_init(head, parent, thm_prefix_subkeys(parent) |
+	    (subkeys << (pcount * head->th_stride)), pcount + count, child);
+	thm_slot_free(head->th_pool, slot, 1);
+}
+
+/*
+ * Pull lone value leaf of the slot at depth up into the nearest compressed
+ * slot above it, prefix slots in between are freed. Inverse of
+ * thm_tail_split(). Returns depth of the slot taking the leaf, -1 if it
+ * has no room for the tail.
+ */
+static int
+thm_tail_pullup(struct thm_head *head, struct thm_cursor *cr, u_int depth,
+    uintptr_t *entp, u_int subkey)
+{
+	struct thm_slot *slot, *upper;
+	uintptr_t leaf;
+	uint64_t ikey;
+	u_int bits, count, d, level, ntails;
+	int up;
+
+	ikey = thm_cursor_prefix(cr, depth, &level);
+	slot = thm_ptr_get_value(*thm_cursor_path(cr)[depth]);
+	bits = (head->th_levels - 1 - level) * head->th_stride;
+	ikey = (((ikey << head->th_stride) | subkey) << bits) |
+	    (bits != 0 ? thm_tail_get(head, slot, entp, bits) : 0);
+
+	for (up = depth - 1; up > 0; up--) {
+		upper = thm_ptr_get_value(*thm_cursor_path(cr)[up]);
+		if (!thm_slot_is_prefix(head, upper))
+			break;
+	}
+	upper = thm_ptr_get_value(*thm_cursor_path(cr)[up]);
+	if (thm_slot_direct(head, upper) != 0 ||
+	    thm_slot_is_prefix(head, upper))
+		return (-1);
+	(void)thm_cursor_prefix(cr, up, &level);
+	if ((bits = thm_tail_bits(head, level)) == 0)
+		return (-1);
+	count = THM_COUNT_1BITS_MAP(thm_slot_map(upper));
+	ntails = thm_tail_count(head, upper);
+	if (count + thm_tail_words(bits, ntails + 1) + 1 >
+	    thm_slot_get_slen(head, upper) * THM_SLOT_MIN_ENTRIES)
+		return (-1);
+
+	leaf = *entp;
+	thm_slot_free(head->th_pool, slot, thm_slot_get_slen(head, slot));
+	for (d = depth - 1; d > (u_int)up; d--)
+		thm_slot_free(head->th_pool,
+		    thm_ptr_get_value(*thm_cursor_path(cr)[d]), 1);
+	thm_ptr_copy(thm_cursor_path(cr)[up + 1], leaf);
+
+	thm_tail_open(head, upper, thm_cursor_path(cr)[up + 1], bits, ntails);
+	thm_tail_set(head, upper, thm_cursor_path(cr)[up + 1], bits,
+	    ikey & (((uint64_t)1 << bits) - 1));
+
+	return (up);
+}
+
+/*
+ * Pull lone leaf up into parent entry, inverse of thm_insert_mkslot().
+ * Prefix slots and single entry slots left above the leaf are collapsed as
+ * well, up to the root entry of entry heads. Value leaves go up into a
+ * tail if there is room for it, leaves keeping their tail stay.
+ */
+static void
+thm_remove_collapse(struct thm_head *head, struct thm_cursor *cr,
+    u_int depth)
+{
+	struct thm_slot *slot;
+	uintptr_t *entp;
+	u_int level, subkey = 0;
+	int up;
+
+	for (; ; depth--) {
+		if (depth == 0 && (head->th_flags & (THM_HEAD_WIDE |
+		    THM_HEAD_VALUE)) != 0)
+			return;
+		slot = thm_ptr_get_value(*thm_cursor_path(cr)[depth]);
+		if (thm_slot_is_prefix(head, slot))
+			entp = &slot->ts_entry[0];
+		else if ((entp = thm_slot_single(head, slot, &subkey)) == NULL)
+			return;
+		if ((*entp & THM_PTR_MASK_SLOT) != 0 && depth == 0)
+			return;
+		if ((*entp & THM_PTR_MASK_SLOT) == 0 && thm_head_tails(head)) {
+			up = thm_tail_pullup(head, cr, depth, entp, subkey);
+			if (up >= 0) {
+				/* Go on from the slot taking the leaf */
+				depth = up + 1;
+				continue;
+			}
+			(void)thm_cursor_prefix(cr, depth, &level);
+			if (level + 1 < head->th_levels)
+				return;
+		}
+		if ((*entp & THM_PTR_MASK_SLOT) != 0 ||
+		    (head->th_flags & THM_HEAD_VALUE) != 0) {
+			ASSERT(!thm_slot_is_prefix(head, slot));
+			thm_prefix_merge(head, cr, depth, entp, subkey);
+			return;
+		}
+		thm_ptr_copy(thm_cursor_path(cr)[depth], *entp);
+		thm_slot_free(head->th_pool, slot,
+		    thm_slot_get_slen(head, slot));
+		if (depth == 0)
+			return;
+	}
+}
+
+/* Remove leaf entry cursor points to, free slots left empty */
+static void
+thm_remove_leaf(struct thm_head *head, struct thm_cursor *cr)
+{
+	uintptr_t *entp;
+	void *entval;
+	u_int bits, count, ind, level;
+	int depth;
+
+	depth = cr->tc_level - 1;
+	entp = thm_cursor_path(cr)[cr->tc_level];
+	ind = 0;
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		ASSERT(thm_head_wide(head)->tw_leaves > 0);
+		thm_head_wide(head)->tw_leaves--;
+		ind = thm_cursor_path(cr)[1] - (uintptr_t *)head->th_root;
+	}
+	if ((head->th_flags & THM_HEAD_COUNT) != 0)
+		thm_wide_count_add(head, ind, -1);
+
+	for (; depth >= 0; depth--) {
+		/* slot for entp */
+		entval = thm_ptr_get_value(*thm_cursor_path(cr)[depth]);
+		if (thm_slot_is_wide(head, entval)) {
+			thm_ptr_set_value(entp, NULL);
+			thm_wide_map_update(head, entp);
+			break;
+		}
+		if (thm_slot_is_dense(head, entval)) {
+			thm_ptr_set_value(entp, NULL);
+			count = thm_dense_update(head, entval, entp);
+			if (count >= THM_DENSE_DEMOTE(head))
+				break;
+			/* Table is kept if slots can't be allocated */
+			if (count != 0) {
+				if (thm_dense_demote(head,
+				    thm_cursor_path(cr)[depth]) == 0)
+					thm_remove_collapse(head, cr, depth);
+				break;
+			}
+			thm_table_free((char *)entval - THM_DENSE_OFFSET);
+			entp = thm_cursor_path(cr)[depth];
+			continue;
+		}
+		bits = 0;
+		if (thm_head_tails(head)) {
+			(void)thm_cursor_prefix(cr, depth, &level);
+			bits = thm_tail_bits(head, level);
+		}
+		count = thm_remove_step(head, entval, entp, bits);
+		if (count != 0) {
+			if (count == 1)
+				thm_remove_collapse(head, cr, depth);
+			break;
+		}
+		thm_slot_free(head->th_pool, entval,
+		    thm_slot_get_slen(head, entval));
+		entp = thm_cursor_path(cr)[depth];
+		/* Head is empty */
+		if (depth == 0)
+			*entp = 0;
+	}
+
+	if ((head->th_flags & THM_HEAD_AGGR) != 0)
+		thm_wide_aggr_refresh(head, ind);
+	if ((head->th_flags & THM_HEAD_DIGEST) != 0)
+		thm_wide_digest_dirty(head, ind);
+}
+
+static void
+thm_remove_impl(struct thm_head *head, struct thm_entry *entry,
+    struct thm_cursor *cr)
+{
+	struct thm_key key;
+	uintptr_t *entp;
+	void *entval __unused;
+
+	thm_entry_get_key(head, entry, &key);
+
+	entval = thm_find_impl(head, &key, cr, NULL);
+	ASSERT(entval != NULL);
+
+	entp = thm_cursor_path(cr)[cr->tc_level];
+	thm_bucket_remove(head, entp, entry);
+	if (thm_leaf_get_value(head, *entp) != NULL) {
+		thm_leaf_changed(head, key.tk_val);
+		return;
+	}
+
+	thm_remove_leaf(head, cr);
+}
+
+/* Keep large string cursor off the stack of thm_remove() */
+static __noinline void
+thm_remove_skey(struct thm_head *head, struct thm_entry *entry)
+{
+	struct thm_scursor scr;
+
+	thm_remove_impl(head, entry, thm_scursor_init(head, &scr));
+}
+
+void
+thm_remove(struct thm_head *head, struct thm_entry *entry)
+{
+	struct thm_cursor cr;
+
+	ASSERT((head->th_flags & THM_HEAD_VALUE) == 0);
+
+	/* Only the first entry of the bucket is referenced by the slot */
+	if ((head->th_flags & THM_HEAD_DLIST) != 0 &&
+	    thm_dentry(entry)->tde_prev != NULL) {
+		thm_bucket_unlink(thm_dentry(entry)->tde_prev, entry);
+		if ((head->th_flags & (THM_HEAD_AGGR | THM_HEAD_DIGEST)) != 0)
+			thm_leaf_changed(head,
+			    thm_entry_get_ikey(head, entry));
+		return;
+	}
+
+	if ((head->th_flags & THM_HEAD_SKEY) != 0) {
+		thm_remove_skey(head, entry);
+		return;
+	}
+
+	thm_cursor_init(head, &cr);
+	thm_remove_impl(head, entry, &cr);
+}
+
+/*
+ * Value lookup without cursor, follows thm_find_inline(). Only a leaf found
+ * by a slot step above the last level has a tail.
+ */
+static uintptr_t
+thm_vfind_nocursor(struct thm_head *head, uint64_t key)
+{
+	struct thm_slot *slot;
+	struct thm_key xkey;
+	uintptr_t ent, *entp;
+	u_int bits, count, level;
+
+	memset(&xkey, 0, sizeof(xkey));
+	xkey.tk_val = key & thm_head_keymask(head);
+	ent = head->th_root;
+	entp = NULL;
+	slot = NULL;
+	level = 0;
+
+	/* Wide root entry replaces first tw_levels steps */
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		level = thm_wide_levels(head);
+		ent = *thm_wide_entry(head, &xkey);
+	}
+
+	while ((ent & THM_PTR_MASK_SLOT) != 0) {
+		slot = thm_ptr_get_value(ent);
+		if (__predict_false(thm_slot_is_dense(head, slot))) {
+			ent = *thm_dense_entry(head, slot, &xkey);
+			level = head->th_levels;
+			break;
+		}
+		if (__predict_false(thm_slot_map(slot) == 0) &&
+		    thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			if (thm_prefix_match(head, slot, &xkey, level) != count)
+				return (0);
+			ent = slot->ts_entry[0];
+			level += count;
+			continue;
+		}
+		entp = thm_find_step(head, slot,
+		    thm_key_subkey(head, &xkey, level));
+		if (entp == NULL)
+			return (0);
+		ent = *entp;
+		level++;
+	}
+
+	if (thm_ptr_get_value(ent) == NULL)
+		return (0);
+	if (level < head->th_levels) {
+		/* Leaf above the last level, the rest is in its tail */
+		bits = (head->th_levels - level) * head->th_stride;
+		if (entp == NULL || thm_tail_get(head, slot, entp, bits) !=
+		    (xkey.tk_val & (((uint64_t)1 << bits) - 1)))
+			return (0);
+	}
+
+	return ((uintptr_t)thm_ptr_get_value(ent));
+}
+
+uintptr_t
+thm_vfind(struct thm_head *head, uint64_t key, struct thm_cursor *cr)
+{
+	ASSERT((head->th_flags & THM_HEAD_VALUE) != 0);
+
+	if (cr == NULL)
+		return (thm_vfind_nocursor(head, key));
+
+	return ((uintptr_t)thm_find(head, key, cr));
+}
+
+uintptr_t
+thm_vnfind(struct thm_head *head, uint64_t key, struct thm_cursor *cr)
+{
+	ASSERT((head->th_flags & THM_HEAD_VALUE) != 0);
+
+	return ((uintptr_t)thm_nfind(head, key, cr));
+}
+
+uint64_t
+thm_vkey(struct thm_cursor *cr)
+{
+	ASSERT((cr->tc_head->th_flags & THM_HEAD_VALUE) != 0);
+	ASSERT(cr->tc_level > 0);
+
+	return (thm_cursor_ikey(cr));
+}
+
+/*
+ * Move leaves of the slot at level down into single unit slots a level
+ * below, the slot is about to become direct indexed. Slots are allocated
+ * before the tree is modified to fail cleanly.
+ */
+static int
+thm_tail_push(struct thm_head *head, struct thm_slot *slot, u_int level)
+{
+	struct thm_slot *rows[THM_SLOT_MAX_ENTRIES], *row;
+	uintptr_t *entp;
+	uint64_t tail;
+	u_int bits, count, i, n, ntails, nwords, slen, tbits;
+
+	tbits = thm_tail_bits(head, level);
+	bits = tbits - head->th_stride;
+	ntails = thm_tail_count(head, slot);
+	for (n = 0; n < ntails; n++) {
+		rows[n] = thm_slot_alloc_zero(head->th_pool, 1, slot);
+		if (rows[n] == NULL) {
+			while (n-- > 0)
+				thm_slot_free(head->th_pool, rows[n], 1);
+			return (ENOMEM);
+		}
+	}
+
+	count = THM_COUNT_1BITS_MAP(thm_slot_map(slot));
+	for (i = 0, n = 0; i < count; i++) {
+		entp = &slot->ts_entry[i];
+		if ((*entp & THM_PTR_MASK_SLOT) != 0)
+			continue;
+		tail = thm_tail_get_index(head, slot, tbits, n);
+		row = rows[n++];
+		row->ts_map = THM_KEY_BIT(tail >> bits);
+		row->ts_entry[0] = *entp & ~THM_PTR_MASK_SLEN;
+		thm_slot_set_slen(head, row, 1);
+		if (bits != 0)
+			thm_tail_set_index(head, row, bits, 0,
+			    tail & (((uint64_t)1 << bits) - 1));
+		thm_ptr_set_slot(entp, row);
+	}
+	slen = thm_slot_get_slen(head, slot);
+	nwords = thm_tail_words(tbits, ntails);
+	memset(&slot->ts_entry[slen * THM_SLOT_MIN_ENTRIES - 1 - nwords], 0,
+	    nwords * sizeof(uintptr_t));
+	thm_slot_set_slen(head, slot, slen);
+
+	return (0);
+}
+
+/*
+ * Key shares the subkey at level with a leaf of another tail. Both go into
+ * a new branch slot at the level their keys differ, prefix slots take the
+ * subkeys in between. Inverse of thm_tail_pullup().
+ */
+static int
+thm_tail_split(struct thm_head *head, struct thm_slot *slot, uintptr_t *entp,
+    const struct thm_key *key, u_int level, uintptr_t value)
+{
+	struct thm_slot *chain[THM_SUBKEY_MAX], *branch;
+	uintptr_t *ent1, *ent2;
+	uint64_t mask, ntail, otail;
+	u_int bbits, bits, c1, c2, i, n, nchain, nskip, slen;
+
+	bits = thm_tail_bits(head, level);
+	ASSERT(bits != 0);
+	mask = ((uint64_t)1 << bits) - 1;
+	otail = thm_tail_get(head, slot, entp, bits);
+	ntail = key->tk_val & mask;
+	ASSERT(otail != ntail);
+
+	/* Subkeys of both tails above the first one differing */
+	nskip = (bits - 1 - (63 -
+	    THM_COUNT_LEADING_0BITS_64(otail ^ ntail))) / head->th_stride;
+	bbits = bits - (nskip + 1) * head->th_stride;
+	nchain = howmany(nskip, THM_PREFIX_MAX(head));
+	ASSERT(nchain <= nitems(chain));
+	for (i = 0; i < nchain; i++) {
+		chain[i] = thm_slot_alloc(head->th_pool, 1, slot);
+		if (chain[i] == NULL)
+			goto fail;
+	}
+	/* Branch slot takes both tails unless it's at the last level */
+	slen = bbits != 0 ? 2 : 1;
+	branch = thm_slot_alloc(head->th_pool, slen, slot);
+	if (branch == NULL)
+		goto fail;
+	memset(branch, 0, slen * THM_SLOT_SIZE);
+
+	c1 = (otail >> bbits) & (THM_FANOUT(head) - 1);
+	c2 = (ntail >> bbits) & (THM_FANOUT(head) - 1);
+	ASSERT(c1 != c2);
+	branch->ts_map = THM_KEY_BIT(c1) | THM_KEY_BIT(c2);
+	ent1 = &branch->ts_entry[c1 < c2 ? 0 : 1];
+	ent2 = &branch->ts_entry[c1 < c2 ? 1 : 0];
+	*ent1 = *entp & ~THM_PTR_MASK_SLEN;
+	*ent2 = value;
+	thm_slot_set_slen(head, branch, slen);
+	if (bbits != 0) {
+		mask = ((uint64_t)1 << bbits) - 1;
+		thm_tail_set(head, branch, ent1, bbits, otail & mask);
+		thm_tail_set(head, branch, ent2, bbits, ntail & mask);
+	}
+
+	/* Entry of the leaf becomes the chain down to the branch */
+	thm_tail_close(head, slot, entp, bits, thm_tail_count(head, slot));
+	for (i = 0, level++; i < nchain; i++, level += n) {
+		n = MIN(nskip, THM_PREFIX_MAX(head));
+		nskip -= n;
+		thm_prefix_init(head, chain[i],
+		    thm_prefix_pack(head, key, level, n), n, 0);
+		thm_ptr_set_slot(entp, chain[i]);
+		entp = &chain[i]->ts_entry[0];
+	}
+	thm_ptr_set_slot(entp, branch);
+
+	return (0);
+
+fail:
+	while (i-- > 0)
+		thm_slot_free(head->th_pool, chain[i], 1);
+	return (ENOMEM);
+}
+
+/*
+ * New value leaf goes into the slot where its key is unique with a tail if
+ * there is room, otherwise subkeys below the new branch entry go into
+ * prefix slots. They are allocated before the tree is modified to fail
+ * cleanly.
+ */
+int
+thm_vinsert(struct thm_head *head, uint64_t key, uintptr_t value)
+{
+	struct thm_slot *chain[THM_SUBKEY_MAX], *slot;
+	struct thm_cursor cr;
+	struct thm_key xkey;
+	uintptr_t *entp, *slotp;
+	u_int bits, i, level, n, nchain, nskip, step;
+
+	ASSERT((head->th_flags & THM_HEAD_VALUE) != 0);
+	ASSERT(value != 0 && (value & THM_PTR_MASK_RESERVED) == 0);
+
+	memset(&xkey, 0, sizeof(xkey));
+	xkey.tk_val = key & thm_head_keymask(head);
+
+	/* Value leaves are never in the root entry, empty head gets a slot */
+	if (head->th_root == 0) {
+		slot = thm_slot_alloc_zero(head->th_pool, 1, NULL);
+		if (slot == NULL)
+			return (ENOMEM);
+		thm_ptr_set_slot(&head->th_root, slot);
+	}
+
+	thm_cursor_init(head, &cr);
+	if (thm_find_impl(head, &xkey, &cr, &level) != NULL) {
+		thm_ptr_set_value(thm_cursor_path(&cr)[cr.tc_level],
+		    (void *)value);
+		thm_leaf_changed(head, xkey.tk_val);
+		return (0);
+	}
+
+	slotp = thm_cursor_path(&cr)[cr.tc_level];
+	slot = thm_ptr_get_value(*slotp);
+	if (thm_slot_is_dense(head, slot)) {
+		entp = thm_dense_entry(head, slot, &xkey);
+		thm_ptr_set_value(entp, (void *)value);
+		thm_dense_update(head, slot, entp);
+		thm_leaf_added(head, &xkey, (void *)value);
+		return (0);
+	}
+	n = 0;
+	step = 1;
+	if (thm_slot_is_wide(head, slot))
+		step = thm_wide_levels(head);
+	else if (thm_slot_is_prefix(head, slot))
+		n = thm_prefix_match(head, slot, &xkey, level);
+	else if ((entp = thm_find_step(head, slot,
+	    thm_key_subkey(head, &xkey, level))) != NULL) {
+		/* Leaf of the subkey has another tail */
+		if (thm_tail_split(head, slot, entp, &xkey, level, value) != 0)
+			return (ENOMEM);
+		thm_leaf_added(head, &xkey, (void *)value);
+		return (0);
+	}
+
+	bits = step == 1 ? thm_tail_bits(head, level + n) : 0;
+	if (bits != 0 && !thm_slot_is_prefix(head, slot) &&
+	    !thm_tail_fits(head, slot, bits)) {
+		/* Slot is going direct indexed, leaves move a level down */
+		if (thm_tail_count(head, slot) != 0 &&
+		    thm_tail_push(head, slot, level) != 0)
+			return (ENOMEM);
+		if (!thm_tail_fits(head, slot, bits))
+			bits = 0;
+	}
+
+	nskip = 0;
+	if (bits == 0)
+		nskip = head->th_levels - step - (level + n);
+	nchain = howmany(nskip, THM_PREFIX_MAX(head));
+	ASSERT(nchain <= nitems(chain));
+	for (i = 0; i < nchain; i++) {
+		chain[i] = thm_slot_alloc(head->th_pool, 1,
+		    thm_slot_hint(head, slot));
+		if (chain[i] == NULL)
+			goto fail;
+	}
+
+	if (step != 1)
+		entp = thm_wide_entry(head, &xkey);
+	else if (thm_slot_is_prefix(head, slot))
+		entp = thm_prefix_split(head, slotp, n, &xkey, level);
+	else
+		entp = thm_insert_step(head, slotp,
+		    thm_key_subkey(head, &xkey, level), bits);
+	if (entp == NULL)
+		goto fail;
+
+	if (bits != 0) {
+		/* Branch of a split prefix slot is below the upper subkeys */
+		slot = thm_ptr_get_value(*slotp);
+		if (n != 0)
+			slot = thm_prefix_child(slot);
+		thm_tail_set(head, slot, entp, bits,
+		    xkey.tk_val & (((uint64_t)1 << bits) - 1));
+	}
+	for (i = 0, level += n + step; i < nchain; i++, level += n) {
+		n = MIN(nskip, THM_PREFIX_MAX(head));
+		nskip -= n;
+		thm_prefix_init(head, chain[i],
+		    thm_prefix_pack(head, &xkey, level, n), n, 0);
+		thm_ptr_set_slot(entp, chain[i]);
+		if (i == 0 && step != 1)
+			thm_wide_map_update(head, entp);
+		entp = &chain[i]->ts_entry[0];
+	}
+	ASSERT(level + bits / head->th_stride == head->th_levels);
+	thm_ptr_set_value(entp, (void *)value);
+	if ((head->th_flags & THM_HEAD_DENSE) != 0 && nchain == 0 &&
+	    step == 1 && bits == 0)
+		thm_dense_check(head, thm_cursor_path(&cr)[cr.tc_level - 1],
+		    slotp);
+	thm_leaf_added(head, &xkey, (void *)value);
+
+	return (0);
+
+fail:
+	while (i-- > 0)
+		thm_slot_free(head->th_pool, chain[i], 1);
+	return (ENOMEM);
+}
+
+uintptr_t
+thm_vremove(struct thm_head *head, uint64_t key)
+{
+	struct thm_cursor cr;
+	struct thm_key xkey;
+	void *entval;
+
+	ASSERT((head->th_flags & THM_HEAD_VALUE) != 0);
+
+	xkey.tk_val = key & thm_head_keymask(head);
+
+	thm_cursor_init(head, &cr);
+	entval = thm_find_impl(head, &xkey, &cr, NULL);
+	if (entval == NULL)
+		return (0);
+
+	/* Entry is cleared by thm_remove_step() */
+	thm_remove_leaf(head, &cr);
+
+	return ((uintptr_t)entval);
+}
+
+static __inline uint64_t
+thm_set_prefix(struct thm_head *head, uint64_t key)
+{
+	return ((key & thm_head_keymask(head)) >> head->th_stride);
+}
+
+static __inline uintptr_t
+thm_set_bit(struct thm_head *head, uint64_t key)
+{
+	return (THM_KEY_BIT(key & (THM_FANOUT(head) - 1)) << THM_SET_SHIFT);
+}
+
+static __inline uintptr_t
+thm_set_leaf(struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_ptr_get_value(
+	    *thm_cursor_path(cr)[cr->tc_level]));
+}
+
+/* Lowest key of the leaf bitmap starting at bit */
+static int
+thm_set_leaf_next(struct thm_cursor *cr, uintptr_t bits, u_int bit,
+    uint64_t *keyp)
+{
+	struct thm_head *head = cr->tc_head;
+
+	bits >>= THM_SET_SHIFT;
+	if (bit > 0)
+		bits &= ~(THM_KEY_BIT(bit) - 1);
+	if (bits == 0)
+		return (0);
+	*keyp = (thm_cursor_ikey(cr) << head->th_stride) |
+	    THM_COUNT_TRAILING_0BITS_MAP(bits);
+	return (1);
+}
+
+/* Highest key of the leaf bitmap below bit */
+static int
+thm_set_leaf_prev(struct thm_cursor *cr, uintptr_t bits, u_int bit,
+    uint64_t *keyp)
+{
+	struct thm_head *head = cr->tc_head;
+
+	bits >>= THM_SET_SHIFT;
+	if (bit < THM_FANOUT(head))
+		bits &= THM_KEY_BIT(bit) - 1;
+	if (bits == 0)
+		return (0);
+	*keyp = (thm_cursor_ikey(cr) << head->th_stride) |
+	    (63 - THM_COUNT_LEADING_0BITS_64((uint64_t)bits));
+	return (1);
+}
+
+int
+thm_set_add(struct thm_head *head, uint64_t key)
+{
+	struct thm_cursor cr;
+	uintptr_t bits;
+
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	bits = thm_vfind(head, thm_set_prefix(head, key), &cr);
+	if (bits != 0) {
+		thm_ptr_set_value(thm_cursor_path(&cr)[cr.tc_level],
+		    (void *)(bits | thm_set_bit(head, key)));
+		return (0);
+	}
+
+	return (thm_vinsert(head, thm_set_prefix(head, key),
+	    thm_set_bit(head, key)));
+}
+
+int
+thm_set_remove(struct thm_head *head, uint64_t key)
+{
+	struct thm_cursor cr;
+	uintptr_t bits;
+
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	bits = thm_vfind(head, thm_set_prefix(head, key), &cr);
+	if ((bits & thm_set_bit(head, key)) == 0)
+		return (0);
+
+	bits &= ~thm_set_bit(head, key);
+	if (bits != 0)
+		thm_ptr_set_value(thm_cursor_path(&cr)[cr.tc_level],
+		    (void *)bits);
+	else
+		thm_remove_leaf(head, &cr);
+
+	return (1);
+}
+
+int
+thm_set_member(struct thm_head *head, uint64_t key)
+{
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	return ((thm_vfind(head, thm_set_prefix(head, key), NULL) &
+	    thm_set_bit(head, key)) != 0);
+}
+
+int
+thm_set_first(struct thm_head *head, struct thm_cursor *cr, uint64_t *keyp)
+{
+	uintptr_t bits;
+
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	bits = thm_vfirst(head, cr);
+	if (bits == 0)
+		return (0);
+
+	return (thm_set_leaf_next(cr, bits, 0, keyp));
+}
+
+int
+thm_set_last(struct thm_head *head, struct thm_cursor *cr, uint64_t *keyp)
+{
+	uintptr_t bits;
+
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	bits = thm_vlast(head, cr);
+	if (bits == 0)
+		return (0);
+
+	return (thm_set_leaf_prev(cr, bits, THM_FANOUT(head), keyp));
+}
+
+/* Key following *keyp, cursor must point to its leaf */
+int
+thm_set_next(struct thm_cursor *cr, uint64_t *keyp)
+{
+	struct thm_head *head = cr->tc_head;
+	uintptr_t bits;
+
+	if (thm_set_leaf_next(cr, thm_set_leaf(cr),
+	    (*keyp & (THM_FANOUT(head) - 1)) + 1, keyp))
+		return (1);
+
+	bits = thm_vnext(cr);
+	if (bits == 0)
+		return (0);
+
+	return (thm_set_leaf_next(cr, bits, 0, keyp));
+}
+
+int
+thm_set_prev(struct thm_cursor *cr, uint64_t *keyp)
+{
+	struct thm_head *head = cr->tc_head;
+	uintptr_t bits;
+
+	if (thm_set_leaf_prev(cr, thm_set_leaf(cr),
+	    *keyp & (THM_FANOUT(head) - 1), keyp))
+		return (1);
+
+	bits = thm_vprev(cr);
+	if (bits == 0)
+		return (0);
+
+	return (thm_set_leaf_prev(cr, bits, THM_FANOUT(head), keyp));
+}
+
+int
+thm_set_nfind(struct thm_head *head, uint64_t key, struct thm_cursor *cr,
+    uint64_t *keyp)
+{
+	uintptr_t bits;
+
+	ASSERT((head->th_flags & THM_HEAD_SET) != 0);
+
+	bits = thm_vnfind(head, thm_set_prefix(head, key), cr);
+	if (bits == 0)
+		return (0);
+	if (thm_cursor_ikey(cr) != thm_set_prefix(head, key))
+		return (thm_set_leaf_next(cr, bits, 0, keyp));
+
+	if (thm_set_leaf_next(cr, bits, key & (THM_FANOUT(head) - 1), keyp))
+		return (1);
+
+	bits = thm_vnext(cr);
+	if (bits == 0)
+		return (0);
+
+	return (thm_set_leaf_next(cr, bits, 0, keyp));
+}
+
+static __inline uint64_t
+thm_lpm_key(struct thm_head *head, uint32_t key, u_int plen)
+{
+	uint64_t ikey;
+	u_int c, level, r;
+
+	ikey = 0;
+	for (level = 0; level < plen / THM_LPM_BITS; level++) {
+		c = (key >> (32 - THM_LPM_BITS * (level + 1))) &
+		    (THM_LPM_MARK - 1);
+		ikey |= (uint64_t)c <<
+		    (head->th_stride * (head->th_levels - 1 - level));
+	}
+	r = plen % THM_LPM_BITS;
+	c = r == 0 ? 0 :
+	    (key >> (32 - THM_LPM_BITS * (level + 1))) & (THM_LPM_MARK - 1);
+	c = THM_LPM_MARK | 1U << r | c >> (THM_LPM_BITS - r);
+
+	return (ikey | (uint64_t)c <<
+	    (head->th_stride * (head->th_levels - 1 - level)));
+}
+
+/* Address bits of the level, 0 past the last bit */
+static __inline u_int
+thm_lpm_chunk(uint32_t key, u_int level)
+{
+	if (level >= THM_LPM_LEVELS - 1)
+		return (0);
+
+	return ((key >> (32 - THM_LPM_BITS * (level + 1))) &
+	    (THM_LPM_MARK - 1));
+}
+
+/* Prefix length of level marker subkey if it covers the address bits */
+static __inline int
+thm_lpm_covers(u_int subkey, u_int c)
+{
+	u_int r;
+
+	subkey &= THM_LPM_MARK - 1;
+	r = 31 - THM_COUNT_LEADING_0BITS_32(subkey);
+	if (c >> (THM_LPM_BITS - r) != (subkey & ((1U << r) - 1)))
+		return (-1);
+
+	return (r);
+}
+
+/* Prefix entry has no siblings below the marker, follow it to the value */
+static __inline uintptr_t
+thm_lpm_leaf(uintptr_t ent)
+{
+	struct thm_slot *slot;
+
+	while ((ent & THM_PTR_MASK_SLOT) != 0) {
+		slot = thm_ptr_get_value(ent);
+		ent = slot->ts_entry[0];
+	}
+
+	return ((uintptr_t)thm_ptr_get_value(ent));
+}
+
+int
+thm_lpm_insert(struct thm_head *head, uint32_t key, u_int plen,
+    uintptr_t value)
+{
+	ASSERT((head->th_flags & THM_HEAD_LPM) != 0 && plen <= 32);
+
+	return (thm_vinsert(head, thm_lpm_key(head, key, plen), value));
+}
+
+uintptr_t
+thm_lpm_remove(struct thm_head *head, uint32_t key, u_int plen)
+{
+	ASSERT((head->th_flags & THM_HEAD_LPM) != 0 && plen <= 32);
+
+	return (thm_vremove(head, thm_lpm_key(head, key, plen)));
+}
+
+/*
+ * Single descent along the address, prefixes ending within each level are
+ * looked up in the same slot before going down. Longest one seen wins.
+ */
+uintptr_t
+thm_lpm(struct thm_head *head, uint32_t key, u_int *plenp)
+{
+	struct thm_slot *slot;
+	uintptr_t *entp, best, subkeys;
+	u_int c, count, i, level, subkey;
+	int r;
+
+	ASSERT((head->th_flags & THM_HEAD_LPM) != 0);
+
+	if (head->th_root == 0)
+		return (0);
+
+	best = 0;
+	slot = thm_ptr_get_value(head->th_root);
+	for (level = 0; ; ) {
+		if (__predict_false(thm_slot_map(slot) == 0) &&
+		    thm_slot_is_prefix(head, slot)) {
+			subkeys = thm_prefix_subkeys(slot);
+			count = thm_prefix_count(slot);
+			for (i = 0; i < count; i++, level++,
+			    subkeys >>= head->th_stride) {
+				subkey = subkeys & (THM_FANOUT(head) - 1);
+				c = thm_lpm_chunk(key, level);
+				if ((subkey & THM_LPM_MARK) == 0) {
+					if (subkey != c)
+						goto done;
+					continue;
+				}
+				/* Nothing but the prefix below its marker */
+				r = thm_lpm_covers(subkey, c);
+				if (r >= 0) {
+					best = slot->ts_entry[0];
+					if (plenp != NULL)
+						*plenp = level * THM_LPM_BITS +
+						    r;
+				}
+				goto done;
+			}
+			if ((slot->ts_entry[0] & THM_PTR_MASK_SLOT) == 0)
+				break;
+			slot = thm_prefix_child(slot);
+			continue;
+		}
+
+		c = thm_lpm_chunk(key, level);
+		r = level < head->th_levels - 1 ? THM_LPM_BITS - 1 : 0;
+		for (; r >= 0; r--) {
+			entp = thm_find_step(head, slot,
+			    THM_LPM_MARK | 1U << r | c >> (THM_LPM_BITS - r));
+			if (entp != NULL) {
+				best = *entp;
+				if (plenp != NULL)
+					*plenp = level * THM_LPM_BITS + r;
+				break;
+			}
+		}
+		if (level == head->th_levels - 1)
+			break;
+		entp = thm_find_step(head, slot, c);
+		if (entp == NULL || (*entp & THM_PTR_MASK_SLOT) == 0)
+			break;
+		slot = thm_ptr_get_value(*entp);
+		level++;
+	}
+done:
+	if (best == 0)
+		return (0);
+
+	return (thm_lpm_leaf(best));
+}
+
+static __inline uint64_t
+thm_hash_round(uint64_t h, uint64_t w)
+{
+	h += w * THM_HASH_PRIME2;
+	h = (h << 31) | (h >> 33);
+
+	return (h * THM_HASH_PRIME1);
+}
+
+static __inline uint64_t
+thm_hash_final(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= THM_HASH_PRIME2;
+	h ^= h >> 29;
+	h *= THM_HASH_PRIME1;
+	h ^= h >> 32;
+
+	return (h);
+}
+
+static __inline uint64_t
+thm_hash_word(const u_char *p, size_t len)
+{
+	uint64_t w;
+
+	w = 0;
+	memcpy(&w, p, len);
+
+	return (w);
+}
+
+/*
+ * Word at a time, long keys go through independent lanes which compilers
+ * turn into vector code. Tail word is zero padded, length is mixed in.
+ */
+uint32_t
+thm_hash_bytes(const void *data, size_t len)
+{
+	const u_char *p = data;
+	uint64_t lane[THM_HASH_LANES], h;
+	size_t off;
+	u_int i;
+
+	off = 0;
+	h = THM_HASH_SEED + len * THM_HASH_PRIME1;
+	if (len >= THM_HASH_BLOCK) {
+		for (i = 0; i < THM_HASH_LANES; i++)
+			lane[i] = h + i * THM_HASH_PRIME2;
+		for (; off + THM_HASH_BLOCK <= len; off += THM_HASH_BLOCK) {
+			for (i = 0; i < THM_HASH_LANES; i++)
+				lane[i] = thm_hash_round(lane[i],
+				    thm_hash_word(p + off + i * 8, 8));
 		}
+		for (i = 0; i < THM_HASH_LANES; i++)
+			h = thm_hash_round(h, lane[i]);
 	}
+	for (; off + 8 <= len; off += 8)
+		h = thm_hash_round(h, thm_hash_word(p + off, 8));
+	if (off < len)
+		h = thm_hash_round(h, thm_hash_word(p + off, len - off));
 
-	/* back track */
-	entval = thm_next(cr);
-	goto done;
+	return ((uint32_t)thm_hash_final(h));
+}
 
-found_gt:
-	if ((*entp & THM_PTR_MASK_SLOT) != 0) {
-		thm_cursor_push(cr, entp);
-		entval = thm_first_impl(cr);
-	} else {
-		entval = thm_ptr_get_value(*entp);
-		ASSERT(thm_entry_get_key(head, entval) > key);
+/* Leaf hash mixes the key with digest of the bucket or the value */
+static __inline uint64_t
+thm_digest_leaf(struct thm_head *head, uint64_t ikey,
+    struct thm_bucket *bucket)
+{
+	uint64_t d;
+
+	if (thm_head_wide(head)->tw_digest != NULL)
+		d = thm_head_wide(head)->tw_digest(bucket);
+	else
+		d = (uintptr_t)bucket;
+
+	return (thm_hash_final(thm_hash_round(thm_hash_round(THM_HASH_SEED,
+	    ikey), d)));
+}
+
+/* Sum of leaf hashes from lo to hi */
+static uint64_t
+thm_digest_walk(struct thm_head *head, uint64_t lo, uint64_t hi)
+{
+	struct thm_cursor cr;
+	struct thm_bucket *bucket;
+	uint64_t ikey, sum;
+
+	sum = 0;
+	for (bucket = thm_nfind(head, lo, &cr); bucket != NULL;
+	    bucket = thm_next(&cr)) {
+		ikey = thm_leaf_ikey(head, &cr, bucket);
+		if (ikey > hi)
+			break;
+		sum += thm_digest_leaf(head, ikey, bucket);
 	}
-	goto done;
 
-found_eq:
-	thm_cursor_push(cr, entp);
-	if ((*entp & THM_PTR_MASK_SLOT) != 0)
-		goto restart;
-	else {
-		entval = thm_ptr_get_value(*entp);
-		if (thm_entry_get_key(head, entval) < key)
-			entval = thm_next(cr);
+	return (sum);
+}
+
+/* Digest of segment tree node, taken again if an entry below changed */
+static uint64_t
+thm_wide_digest(struct thm_head *head, u_int node)
+{
+	uint64_t *dirty, *tree, lo;
+	u_int fanout, ind, shift;
+
+	fanout = THM_WIDE_FANOUT(head);
+	tree = thm_wide_digests(head);
+	dirty = tree + 2 * fanout;
+	if ((dirty[node / 64] & ((uint64_t)1 << (node % 64))) == 0)
+		return (tree[node]);
+
+	if (node < fanout) {
+		tree[node] = thm_wide_digest(head, 2 * node) +
+		    thm_wide_digest(head, 2 * node + 1);
+	} else {
+		ind = node - fanout;
+		tree[node] = 0;
+		if (thm_ptr_get_value(((uintptr_t *)head->th_root)[ind]) !=
+		    NULL) {
+			shift = head->th_stride * (head->th_levels -
+			    thm_wide_levels(head));
+			lo = (uint64_t)ind << shift;
+			tree[node] = thm_digest_walk(head, lo,
+			    lo | (((uint64_t)1 << shift) - 1));
+		}
 	}
+	dirty[node / 64] &= ~((uint64_t)1 << (node % 64));
 
-done:
-	ASSERT(entval == NULL || thm_entry_get_key(head, entval) > key);
-	return (entval);
+	return (tree[node]);
 }
 
-static uintptr_t *
-thm_insert_step(struct thm_pool *pool, uintptr_t *slotp, u_int key)
+/*
+ * Digest of 2^bits keys from lo, lo is aligned to it. Ranges of whole
+ * entries are nodes of the tree, smaller ones are walked.
+ */
+static uint64_t
+thm_digest_node(struct thm_head *head, uint64_t lo, u_int bits)
 {
-	struct thm_slot *slot, *oslot;
-	uint32_t keyind, smap;
-	u_int count, keybit, slen;
+	u_int shift;
 
-	ASSERT(key < THM_SLOT_MAX_ENTRIES);
+	shift = head->th_stride * (head->th_levels - thm_wide_levels(head));
+	if (bits < shift)
+		return (thm_digest_walk(head, lo,
+		    lo | (((uint64_t)1 << bits) - 1)));
+	if (bits >= head->th_stride * head->th_levels)
+		return (thm_wide_digest(head, 1));
 
-	slot = thm_ptr_get_value(*slotp);
-	slen = thm_slot_get_slen(slot);
-	if (slen == THM_SLEN_MAX)
-		return (thm_slotmax_entry(slot, key));
+	return (thm_wide_digest(head, (THM_WIDE_FANOUT(head) +
+	    (u_int)(lo >> shift)) >> (bits - shift)));
+}
 
-	smap = slot->ts_map;
-	keybit = THM_KEY_BIT(key);
-	keyind = THM_COUNT_1BITS_32(smap & (keybit - 1));
+/*
+ * Digest of keys from lo to hi inclusive, equal for equal key ranges of
+ * heads of any stride or wide root size. Entries fully in the range are
+ * summed up from the tree, keys of partly covered boundary entries are
+ * walked.
+ */
+uint64_t
+thm_digest_range(struct thm_head *head, uint64_t lo, uint64_t hi)
+{
+	uint64_t mask, sum;
+	u_int ihi, ilo, shift;
 
-	if ((smap & keybit) != 0)
-		return (&slot->ts_entry[keyind]);
+	ASSERT((head->th_flags & THM_HEAD_DIGEST) != 0);
 
-	/* Insert new entry */
-	count = THM_COUNT_1BITS_32(smap);
-	ASSERT(count + 1 <= slen * THM_SLOT_MIN_ENTRIES);
+	lo &= thm_head_keymask(head);
+	hi &= thm_head_keymask(head);
+	if (lo > hi)
+		return (0);
 
-	if (count + 1 + 1 > slen * THM_SLOT_MIN_ENTRIES &&
-	    thm_slot_tryextend(pool, slot, slen, slen + 1)) {
-		slen += 1;
-		if (slen == THM_SLEN_MAX)
-			return (thm_slotmax_entry(slot, key));
+	shift = head->th_stride * (head->th_levels - thm_wide_levels(head));
+	mask = ((uint64_t)1 << shift) - 1;
+	ilo = thm_wide_index(head, lo);
+	ihi = thm_wide_index(head, hi);
+	if (ilo == ihi && ((lo & mask) != 0 || (hi & mask) != mask))
+		return (thm_digest_walk(head, lo, hi));
+
+	sum = 0;
+	if ((lo & mask) != 0) {
+		sum += thm_digest_walk(head, lo, lo | mask);
+		ilo++;
 	}
-	if (count + 1 + 1 <= slen * THM_SLOT_MIN_ENTRIES) {
-		slot->ts_map |= keybit;
-		for (u_int i = count; i > keyind; i--)
-			slot->ts_entry[i] = slot->ts_entry[i - 1];
-		slot->ts_entry[keyind] = 0;
-		if (keyind < 3)
-			thm_slot_set_slen(slot, slen);
-		ASSERT((u_int)THM_COUNT_1BITS_32(slot->ts_map) + 1 <=
-		    slen * THM_SLOT_MIN_ENTRIES);
-		return (&slot->ts_entry[keyind]);
+	if ((hi & mask) != mask) {
+		sum += thm_digest_walk(head, hi & ~mask, hi);
+		ihi--;
 	}
-
-	/* Allocate larger slot */
-	oslot = slot;
-	slot = thm_slot_alloc(pool, slen + 1, oslot);
-	if (slot == NULL)
-		return (NULL);
-
-	thm_ptr_set_slot(slotp, slot);
-	slen += 1;
-
-	if (slen == THM_SLEN_MAX) {
-		thm_slotmax_fix_extend(oslot, (struct thm_slotmax *)slot);
-		thm_slot_free(pool, oslot, slen - 1);
-		return (thm_slotmax_entry(slot, key));
+	for (ilo += THM_WIDE_FANOUT(head), ihi += THM_WIDE_FANOUT(head) + 1;
+	    ilo < ihi; ilo /= 2, ihi /= 2) {
+		if ((ilo & 1) != 0)
+			sum += thm_wide_digest(head, ilo++);
+		if ((ihi & 1) != 0)
+			sum += thm_wide_digest(head, --ihi);
 	}
 
-	slot->ts_map = oslot->ts_map | keybit;
-	for (u_int i = 0; i < keyind; i++)
-		slot->ts_entry[i] = oslot->ts_entry[i];
-	slot->ts_entry[keyind] = 0;
-	for (u_int i = keyind; i < count; i++)
-		slot->ts_entry[i + 1] = oslot->ts_entry[i];
-	thm_slot_set_slen(slot, slen);
-	thm_slot_free(pool, oslot, slen - 1);
+	return (sum);
+}
 
-	ASSERT((u_int)THM_COUNT_1BITS_32(slot->ts_map) + 1 <=
-	    slen * THM_SLOT_MIN_ENTRIES);
+uint64_t
+thm_digest(struct thm_head *head)
+{
+	ASSERT((head->th_flags & THM_HEAD_DIGEST) != 0);
 
-	return (&slot->ts_entry[keyind]);
+	return (thm_digest_node(head, 0, head->th_keybits));
 }
 
-static uintptr_t *
-thm_insert_mkslot(struct thm_pool *pool, uintptr_t *slotp_top, u_int subkey_n,
-    struct thm_entry *entry1, u_int key1,
-    struct thm_entry *entry2, u_int key2)
+/* Bucket contents of the key changed without insert or remove */
+void
+thm_digest_update(struct thm_head *head, uint64_t key)
 {
-	struct thm_slot *slot;
-	uintptr_t *ent1, *ent2, *slotp;
-	u_int nslots, subkey1, subkey2;
+	ASSERT((head->th_flags & THM_HEAD_DIGEST) != 0);
 
-	slotp = slotp_top;
+	thm_leaf_changed(head, key & thm_head_keymask(head));
+}
 
-	nslots = THM_COUNT_LEADING_0BITS_32(key1 ^ key2);
-	nslots = THM_SUBKEY_BITIND(nslots) - subkey_n + 1;
-	ASSERT(nslots >= 1);
+struct thm_digest_cmp {
+	struct thm_head	*tdc_a;
+	struct thm_head	*tdc_b;
+	thm_range_cb_t	*tdc_cb;
+	void		*tdc_arg;
+	u_long		tdc_count;
+	u_int		tdc_bits;	/* smallest range compared */
+	int		tdc_diff;	/* range below not reported yet */
+	uint64_t	tdc_lo;
+	uint64_t	tdc_hi;
+};
 
-	slot = thm_slot_alloc(pool, nslots, slotp);
-	if (slot == NULL)
-		return (NULL);
-	memset(slot, 0, nslots * THM_SLOT_SIZE);
+/* Split differing ranges down to tdc_bits, merge adjacent ones */
+static void
+thm_digest_cmp_node(struct thm_digest_cmp *dc, uint64_t lo, u_int bits)
+{
+	uint64_t hi;
 
-nested:
-	subkey1 = THM_SUBKEY(key1, subkey_n);
-	subkey2 = THM_SUBKEY(key2, subkey_n);
-	if (subkey1 == subkey2) {
-		slot->ts_map = (1 << subkey1);
-		thm_ptr_set_slot(slotp, slot);
-		slotp = &slot->ts_entry[0];
-		slot = (struct thm_slot *)((uintptr_t *)slot +
-		    THM_SLOT_MIN_ENTRIES);
-		subkey_n++;
-		goto nested;
+	if (thm_digest_node(dc->tdc_a, lo, bits) ==
+	    thm_digest_node(dc->tdc_b, lo, bits))
+		return;
+	if (bits > dc->tdc_bits) {
+		thm_digest_cmp_node(dc, lo, bits - 1);
+		thm_digest_cmp_node(dc, lo | ((uint64_t)1 << (bits - 1)),
+		    bits - 1);
+		return;
 	}
 
-	slot->ts_map = (1 << subkey1) | (1 << subkey2);
-	thm_ptr_set_slot(slotp, slot);
-	if (key1 < key2) {
-		ent1 = &slot->ts_entry[0];
-		ent2 = &slot->ts_entry[1];
-	} else {
-		ent1 = &slot->ts_entry[1];
-		ent2 = &slot->ts_entry[0];
+	hi = lo | (((uint64_t)1 << bits) - 1);
+	if (dc->tdc_diff && dc->tdc_hi + 1 == lo) {
+		dc->tdc_hi = hi;
+		return;
 	}
-	thm_bucket_insert(ent1, entry1);
-	thm_bucket_set(ent2, entry2);
-
-	return (ent1);
+	if (dc->tdc_diff) {
+		dc->tdc_cb(dc->tdc_arg, dc->tdc_lo, dc->tdc_hi);
+		dc->tdc_count++;
+	}
+	dc->tdc_diff = 1;
+	dc->tdc_lo = lo;
+	dc->tdc_hi = hi;
 }
 
-struct thm_bucket *
-thm_insert(struct thm_head *head, struct thm_entry *entry)
+/*
+ * Compare heads top down by their digest trees, halves of equal digests
+ * are skipped. Ranges spanned by an entry of the larger wide root entries
+ * of the two aren't split further, ranges that differ are reported merged
+ * with adjacent ones. Returns number of ranges reported.
+ */
+u_long
+thm_digest_cmp(struct thm_head *a, struct thm_head *b, thm_range_cb_t *cb,
+    void *arg)
 {
-	struct thm_pool *pool;
-	struct thm_entry *xentry;
-	uintptr_t *parentp, *entp;
-	uint32_t key, xkey;
-	u_int subkey_n;
+	struct thm_digest_cmp dc;
+
+	ASSERT((a->th_flags & b->th_flags & THM_HEAD_DIGEST) != 0);
+	ASSERT(thm_head_keymask(a) == thm_head_keymask(b));
+
+	dc.tdc_a = a;
+	dc.tdc_b = b;
+	dc.tdc_cb = cb;
+	dc.tdc_arg = arg;
+	dc.tdc_count = 0;
+	dc.tdc_bits = MAX(a->th_stride * (a->th_levels - thm_wide_levels(a)),
+	    b->th_stride * (b->th_levels - thm_wide_levels(b)));
+	dc.tdc_diff = 0;
+	thm_digest_cmp_node(&dc, 0, a->th_keybits);
+	if (dc.tdc_diff) {
+		cb(arg, dc.tdc_lo, dc.tdc_hi);
+		dc.tdc_count++;
+	}
 
-	pool = head->th_pool;
-	key = thm_entry_get_key(head, entry);
+	return (dc.tdc_count);
+}
 
-	parentp = &head->th_root;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 0));
-	if (entp == NULL)
-		return (NULL);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		subkey_n = 0;
-		goto found;
-	}
+/*
+ * Lockstep walk of two heads by subkey. Wide roots, dense tables and prefix
+ * slots span several levels, they're entered a level at a time so heads of
+ * different shape line up. Leaf above the last level stands for the path
+ * of its key.
+ */
+struct thm_pair_node {
+	uintptr_t	tn_ent;
+	u_int		tn_skip;	/* levels of the node already taken */
+	uint64_t	tn_key;		/* key of value leaf with a tail */
+};
 
-	parentp = entp;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 1));
-	if (entp == NULL)
-		return (NULL);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		subkey_n = 1;
-		goto found;
+struct thm_pair {
+	struct thm_head	*tp_a;
+	struct thm_head	*tp_b;
+	thm_bucket_eq_t	*tp_eq;
+	thm_diff_cb_t	*tp_cb;
+	void		*tp_arg;
+	u_long		tp_count;
+	u_int		tp_mode;
+	u_int		tp_digest;	/* levels above it compare digests */
+};
+
+#define	THM_PAIR_A			0x01	/* keys only in a */
+#define	THM_PAIR_B			0x02	/* keys only in b */
+#define	THM_PAIR_AB			0x04	/* keys in both */
+
+/* Any of n table entries from lo is used, n is a power of 2 */
+static int
+thm_table_any(uint64_t *map, u_int lo, u_int n)
+{
+	u_int i;
+
+	if (n < 64)
+		return (((map[lo / 64] >> (lo % 64)) &
+		    (((uint64_t)1 << n) - 1)) != 0);
+	for (i = lo / 64; i < (lo + n) / 64; i++) {
+		if (map[i] != 0)
+			return (1);
 	}
 
-	parentp = entp;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 2));
-	if (entp == NULL)
-		return (NULL);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		subkey_n = 2;
-		goto found;
+	return (0);
+}
+
+/* Subkeys used at level below node, prefix holds the subkeys above */
+static uint64_t
+thm_pair_map(struct thm_head *head, const struct thm_pair_node *n,
+    uint64_t prefix, u_int level)
+{
+	struct thm_slot *slot;
+	uint64_t *map, m;
+	u_int c, fanout, span;
+
+	if (thm_ptr_get_value(n->tn_ent) == NULL)
+		return (0);
+	if ((n->tn_ent & THM_PTR_MASK_SLOT) == 0 &&
+	    (head->th_flags & THM_HEAD_VALUE) != 0)
+		return ((uint64_t)1 << THM_SUBKEY(head, n->tn_key, level));
+	if ((n->tn_ent & THM_PTR_MASK_SLOT) == 0)
+		return ((uint64_t)1 << THM_SUBKEY(head, thm_entry_get_ikey(head,
+		    thm_leaf_get_value(head, n->tn_ent)), level));
+
+	slot = thm_ptr_get_value(n->tn_ent);
+	fanout = THM_FANOUT(head);
+	m = 0;
+	if (thm_slot_is_wide(head, slot)) {
+		map = thm_table_map(slot, THM_WIDE_FANOUT(head));
+		span = 1U << (head->th_stride *
+		    (thm_wide_levels(head) - n->tn_skip - 1));
+		for (c = 0; c < fanout; c++) {
+			if (thm_table_any(map,
+			    (((u_int)prefix << head->th_stride) | c) * span, span))
+				m |= (uint64_t)1 << c;
+		}
+		return (m);
+	}
+	if (thm_slot_is_dense(head, slot)) {
+		if (n->tn_skip != 0)
+			return (thm_dense_rowmap(head, slot,
+			    prefix & (fanout - 1)));
+		for (c = 0; c < fanout; c++) {
+			if (thm_dense_rowmap(head, slot, c) != 0)
+				m |= (uint64_t)1 << c;
+		}
+		return (m);
+	}
+	if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot))
+		return ((uint64_t)1 << ((thm_prefix_subkeys(slot) >>
+		    (n->tn_skip * head->th_stride)) & (fanout - 1)));
+	if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+		for (c = 0; c < fanout; c++) {
+			if (thm_ptr_get_value(*thm_slotmax_entry(slot, c)) != NULL)
+				m |= (uint64_t)1 << c;
+		}
+		return (m);
 	}
 
-	parentp = entp;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 3));
-	if (entp == NULL)
-		return (NULL);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		subkey_n = 3;
-		goto found;
+	return (thm_slot_map(slot));
+}
+
+/* Node for subkey c below node at level, c must be used */
+static void
+thm_pair_child(struct thm_head *head, const struct thm_pair_node *n,
+    uint64_t prefix, u_int level, u_int c, struct thm_pair_node *child)
+{
+	struct thm_slot *slot;
+	u_int bits, fanout, shift;
+
+	*child = *n;
+	child->tn_skip++;
+	if ((n->tn_ent & THM_PTR_MASK_SLOT) == 0) {
+		child->tn_skip = 0;
+		return;
 	}
 
-	parentp = entp;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 4));
-	if (entp == NULL)
-		return (NULL);
-	if ((*entp & THM_PTR_MASK_SLOT) == 0) {
-		subkey_n = 4;
-		goto found;
+	slot = thm_ptr_get_value(n->tn_ent);
+	fanout = THM_FANOUT(head);
+	if (thm_slot_is_wide(head, slot)) {
+		if (child->tn_skip < thm_wide_levels(head))
+			return;
+		child->tn_ent = ((uintptr_t *)slot)[(((u_int)prefix <<
+		    head->th_stride) | c) & (THM_WIDE_FANOUT(head) - 1)];
+	} else if (thm_slot_is_dense(head, slot)) {
+		if (child->tn_skip < THM_DENSE_LEVELS)
+			return;
+		child->tn_ent = ((uintptr_t *)slot)[(prefix & (fanout - 1)) *
+		    fanout + c];
+	} else if (thm_slot_map(slot) == 0 &&
+	    thm_slot_is_prefix(head, slot)) {
+		if (child->tn_skip < thm_prefix_count(slot))
+			return;
+		child->tn_ent = slot->ts_entry[0];
+	} else if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head)) {
+		child->tn_ent = *thm_slotmax_entry(slot, c);
+	} else {
+		shift = THM_COUNT_1BITS_MAP(thm_slot_map(slot) &
+		    (THM_KEY_BIT(c) - 1));
+		child->tn_ent = slot->ts_entry[shift];
+		bits = thm_tail_bits(head, level);
+		if ((child->tn_ent & THM_PTR_MASK_SLOT) == 0 && bits != 0)
+			child->tn_key = (((prefix << head->th_stride) | c) <<
+			    bits) | thm_tail_get(head, slot,
+			    &slot->ts_entry[shift], bits);
 	}
+	child->tn_skip = 0;
+}
 
-	parentp = entp;
-	entp = thm_insert_step(pool, parentp, THM_SUBKEY(key, 5));
-	if (entp == NULL)
-		return (NULL);
-	ASSERT((*entp & THM_PTR_MASK_SLOT) == 0);
-	subkey_n = 5;
+static void
+thm_pair_emit(struct thm_pair *p, uint64_t key, struct thm_bucket *a,
+    struct thm_bucket *b)
+{
+	if (a != NULL && b != NULL) {
+		if ((p->tp_mode & THM_PAIR_AB) == 0 ||
+		    (p->tp_eq != NULL && p->tp_eq(a, b)))
+			return;
+	} else if ((p->tp_mode & (a != NULL ? THM_PAIR_A : THM_PAIR_B)) == 0)
+		return;
 
-found:
-	if ((xentry = thm_ptr_get_value(*entp)) != NULL &&
-	    (xkey = thm_entry_get_key(head, xentry)) != key) {
-		entp = thm_insert_mkslot(pool, entp, subkey_n + 1,
-		    entry, key, xentry, xkey);
-		if (entp == NULL)
-			return (NULL);
-		return (thm_ptr_get_value(*entp));
-	}
+	p->tp_cb(p->tp_arg, key, a, b);
+	p->tp_count++;
+}
 
-	thm_bucket_insert(entp, entry);
+/* Leaves of the last level, set heads compare key bitmaps */
+static void
+thm_pair_leaf(struct thm_pair *p, uintptr_t enta, uintptr_t entb,
+    uint64_t ikey)
+{
+	struct thm_head *head = p->tp_a;
+	uintptr_t a, b, m;
+	u_int bit;
+
+	if ((head->th_flags & THM_HEAD_SET) == 0) {
+		thm_pair_emit(p, ikey & thm_head_keymask(head),
+		    thm_leaf_get_value(head, enta),
+		    thm_leaf_get_value(p->tp_b, entb));
+		return;
+	}
 
-	return (thm_ptr_get_value(*entp));
+	a = (uintptr_t)thm_ptr_get_value(enta) >> THM_SET_SHIFT;
+	b = (uintptr_t)thm_ptr_get_value(entb) >> THM_SET_SHIFT;
+	for (m = a | b; m != 0; m &= m - 1) {
+		bit = THM_COUNT_TRAILING_0BITS_MAP(m);
+		thm_pair_emit(p, (ikey << head->th_stride) | bit,
+		    (a & THM_KEY_BIT(bit)) != 0 ? THM_SET_MEMBER : NULL,
+		    (b & THM_KEY_BIT(bit)) != 0 ? THM_SET_MEMBER : NULL);
+	}
 }
 
+/* Digests of both heads match for keys under prefix */
 static int
-thm_remove_step(struct thm_pool *pool, struct thm_slot *slot, uintptr_t *entp,
-    u_int key)
+thm_pair_same(struct thm_pair *p, uint64_t prefix, u_int level)
 {
-	uint32_t keybit;
-	u_int count, keyind, slen;
+	u_int shift;
 
-	slen = thm_slot_get_slen(slot);
-	if (slen == THM_SLEN_MAX) {
-		struct thm_slotmax *slotmax = (struct thm_slotmax *)slot;
+	if (level == 0)
+		return (thm_digest(p->tp_a) == thm_digest(p->tp_b));
 
-		ASSERT(entp >= slotmax->ts_entry &&
-		    entp < slotmax->ts_entry + THM_SLOT_MAX_ENTRIES);
+	shift = p->tp_a->th_stride * (p->tp_a->th_levels - level);
 
-		thm_ptr_set_value(entp, NULL);
-		for (count = 0, entp = slotmax->ts_entry;
-		    entp < slotmax->ts_entry + THM_SLOT_MAX_ENTRIES; entp++) {
-			if (thm_ptr_get_value(*entp) != NULL)
-				count++;
-		}
-	} else {
-		keyind = entp - slot->ts_entry;
-		keybit = THM_KEY_BIT(key);
+	return (thm_digest_node(p->tp_a, prefix << shift, shift) ==
+	    thm_digest_node(p->tp_b, prefix << shift, shift));
+}
 
-		ASSERT(entp >= slot->ts_entry &&
-		    keyind < slen * THM_SLOT_MIN_ENTRIES);
-		ASSERT((slot->ts_map & keybit) != 0);
+static void
+thm_pair_walk(struct thm_pair *p, const struct thm_pair_node *na,
+    const struct thm_pair_node *nb, uint64_t prefix, u_int level)
+{
+	struct thm_pair_node ca, cb;
+	uint64_t ma, mb, visit;
+	u_int c;
 
-		slot->ts_map &= ~keybit;
-		count = THM_COUNT_1BITS_32(slot->ts_map);
+	if (level == p->tp_a->th_levels) {
+		thm_pair_leaf(p, na->tn_ent, nb->tn_ent, prefix);
+		return;
+	}
+	if (level < p->tp_digest && thm_pair_same(p, prefix, level))
+		return;
 
-		for (u_int i = keyind; i < count; i++)
-			slot->ts_entry[i] = slot->ts_entry[i + 1];
-		if (keyind < 3)
-			thm_slot_set_slen(slot, slen);
+	ma = thm_pair_map(p->tp_a, na, prefix, level);
+	mb = thm_pair_map(p->tp_b, nb, prefix, level);
+
+	/* Subtrees of one head only hold keys of that head */
+	visit = ma & mb;
+	if ((p->tp_mode & THM_PAIR_A) != 0)
+		visit |= ma & ~mb;
+	if ((p->tp_mode & THM_PAIR_B) != 0)
+		visit |= mb & ~ma;
+
+	memset(&ca, 0, sizeof(ca));
+	memset(&cb, 0, sizeof(cb));
+	for (; visit != 0; visit &= visit - 1) {
+		c = THM_COUNT_TRAILING_0BITS_64(visit);
+		if ((ma & ((uint64_t)1 << c)) != 0)
+			thm_pair_child(p->tp_a, na, prefix, level, c, &ca);
+		else
+			ca.tn_ent = 0;
+		if ((mb & ((uint64_t)1 << c)) != 0)
+			thm_pair_child(p->tp_b, nb, prefix, level, c, &cb);
+		else
+			cb.tn_ent = 0;
+		thm_pair_walk(p, &ca, &cb, (prefix << p->tp_a->th_stride) | c,
+		    level + 1);
 	}
+}
 
-	if (count == 0)
-		return (1);
+/* Heads of different stride are merged by key */
+static void
+thm_pair_merge(struct thm_pair *p)
+{
+	struct thm_cursor cra, crb;
+	struct thm_bucket *a, *b;
+	uint64_t ka, kb;
+
+	a = thm_first(p->tp_a, &cra);
+	b = thm_first(p->tp_b, &crb);
+	ka = kb = 0;
+	while (a != NULL || b != NULL) {
+		if (a != NULL)
+			ka = thm_leaf_ikey(p->tp_a, &cra, a);
+		if (b != NULL)
+			kb = thm_leaf_ikey(p->tp_b, &crb, b);
+		if (b == NULL || (a != NULL && ka < kb)) {
+			thm_pair_emit(p, ka, a, NULL);
+			a = thm_next(&cra);
+		} else if (a == NULL || kb < ka) {
+			thm_pair_emit(p, kb, NULL, b);
+			b = thm_next(&crb);
+		} else {
+			thm_pair_emit(p, ka, a, b);
+			a = thm_next(&cra);
+			b = thm_next(&crb);
+		}
+	}
+}
 
-	if (count + 1 + 2 <= (slen - 1) * THM_SLOT_MIN_ENTRIES &&
-	    (THM_SLOT_MIN_ENTRIES > 4 && slen > 1)) {
-		ASSERT(slen > 1);
-		thm_slot_shrink(pool, slot, slen, slen - 1);
+static void
+thm_pair_run(struct thm_pair *p)
+{
+	struct thm_pair_node na, nb;
+
+	ASSERT(thm_head_keymask(p->tp_a) == thm_head_keymask(p->tp_b));
+	ASSERT(((p->tp_a->th_flags ^ p->tp_b->th_flags) &
+	    (THM_HEAD_VALUE | THM_HEAD_SET)) == 0);
+	ASSERT(((p->tp_a->th_flags | p->tp_b->th_flags) &
+	    THM_HEAD_SKEY) == 0);
+
+	p->tp_count = 0;
+	if (p->tp_a->th_stride != p->tp_b->th_stride) {
+		ASSERT((p->tp_a->th_flags & THM_HEAD_SET) == 0);
+		thm_pair_merge(p);
+		return;
 	}
 
-	return (0);
+	/* Wide root is the only root slot not tagged */
+	na.tn_ent = p->tp_a->th_root;
+	if ((p->tp_a->th_flags & THM_HEAD_WIDE) != 0)
+		na.tn_ent |= THM_PTR_MASK_SLOT;
+	na.tn_skip = 0;
+	na.tn_key = 0;
+	nb.tn_ent = p->tp_b->th_root;
+	if ((p->tp_b->th_flags & THM_HEAD_WIDE) != 0)
+		nb.tn_ent |= THM_PTR_MASK_SLOT;
+	nb.tn_skip = 0;
+	nb.tn_key = 0;
+	thm_pair_walk(p, &na, &nb, 0, 0);
 }
 
-void
-thm_remove(struct thm_head *head, struct thm_entry *entry)
+static int
+thm_bucket_same(struct thm_bucket *a, struct thm_bucket *b)
 {
-	struct thm_cursor cr;
-	uintptr_t *entp;
-	void *entval;
-	uint32_t key;
-	int subkey_n;
-
-	key = thm_entry_get_key(head, entry);
+	return (a == b);
+}
 
-	entval = thm_find_impl(head, key, &cr);
-	ASSERT(entval != NULL);
+/*
+ * Keys of a or b but not both, and keys of both with buckets eq tells
+ * apart, in key order. Heads of the same stride are walked in lockstep
+ * skipping subtrees of one head at once, digest heads skip key ranges of
+ * equal digests as well, so eq must agree with the digests.
+ */
+u_long
+thm_diff(struct thm_head *a, struct thm_head *b, thm_bucket_eq_t *eq,
+    thm_diff_cb_t *cb, void *arg)
+{
+	struct thm_pair p;
+
+	p.tp_a = a;
+	p.tp_b = b;
+	p.tp_eq = eq != NULL ? eq : thm_bucket_same;
+	p.tp_cb = cb;
+	p.tp_arg = arg;
+	p.tp_mode = THM_PAIR_A | THM_PAIR_B | THM_PAIR_AB;
+	p.tp_digest = 0;
+	if ((a->th_flags & b->th_flags & THM_HEAD_DIGEST) != 0)
+		p.tp_digest = MIN(thm_wide_levels(a), thm_wide_levels(b)) + 1;
+	thm_pair_run(&p);
+
+	return (p.tp_count);
+}
 
-	subkey_n = cr.tc_level - 1;
-	entp = cr.tc_path[cr.tc_level];
+/* Set operations descend only where the mode may find keys */
+static u_long
+thm_pair_op(struct thm_head *a, struct thm_head *b, u_int mode,
+    thm_diff_cb_t *cb, void *arg)
+{
+	struct thm_pair p;
+
+	p.tp_a = a;
+	p.tp_b = b;
+	p.tp_eq = NULL;
+	p.tp_cb = cb;
+	p.tp_arg = arg;
+	p.tp_mode = mode;
+	p.tp_digest = 0;
+	thm_pair_run(&p);
+
+	return (p.tp_count);
+}
 
-	thm_bucket_remove(entp, entry);
+/* Keys of both heads, subtrees of one head only are skipped */
+u_long
+thm_intersect(struct thm_head *a, struct thm_head *b, thm_diff_cb_t *cb,
+    void *arg)
+{
+	return (thm_pair_op(a, b, THM_PAIR_AB, cb, arg));
+}
 
-	if (thm_ptr_get_value(*entp) != NULL)
-		return;
+/* Keys of either head, once with both buckets for keys of both */
+u_long
+thm_union(struct thm_head *a, struct thm_head *b, thm_diff_cb_t *cb,
+    void *arg)
+{
+	return (thm_pair_op(a, b, THM_PAIR_A | THM_PAIR_B | THM_PAIR_AB, cb,
+	    arg));
+}
 
-	/* Remove slot */
-	for (; subkey_n >= 0; subkey_n--) {
-		/* slot for entp */
-		entval = thm_ptr_get_value(*cr.tc_path[subkey_n]);
-		if (thm_remove_step(head->th_pool, entval, entp,
-		    THM_SUBKEY(key, subkey_n)) == 0)
-			break;
-		if (subkey_n > 0) {
-			thm_slot_free(head->th_pool, entval,
-			    thm_slot_get_slen(entval));
-		}
-		entp = cr.tc_path[subkey_n];
-	}
+/* Keys of a not in b, subtrees of b only are skipped */
+u_long
+thm_difference(struct thm_head *a, struct thm_head *b, thm_diff_cb_t *cb,
+    void *arg)
+{
+	return (thm_pair_op(a, b, THM_PAIR_A, cb, arg));
 }
 
 static __inline u_int
@@ -1138,6 +5062,22 @@ thm_page_alloc_slot(struct thm_page *page, u_int slen)
 
 again:
 	switch (slen) {
+	case 16:
+		m1 = m1 & (m1 >> 1) & MASK_01010101;
+		m1 = (m1 & MASK_00110011) &
+		    ((m1 & MASK_11001100) >> 2);
+		m1 = (m1 & MASK_00001111) &
+		    ((m1 & MASK_11110000) >> 4);
+		m1 = (m1 & MASK_0000000011111111) &
+		    ((m1 & MASK_1111111100000000) >> 8);
+		m2 = m2 & (m2 >> 1) & MASK_01010101;
+		m2 = (m2 & MASK_00110011) &
+		    ((m2 & MASK_11001100) >> 2);
+		m2 = (m2 & MASK_00001111) &
+		    ((m2 & MASK_11110000) >> 4);
+		m2 = (m2 & MASK_0000000011111111) &
+		    ((m2 & MASK_1111111100000000) >> 8);
+		break;
 	case 8:
 		m1 = m1 & (m1 >> 1) & MASK_01010101;
 		m1 = (m1 & MASK_00110011) &
@@ -1344,14 +5284,16 @@ thm_slot_get_offset(struct thm_slot *slot)
 }
 
 static void
-thm_slotmax_fix_shrink(struct thm_slotmax *slotmax, struct thm_slot *slot_new,
-    u_int slen_new)
+thm_slotmax_fix_shrink(struct thm_head *head, struct thm_slotmax *slotmax,
+    struct thm_slot *slot_new, u_int slen_new)
 {
 	uintptr_t xbuf[THM_SLOT_MAX_ENTRIES], *buf;
 	uintptr_t map = 0, keybit = 1;
 	u_int i, keyind;
 
-	for (i = 0, keyind = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
+	ASSERT(slen_new < THM_SLEN_MAX);
+
+	for (i = 0, keyind = 0; i < THM_FANOUT(head); i++) {
 		if (thm_ptr_get_value(slotmax->ts_entry[i]) != NULL)
 			map |= keybit;
 		keybit <<= 1;
@@ -1361,10 +5303,10 @@ thm_slotmax_fix_shrink(struct thm_slotmax *slotmax, struct thm_slot *slot_new,
 		buf = slot_new->ts_entry;
 	else
 		buf = xbuf;
-	for (i = 0, keyind = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
+	for (i = 0, keyind = 0; i < THM_FANOUT(head); i++) {
 		if (thm_ptr_get_value(slotmax->ts_entry[i]) == NULL)
 			continue;
-		buf[keyind] = slotmax->ts_entry[i];
+		buf[keyind] = slotmax->ts_entry[i] & ~THM_PTR_MASK_SLEN;
 		keyind++;
 	}
 	ASSERT(keyind > 0 && keyind < slen_new * THM_SLOT_MIN_ENTRIES);
@@ -1372,31 +5314,32 @@ thm_slotmax_fix_shrink(struct thm_slotmax *slotmax, struct thm_slot *slot_new,
 		memcpy(slot_new->ts_entry, buf, keyind * sizeof(uintptr_t));
 
 	slot_new->ts_map = map;
-	thm_slot_set_slen(slot_new, slen_new);
+	thm_slot_set_slen(head, slot_new, slen_new);
 }
 
 static void
-thm_slotmax_fix_extend(struct thm_slot *slot_old, struct thm_slotmax *slotmax)
+thm_slotmax_fix_extend(struct thm_head *head, struct thm_slot *slot_old,
+    struct thm_slotmax *slotmax)
 {
 	uintptr_t xbuf[THM_SLOT_MAX_ENTRIES], *buf;
-	uint32_t smap, keybit;
+	uintptr_t smap, keybit;
 	u_int i, keyind;
 
-	smap = slot_old->ts_map;
+	smap = thm_slot_map(slot_old);
 	keyind = 0;
 
 	ASSERT(smap != 0);
-	ASSERT((u_int)THM_COUNT_1BITS_32(smap) + 1 <=
-	    thm_slot_get_slen(slot_old) * THM_SLOT_MIN_ENTRIES);
+	ASSERT((u_int)THM_COUNT_1BITS_MAP(smap) + 1 <=
+	    thm_slot_get_slen(head, slot_old) * THM_SLOT_MIN_ENTRIES);
 
 	if (slot_old != (void *)slotmax)
 		buf = slotmax->ts_entry;
 	else
 		buf = xbuf;
 
-	memset(buf, 0, THM_SLOT_MAX_ENTRIES * sizeof(uintptr_t));
+	memset(buf, 0, THM_FANOUT(head) * sizeof(uintptr_t));
 	while (smap != 0) {
-		i = THM_COUNT_TRAILING_0BITS_32(smap);
+		i = THM_COUNT_TRAILING_0BITS_MAP(smap);
 		keybit = THM_KEY_BIT(i);
 		smap &= ~keybit;
 		buf[i] = slot_old->ts_entry[keyind];
@@ -1405,9 +5348,10 @@ thm_slotmax_fix_extend(struct thm_slot *slot_old, struct thm_slotmax *slotmax)
 
 	if (slot_old == (void *)slotmax)
 		memcpy(slotmax->ts_entry, buf,
-		    THM_SLOT_MAX_ENTRIES * sizeof(uintptr_t));
+		    THM_FANOUT(head) * sizeof(uintptr_t));
 
-	thm_slot_set_slen((struct thm_slot *)slotmax, THM_SLEN_MAX);
+	thm_slot_set_slen(head, (struct thm_slot *)slotmax,
+	    THM_SLOTMAX_SLEN(head));
 }
 
 static void
@@ -1420,14 +5364,6 @@ thm_slot_shrink(struct thm_pool *pool, struct thm_slot *slot, u_int slen_old,
 
 	ASSERT(slen_old > slen_new);
 
-	if (slen_new != 0) {
-		if (slen_old == THM_SLEN_MAX)
-			thm_slotmax_fix_shrink((struct thm_slotmax *)slot, slot,
-			    slen_new);
-		else
-			thm_slot_set_slen(slot, slen_new);
-	}
-
 	page = thm_addr_get_page(slot);
 	off = thm_slot_get_offset(slot);
 	if (off < 64) {
@@ -1482,11 +5418,6 @@ thm_slot_tryextend(struct thm_pool *pool __unused, struct thm_slot *slot,
 	if ((*map & mask) == mask) {
 		*map &= ~mask;
 		THM_POOL_UNLOCK(pool);
-		if (slen_new == THM_SLEN_MAX)
-			thm_slotmax_fix_extend(slot,
-			    (struct thm_slotmax *)slot);
-		else
-			thm_slot_set_slen(slot, slen_new);
 		return (1);
 	} else
 		THM_POOL_UNLOCK(pool);
@@ -1501,13 +5432,15 @@ thm_slot_alloc_step(struct thm_pool *pool, struct thm_page *page, u_int slen)
 	u_int rank;
 
 	rank = thm_page_get_rank(page);
-	if (rank < slen)
+	if (rank < MIN(slen, THM_SLEN_MAX))
 		return (NULL);
 	slot = thm_page_alloc_slot(page, slen);
 	if (slot != NULL)
 		return (slot);
 
-	thm_page_demote(pool, page, rank, slen);
+	/* Ranks don't track runs longer than THM_SLEN_MAX */
+	if (slen <= THM_SLEN_MAX)
+		thm_page_demote(pool, page, rank, slen);
 
 	return (NULL);
 }
@@ -1519,7 +5452,7 @@ thm_slot_alloc(struct thm_pool *pool, u_int slen, void *hint)
 	struct thm_slot *slot = NULL;
 	u_int rank;
 
-	ASSERT(slen <= THM_SLEN_MAX);
+	ASSERT(slen <= THM_SLEN_MAX || slen == THM_SLOTMAX_SLEN_MAX);
 
 	THM_POOL_LOCK(pool);
 
@@ -1530,7 +5463,7 @@ thm_slot_alloc(struct thm_pool *pool, u_int slen, void *hint)
 			goto out;
 	}
 
-	for (rank = slen; rank < THM_POOL_RANK_MAX; rank++) {
+	for (rank = MIN(slen, THM_SLEN_MAX); rank < THM_POOL_RANK_MAX; rank++) {
 		page = thm_pool_first(pool, rank);
 		while (page != NULL) {
 			npage = thm_pool_next(page);
@@ -1556,8 +5489,9 @@ thm_slot_alloc_zero(struct thm_pool *pool, u_int slen, void *hint)
 	if (slot == NULL)
 		return (NULL);
 
+	/* Zeroed unit is an empty compressed slot in either encoding */
+	ASSERT(slen == 1);
 	memset(slot, 0, slen * THM_SLOT_SIZE);
-	thm_slot_set_slen(slot, slen);
 
 	return (slot);
 }
@@ -1732,41 +5666,74 @@ static void
 thm_dump_tree_step(struct thm_head *head, struct thm_slot *slot)
 {
 	uintptr_t buf[THM_SLOT_MAX_ENTRIES], *ents;
+	u_int n, size;
+
+	if (!thm_slot_is_wide(head, slot) && !thm_slot_is_dense(head, slot) &&
+	    thm_slot_is_prefix(head, slot)) {
+		uintptr_t subkeys = thm_prefix_subkeys(slot);
 
-	if (thm_slot_get_slen(slot) == THM_SLEN_MAX) {
+		printf("P:%p:%u: ", slot, thm_prefix_count(slot));
+		for (u_int i = 0; i < thm_prefix_count(slot); i++) {
+			printf("%ju ", (uintmax_t)(subkeys &
+			    (THM_FANOUT(head) - 1)));
+			subkeys >>= head->th_stride;
+		}
+		if ((slot->ts_entry[0] & THM_PTR_MASK_SLOT) == 0) {
+			printf("V:%jx\n", (uintmax_t)slot->ts_entry[0]);
+			return;
+		}
+		printf("S:%p\n", thm_prefix_child(slot));
+		thm_dump_tree_step(head, thm_prefix_child(slot));
+		return;
+	}
+
+	if ((n = thm_slot_direct(head, slot)) != 0) {
 		ents = ((struct thm_slotmax *)slot)->ts_entry;
+		size = n;
 	} else {
-		uint32_t keybit, smap;
+		uintptr_t keybit, smap;
 		u_int keyind;
 
 		ents = buf;
-		memset(buf, 0, THM_SLOT_MAX_ENTRIES * sizeof(uintptr_t));
-		smap = slot->ts_map;
+		memset(buf, 0, THM_FANOUT(head) * sizeof(uintptr_t));
+		smap = thm_slot_map(slot);
 		keyind = 0;
 		while (smap != 0) {
-			u_int i = THM_COUNT_TRAILING_0BITS_32(smap);
+			u_int i = THM_COUNT_TRAILING_0BITS_MAP(smap);
 			keybit = THM_KEY_BIT(i);
 			smap &= ~keybit;
 			ents[i] = slot->ts_entry[keyind];
 			keyind++;
 		}
+		n = THM_FANOUT(head);
+		size = thm_slot_get_slen(head, slot) * THM_SLOT_MIN_ENTRIES;
 	}
 
-	printf("S:%p:%d: ", slot,
-	    thm_slot_get_slen(slot) * THM_SLOT_MIN_ENTRIES);
-	for (int i = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
+	printf("S:%p:%u: ", slot, size);
+	for (u_int i = 0; i < n; i++) {
 		void *entval = thm_ptr_get_value(ents[i]);
 		if (entval == NULL)
 			continue;
-		if ((ents[i] & THM_PTR_MASK_SLOT) == 0)
-		printf("%d:D:%p:K%08x ", i, entval,
-		    thm_entry_get_key(head, entval));
-		else
-		printf("%d:S:%p ", i, entval);
+		if ((ents[i] & THM_PTR_MASK_SLOT) == 0 &&
+		    (head->th_flags & THM_HEAD_VALUE) != 0) {
+			printf("%u:V:%jx ", i, (uintmax_t)(uintptr_t)entval);
+		} else if ((ents[i] & THM_PTR_MASK_SLOT) == 0) {
+			struct thm_key key;
+
+			entval = thm_leaf_get_value(head, ents[i]);
+			thm_entry_get_key(head, entval, &key);
+			if ((head->th_flags & THM_HEAD_SKEY) != 0)
+				printf("%u:D:%p:K\"%.*s\" ", i, entval,
+				    (int)key.tk_len, key.tk_str);
+			else
+				printf("%u:D:%p:K%08jx ", i, entval,
+				    (uintmax_t)key.tk_val);
+		} else
+		printf("%u:S:%p ", i, entval);
 	}
 	printf("\n");
 
-	for (int i = 0; i < THM_SLOT_MAX_ENTRIES; i++) {
+	for (u_int i = 0; i < n; i++) {
 		void *entval = thm_ptr_get_value(ents[i]);
 		if (entval == NULL || (ents[i] & THM_PTR_MASK_SLOT) == 0)
 			continue;
@@ -1777,7 +5744,8 @@ thm_dump_tree_step(struct thm_head *head, struct thm_slot *slot)
 void
 thm_dump_tree(struct thm_head *head)
 {
-	thm_dump_tree_step(head, thm_ptr_get_value(head->th_root));
+	if (thm_root_is_slot(head))
+		thm_dump_tree_step(head, thm_ptr_get_value(head->th_root));
 }
 
 #endif /* !_KERNEL */
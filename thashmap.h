@@ -43,20 +43,110 @@
 
 #define	THM_SLEN_MAX			8
 
-#define	THM_SUBKEY_MAX			6
+/* Number of levels required for 64-bit keys with 4-bit stride */
+#define	THM_SUBKEY_MAX			16
+
+/* Byte string keys use two levels per byte and end of key level */
+#define	THM_SKEY_MAXLEN			255
+#define	THM_SKEY_LEVELS			(2 * THM_SKEY_MAXLEN + 1)
+
+/* thm_head_init_flags() flags, unsupported combinations fail with EINVAL */
+#define	THM_HEAD_KEY30			0x0000
+#define	THM_HEAD_KEY32			0x0001
+#define	THM_HEAD_KEY64			0x0002
+#define	THM_HEAD_KEYWIDTH		0x0003
+#define	THM_HEAD_SKEY			0x0004
+#define	THM_HEAD_VALUE			0x0008
+#define	THM_HEAD_STRIDE5		0x0000
+#define	THM_HEAD_STRIDE4		0x0010
+#define	THM_HEAD_STRIDE6		0x0020	/* 64-bit archs only */
+#define	THM_HEAD_STRIDE			0x0030
+#define	THM_HEAD_FPRINT			0x0040	/* 64-bit archs only */
+#define	THM_HEAD_SET			0x0080
+#define	THM_HEAD_DLIST			0x0100
+#define	THM_HEAD_WIDE			0x0200	/* integer keys only */
+#define	THM_HEAD_DENSE			0x0400	/* integer keys only */
+#define	THM_HEAD_LPM			0x0800	/* stride 5 only */
+#define	THM_HEAD_COUNT			0x1000	/* implies THM_HEAD_WIDE */
+#define	THM_HEAD_AGGR			0x2000	/* thm_head_init_aggr() only */
+#define	THM_HEAD_DIGEST			0x4000	/* thm_head_init_digest() only */
 
 #define	THM_POOL_RANK_MAX		(THM_SLEN_MAX + 1)
 
+/*
+ * Value mode heads store tagged values in leaves instead of entries:
+ * pointers aligned to 8 bytes or integers up to THM_VALUE_INT_BITS wide.
+ * Zero value is reserved for empty entries.
+ */
+#define	THM_VALUE_INT_TAG		((uintptr_t)0x04)
+#define	THM_VALUE_INT_SHIFT		3
+#define	THM_VALUE_INT_BITS		\
+	(8 * sizeof(uintptr_t) - THM_VALUE_INT_SHIFT)
+
 struct thm_bucket;
 struct thm_page;
 
+/*
+ * Aggregate heads keep summaries of their leaves. ta_combine must be
+ * associative and commutative with ta_identity as identity element, like
+ * sum, min, max or bitwise or. ta_value summarizes a bucket, value heads
+ * pass the value as the bucket.
+ */
+struct thm_aggr {
+	uint64_t	ta_identity;
+	uint64_t	(*ta_value)(struct thm_bucket *bucket);
+	uint64_t	(*ta_combine)(uint64_t a, uint64_t b);
+};
+
+/* Digest of bucket contents, value heads may hash values instead */
+typedef uint64_t thm_digest_t(struct thm_bucket *bucket);
+
+/* Key range from lo to hi inclusive */
+typedef void thm_range_cb_t(void *arg, uint64_t lo, uint64_t hi);
+
+/* Buckets of the same key in two heads match */
+typedef int thm_bucket_eq_t(struct thm_bucket *a, struct thm_bucket *b);
+
+/*
+ * Key of two heads, NULL bucket for the head without it. Set heads pass
+ * THM_SET_MEMBER for members.
+ */
+typedef void thm_diff_cb_t(void *arg, uint64_t key, struct thm_bucket *a,
+    struct thm_bucket *b);
+
+#define	THM_SET_MEMBER			((struct thm_bucket *)1)
+
 struct thm_entry {
 	struct thm_entry *te_next;
 };
 
+/*
+ * Entry with back link for heads with large duplicate buckets, removal
+ * doesn't walk the bucket. Types embedding it are defined by
+ * THM_DEFINE_DLIST*().
+ */
+struct thm_dentry {
+	struct thm_entry tde_entry;
+	struct thm_entry *tde_prev;
+};
+
+struct thm_skey {
+	const void	*tsk_data;
+	size_t		tsk_len;
+};
+
+/* Cursors hold no pointers into themselves and may be copied */
 struct thm_cursor {
-	uintptr_t	*tc_path[THM_SUBKEY_MAX + 1];
+	struct thm_head	*tc_head;
 	u_int		tc_level;
+	u_int		tc_depth;
+	uintptr_t	*tc_path[THM_SUBKEY_MAX + 1];
+};
+
+/* Cursor for byte string key heads, tsc_path continues tc_path */
+struct thm_scursor {
+	struct thm_cursor tsc_cursor;
+	uintptr_t	*tsc_path[THM_SKEY_LEVELS - THM_SUBKEY_MAX];
 };
 
 struct thm_pool_queue {
@@ -72,10 +162,29 @@ struct thm_pool {
 	struct thm_pool_queue tp_queue[THM_POOL_RANK_MAX];
 };
 
+/*
+ * Root entry is a slot, a lone leaf of entry heads or 0 for empty heads.
+ * Wide root heads point it at the wide root table.
+ */
 struct thm_head {
 	struct thm_pool *th_pool;
 	uintptr_t	th_root;
-	int		th_keyoffset;
+	short		th_keyoffset;	/* in 32-bit words */
+	u_short		th_flags;
+	u_short		th_levels;
+	u_char		th_stride;
+	u_char		th_keybits;
+};
+
+/*
+ * Wide root head state is kept in front of the wide root table, leaf count
+ * drives table growth.
+ */
+struct thm_wide {
+	u_long		tw_leaves;
+	const struct thm_aggr *tw_aggr;
+	thm_digest_t	*tw_digest;
+	u_int		tw_levels;
 };
 
 struct thm_pool_stats {
@@ -96,10 +205,53 @@ void thm_pool_get_stats(struct thm_pool *pool, struct thm_pool_stats *stats);
 
 void thm_head_init(struct thm_head *head, struct thm_pool *pool, int keyoffset);
 
+int thm_head_init_flags(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags);
+
+int thm_head_init_aggr(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags, const struct thm_aggr *aggr);
+
+int thm_head_init_digest(struct thm_head *head, struct thm_pool *pool,
+    int keyoffset, u_int flags, thm_digest_t *digest);
+
 void thm_head_destroy(struct thm_head *head);
 
 int thm_empty(struct thm_head *head);
 
+u_long thm_count(struct thm_head *head);
+
+u_long thm_rank(struct thm_head *head, uint64_t key);
+
+struct thm_bucket *thm_select(struct thm_head *head, u_long k,
+    struct thm_cursor *curs);
+
+u_long thm_count_range(struct thm_head *head, uint64_t lo, uint64_t hi);
+
+uint64_t thm_aggregate(struct thm_head *head, uint64_t lo, uint64_t hi);
+
+void thm_aggr_update(struct thm_head *head, uint64_t key);
+
+uint64_t thm_digest(struct thm_head *head);
+
+uint64_t thm_digest_range(struct thm_head *head, uint64_t lo, uint64_t hi);
+
+void thm_digest_update(struct thm_head *head, uint64_t key);
+
+u_long thm_digest_cmp(struct thm_head *a, struct thm_head *b,
+    thm_range_cb_t *cb, void *arg);
+
+u_long thm_diff(struct thm_head *a, struct thm_head *b, thm_bucket_eq_t *eq,
+    thm_diff_cb_t *cb, void *arg);
+
+u_long thm_intersect(struct thm_head *a, struct thm_head *b,
+    thm_diff_cb_t *cb, void *arg);
+
+u_long thm_union(struct thm_head *a, struct thm_head *b, thm_diff_cb_t *cb,
+    void *arg);
+
+u_long thm_difference(struct thm_head *a, struct thm_head *b,
+    thm_diff_cb_t *cb, void *arg);
+
 struct thm_bucket *thm_first(struct thm_head *head, struct thm_cursor *curs);
 
 struct thm_bucket *thm_last(struct thm_head *head, struct thm_cursor *curs);
@@ -108,16 +260,66 @@ struct thm_bucket *thm_next(struct thm_cursor *curs);
 
 struct thm_bucket *thm_prev(struct thm_cursor *curs);
 
-struct thm_bucket *thm_find(struct thm_head *head, uint32_t key,
+struct thm_bucket *thm_find(struct thm_head *head, uint64_t key,
     struct thm_cursor *cr);
 
-struct thm_bucket *thm_nfind(struct thm_head *head, uint32_t key,
+struct thm_bucket *thm_nfind(struct thm_head *head, uint64_t key,
     struct thm_cursor *cr);
 
+struct thm_bucket *thm_sfirst(struct thm_head *head, struct thm_scursor *scr);
+
+struct thm_bucket *thm_slast(struct thm_head *head, struct thm_scursor *scr);
+
+struct thm_bucket *thm_sfind(struct thm_head *head, const void *key,
+    size_t len, struct thm_scursor *scr);
+
+struct thm_bucket *thm_snfind(struct thm_head *head, const void *key,
+    size_t len, struct thm_scursor *scr);
+
 struct thm_bucket *thm_insert(struct thm_head *head, struct thm_entry *entry);
 
 void thm_remove(struct thm_head *head, struct thm_entry *entry);
 
+uintptr_t thm_vfind(struct thm_head *head, uint64_t key,
+    struct thm_cursor *cr);
+
+uintptr_t thm_vnfind(struct thm_head *head, uint64_t key,
+    struct thm_cursor *cr);
+
+uint64_t thm_vkey(struct thm_cursor *cr);
+
+int thm_vinsert(struct thm_head *head, uint64_t key, uintptr_t value);
+
+uintptr_t thm_vremove(struct thm_head *head, uint64_t key);
+
+int thm_set_add(struct thm_head *head, uint64_t key);
+
+int thm_set_remove(struct thm_head *head, uint64_t key);
+
+int thm_set_member(struct thm_head *head, uint64_t key);
+
+int thm_set_first(struct thm_head *head, struct thm_cursor *cr,
+    uint64_t *keyp);
+
+int thm_set_last(struct thm_head *head, struct thm_cursor *cr,
+    uint64_t *keyp);
+
+int thm_set_next(struct thm_cursor *cr, uint64_t *keyp);
+
+int thm_set_prev(struct thm_cursor *cr, uint64_t *keyp);
+
+int thm_set_nfind(struct thm_head *head, uint64_t key, struct thm_cursor *cr,
+    uint64_t *keyp);
+
+int thm_lpm_insert(struct thm_head *head, uint32_t key, u_int plen,
+    uintptr_t value);
+
+uintptr_t thm_lpm_remove(struct thm_head *head, uint32_t key, u_int plen);
+
+uintptr_t thm_lpm(struct thm_head *head, uint32_t key, u_int *plenp);
+
+uint32_t thm_hash_bytes(const void *data, size_t len);
+
 void thm_dump_tree(struct thm_head *head);
 
 static __inline void *
@@ -138,7 +340,327 @@ thm_bucket_next(struct thm_entry *entry)
 	return (entry->te_next);
 }
 
+static __inline uintptr_t
+thm_value_from_int(uint64_t v)
+{
+	return (((uintptr_t)v << THM_VALUE_INT_SHIFT) | THM_VALUE_INT_TAG);
+}
+
+static __inline uintptr_t
+thm_value_from_ptr(void *p)
+{
+	return ((uintptr_t)p);
+}
+
+static __inline int
+thm_value_is_int(uintptr_t value)
+{
+	return ((value & THM_VALUE_INT_TAG) != 0);
+}
+
+static __inline uint64_t
+thm_value_to_int(uintptr_t value)
+{
+	return (value >> THM_VALUE_INT_SHIFT);
+}
+
+static __inline void *
+thm_value_to_ptr(uintptr_t value)
+{
+	return ((void *)value);
+}
+
+static __inline uintptr_t
+thm_vfirst(struct thm_head *head, struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_first(head, cr));
+}
+
+static __inline uintptr_t
+thm_vlast(struct thm_head *head, struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_last(head, cr));
+}
+
+static __inline uintptr_t
+thm_vnext(struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_next(cr));
+}
+
+static __inline uintptr_t
+thm_vprev(struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_prev(cr));
+}
+
+static __inline uintptr_t
+thm_vselect(struct thm_head *head, u_long k, struct thm_cursor *cr)
+{
+	return ((uintptr_t)thm_select(head, k, cr));
+}
+
+/*
+ * Slot layout needed by inlined lookup, the rest of it is private to
+ * thashmap.c.
+ */
+#define	THM_SLOT_MIN_ENTRIES		4
+#define	THM_SLOT_SIZE			\
+	(THM_SLOT_MIN_ENTRIES * (int)sizeof(uintptr_t))
+
+#define	THM_FANOUT(head)		(1U << (head)->th_stride)
+#define	THM_SLOTMAX_SLEN(head)		\
+	(THM_FANOUT(head) / THM_SLOT_MIN_ENTRIES)
+
+#define	THM_PREFIX_SHIFT		2
+
+#define	THM_DENSE_LEVELS		2
+#define	THM_DENSE_FANOUT(head)		\
+	(1U << (THM_DENSE_LEVELS * (head)->th_stride))
+#define	THM_DENSE_OFFSET		(THM_SLOT_SIZE / 2)
+
+/*
+ * Fingerprint heads keep folded key in the top bits of leaf pointers,
+ * pointers are restored by sign extension.
+ */
+#define	THM_FPRINT_BITS			16
+#define	THM_FPRINT_SHIFT		\
+	(8 * sizeof(uintptr_t) - THM_FPRINT_BITS)
+
+#ifdef THM_SLOT_HEADER
+#define	THM_SLOT_HDR_SLEN_SHIFT		32
+#define	THM_SLOT_HDR_MAP		\
+	(((uintptr_t)1 << THM_SLOT_HDR_SLEN_SHIFT) - 1)
+#define	THM_SLOT_HDR_SLEN		\
+	((uintptr_t)(THM_SLEN_MAX - 1) << THM_SLOT_HDR_SLEN_SHIFT)
+#define	THM_SLOT_HDR_PREFIX		\
+	((uintptr_t)THM_SLEN_MAX << THM_SLOT_HDR_SLEN_SHIFT)
+#endif
+
+struct thm_slot {
+	uintptr_t	ts_map;
+	uintptr_t	ts_entry[0];
+};
+
+struct thm_slotmax {
+	uintptr_t	ts_entry[0];
+};
+
+static __inline uintptr_t *
+thm_slotmax_entry(struct thm_slot *slot, u_int ind)
+{
+	struct thm_slotmax *slotmax = (struct thm_slotmax *)slot;
+
+	return (&slotmax->ts_entry[ind]);
+}
+
+#ifdef THM_SLOT_HEADER
+
+static __inline uintptr_t
+thm_slot_map(struct thm_slot *slot)
+{
+	return (slot->ts_map & THM_SLOT_HDR_MAP);
+}
+
+static __inline u_int
+thm_slot_get_slen(struct thm_head *head, struct thm_slot *slot)
+{
+	if ((slot->ts_entry[0] & THM_PTR_MASK_SLEN) != 0)
+		return (THM_SLOTMAX_SLEN(head));
+
+	return (((slot->ts_map & THM_SLOT_HDR_SLEN) >>
+	    THM_SLOT_HDR_SLEN_SHIFT) + 1);
+}
+
+#else /* !THM_SLOT_HEADER */
+
+static __inline uintptr_t
+thm_slot_map(struct thm_slot *slot)
+{
+	return (slot->ts_map);
+}
+
+static __inline u_int
+thm_slot_get_slen(struct thm_head *head, struct thm_slot *slot)
+{
+	u_int slen;
+
+	slen = (((slot->ts_entry[0] & THM_PTR_MASK_SLEN) >> 1) |
+	    (slot->ts_entry[1] & THM_PTR_MASK_SLEN) |
+	    ((slot->ts_entry[2] & THM_PTR_MASK_SLEN) << 1)) + 1;
+
+	if (slen == THM_SLEN_MAX)
+		slen = THM_SLOTMAX_SLEN(head);
+
+	return (slen);
+}
+
+#endif /* THM_SLOT_HEADER */
+
+static __inline int
+thm_slot_is_prefix(struct thm_head *head, struct thm_slot *slot)
+{
+#ifdef THM_SLOT_HEADER
+	return (slot->ts_map == THM_SLOT_HDR_PREFIX &&
+	    (slot->ts_entry[0] & THM_PTR_MASK_SLEN) == 0);
+#else
+	return (slot->ts_map == 0 && slot->ts_entry[0] != 0 &&
+	    thm_slot_get_slen(head, slot) == 1);
+#endif
+}
+
+static __inline u_int
+thm_prefix_count(struct thm_slot *slot)
+{
+	return (slot->ts_entry[2] >> THM_PREFIX_SHIFT);
+}
+
+static __inline uintptr_t
+thm_prefix_subkeys(struct thm_slot *slot)
+{
+	return (slot->ts_entry[1] >> THM_PREFIX_SHIFT);
+}
+
+/* Dense tables are the only slots off slot alignment */
+static __inline int
+thm_slot_is_dense(struct thm_head *head, struct thm_slot *slot)
+{
+	return (((uintptr_t)slot & (THM_SLOT_SIZE - 1)) == THM_DENSE_OFFSET &&
+	    (head->th_flags & THM_HEAD_DENSE) != 0);
+}
+
+static __inline uint64_t
+thm_head_keymask(struct thm_head *head)
+{
+	if (head->th_keybits == 0)
+		return (0);
+
+	return (~(uint64_t)0 >> (64 - head->th_keybits));
+}
+
+static __inline struct thm_wide *
+thm_head_wide(struct thm_head *head)
+{
+	return ((struct thm_wide *)head->th_root - 1);
+}
+
+static __inline uintptr_t
+thm_key_fprint(uint64_t ikey)
+{
+	ikey ^= ikey >> 32;
+	ikey ^= ikey >> 16;
+
+	return (ikey & ((1 << THM_FPRINT_BITS) - 1));
+}
+
+/*
+ * Integer key lookup without cursor. Key offset and width are constants
+ * when called from THM_DEFINE*() generated code. Follows thm_find().
+ */
+static __inline struct thm_bucket *
+thm_find_inline(struct thm_head *head, uint64_t key, int keyoffset,
+    int key64)
+{
+	struct thm_slot *slot;
+	uintptr_t ent, keybit, smap, subkeys;
+	uint64_t ekey;
+	void *entval;
+	u_int count, i, level, shift, subkey;
+
+	key &= thm_head_keymask(head);
+	ent = head->th_root;
+	level = 0;
+
+	/* Wide root entry replaces first tw_levels steps */
+	if ((head->th_flags & THM_HEAD_WIDE) != 0) {
+		level = thm_head_wide(head)->tw_levels;
+		ent = ((uintptr_t *)head->th_root)[(key >>
+		    (head->th_stride * (head->th_levels - level))) &
+		    ((1U << (level * head->th_stride)) - 1)];
+	}
+
+	while ((ent & THM_PTR_MASK_SLOT) != 0) {
+		slot = thm_ptr_get_value(ent);
+		if (thm_slot_is_dense(head, slot)) {
+			ent = ((uintptr_t *)slot)[key &
+			    (THM_DENSE_FANOUT(head) - 1)];
+			break;
+		}
+		shift = head->th_stride * (head->th_levels - 1 - level);
+		if (thm_slot_map(slot) == 0 && thm_slot_is_prefix(head, slot)) {
+			count = thm_prefix_count(slot);
+			subkeys = thm_prefix_subkeys(slot);
+			for (i = 0; i < count; i++, subkeys >>= head->th_stride,
+			    shift -= head->th_stride) {
+				if (((subkeys ^ (key >> shift)) &
+				    (THM_FANOUT(head) - 1)) != 0)
+					return (NULL);
+			}
+			ent = slot->ts_entry[0];
+			level += count;
+			continue;
+		}
+		subkey = (key >> shift) & (THM_FANOUT(head) - 1);
+		if (thm_slot_get_slen(head, slot) == THM_SLOTMAX_SLEN(head))
+			ent = *thm_slotmax_entry(slot, subkey);
+		else {
+			smap = thm_slot_map(slot);
+			keybit = (uintptr_t)1 << subkey;
+			if ((smap & keybit) == 0)
+				return (NULL);
+			ent = slot->ts_entry[__builtin_popcountl(smap &
+			    (keybit - 1))];
+		}
+		level++;
+	}
+
+	if (thm_ptr_get_value(ent) == NULL)
+		return (NULL);
+	if ((head->th_flags & THM_HEAD_FPRINT) != 0) {
+		if ((ent >> THM_FPRINT_SHIFT) != thm_key_fprint(key))
+			return (NULL);
+		ent = (intptr_t)(ent << THM_FPRINT_BITS) >> THM_FPRINT_BITS;
+	}
+	entval = thm_ptr_get_value(ent);
+	if (key64)
+		ekey = *(uint64_t *)(void *)((char *)entval + keyoffset);
+	else
+		ekey = *(uint32_t *)(void *)((char *)entval + keyoffset) &
+		    thm_head_keymask(head);
+	if (ekey != key)
+		return (NULL);
+
+	return (entval);
+}
+
 #define	THM_DEFINE(name, type, entryfield, keyfield)			\
+	THM_DEFINE_KEY(name, type, entryfield, keyfield, uint32_t,	\
+	    THM_HEAD_KEY30)
+
+#define	THM_DEFINE32(name, type, entryfield, keyfield)			\
+	THM_DEFINE_KEY(name, type, entryfield, keyfield, uint32_t,	\
+	    THM_HEAD_KEY32)
+
+#define	THM_DEFINE64(name, type, entryfield, keyfield)			\
+	THM_DEFINE_KEY(name, type, entryfield, keyfield, uint64_t,	\
+	    THM_HEAD_KEY64)
+
+#define	THM_DEFINE_SKEY(name, type, entryfield, keyfield)		\
+	THM_DEFINE_KEY(name, type, entryfield, keyfield,		\
+	    struct thm_skey, THM_HEAD_SKEY)
+
+/* Entries linked by struct thm_dentry field, see THM_HEAD_DLIST */
+#define	THM_DEFINE_DLIST(name, type, entryfield, keyfield)		\
+	THM_DEFINE_DLIST_KEY(name, type, entryfield, keyfield, uint32_t, \
+	    THM_HEAD_KEY30)
+
+#define	THM_DEFINE_DLIST_KEY(name, type, entryfield, keyfield, keytype, \
+	    keyflags)							\
+	THM_DEFINE_KEY(name, type, entryfield.tde_entry, keyfield,	\
+	    keytype, (keyflags) | THM_HEAD_DLIST)
+
+#define	THM_DEFINE_KEY(name, type, entryfield, keyfield, keytype,	\
+	    keyflags)							\
 									\
 struct name##_BUCKET;							\
 									\
@@ -147,7 +669,7 @@ struct name##_HEAD {							\
 };									\
 									\
 static __inline int							\
-name##_KEYOFFSET0(struct thm_entry *entryptr, uint32_t *keyptr)		\
+name##_KEYOFFSET0(struct thm_entry *entryptr, keytype *keyptr)		\
 {									\
 	return ((intptr_t)keyptr - (intptr_t)entryptr);			\
 }									\
@@ -160,6 +682,22 @@ name##_KEYOFFSET(void)							\
 	return (name##_KEYOFFSET0(&ent->entryfield, &ent->keyfield));	\
 }									\
 									\
+static __inline u_int							\
+name##_KEYFLAGS(void)							\
+{									\
+	return (keyflags);						\
+}									\
+									\
+static __inline struct thm_bucket *					\
+name##_FIND(struct name##_HEAD *head, uint64_t key,			\
+    struct thm_cursor *cr)						\
+{									\
+	if (cr != NULL)							\
+		return (thm_find(&head->name##_head, key, cr));		\
+	return (thm_find_inline(&head->name##_head, key,		\
+	    name##_KEYOFFSET(), ((keyflags) & THM_HEAD_KEY64) != 0));	\
+}									\
+									\
 static __inline struct thm_bucket *					\
 name##_BUCKET_CAST(struct name##_BUCKET *bucket)			\
 {									\
@@ -181,12 +719,90 @@ name##_FIELD(struct type *elm)						\
 	return (&(elm->entryfield));					\
 }
 
+/*
+ * Hashed heads take arbitrary keys. Entries keep 32-bit key hash in
+ * hashfield, hashfn(key) computes it and eqfn(elm, key) is true if elm
+ * has the key. Keys with the same hash share a bucket.
+ */
+#define	THM_DEFINE_HASH(name, type, entryfield, hashfield, keytype,	\
+	    hashfn, eqfn)						\
+	THM_DEFINE_KEY(name, type, entryfield, hashfield, uint32_t,	\
+	    THM_HEAD_KEY32)						\
+									\
+static __inline struct type *						\
+name##_HLOOKUP(struct name##_HEAD *head, keytype key, uint32_t hash)	\
+{									\
+	struct thm_bucket *bucket;					\
+	struct type *elm;						\
+									\
+	bucket = name##_FIND(head, hash, NULL);				\
+	if (bucket == NULL)						\
+		return (NULL);						\
+	for (elm = name##_ENTRY(thm_bucket_first(bucket)); elm != NULL; \
+	    elm = name##_ENTRY(thm_bucket_next(name##_FIELD(elm)))) {	\
+		if (eqfn(elm, key))					\
+			return (elm);					\
+	}								\
+	return (NULL);							\
+}									\
+									\
+static __inline struct type *						\
+name##_HFIND(struct name##_HEAD *head, keytype key)			\
+{									\
+	return (name##_HLOOKUP(head, key, hashfn(key)));		\
+}									\
+									\
+/* Element with the same key if there is one, NULL if out of slots */	\
+static __inline struct type *						\
+name##_HINSERT(struct name##_HEAD *head, struct type *elm, keytype key) \
+{									\
+	struct thm_bucket *bucket;					\
+	struct type *old;						\
+									\
+	/* Hashes rarely collide, insert first and back out duplicates */ \
+	elm->hashfield = hashfn(key);					\
+	bucket = thm_insert(&head->name##_head, name##_FIELD(elm));	\
+	if (bucket == NULL)						\
+		return (NULL);						\
+	for (old = name##_ENTRY(thm_bucket_first(bucket)); old != NULL; \
+	    old = name##_ENTRY(thm_bucket_next(name##_FIELD(old)))) {	\
+		if (old != elm && eqfn(old, key)) {			\
+			thm_remove(&head->name##_head, name##_FIELD(elm)); \
+			return (old);					\
+		}							\
+	}								\
+	return (elm);							\
+}									\
+									\
+static __inline struct type *						\
+name##_HREMOVE(struct name##_HEAD *head, keytype key)			\
+{									\
+	struct type *elm;						\
+									\
+	elm = name##_HFIND(head, key);					\
+	if (elm != NULL)						\
+		thm_remove(&head->name##_head, name##_FIELD(elm));	\
+	return (elm);							\
+}
+
 #define	THM_HEAD(name)			struct name##_HEAD
 
 #define	THM_BUCKET(name)		struct name##_BUCKET
 
 #define	THM_HEAD_INIT(name, head, pool)					\
-	thm_head_init(&(head)->name##_head, (pool), name##_KEYOFFSET())
+	THM_HEAD_INIT_FLAGS(name, head, pool, 0)
+
+#define	THM_HEAD_INIT_FLAGS(name, head, pool, flags)			\
+	thm_head_init_flags(&(head)->name##_head, (pool),		\
+	    name##_KEYOFFSET(), name##_KEYFLAGS() | (flags))
+
+#define	THM_HEAD_INIT_AGGR(name, head, pool, flags, aggr)		\
+	thm_head_init_aggr(&(head)->name##_head, (pool),		\
+	    name##_KEYOFFSET(), name##_KEYFLAGS() | (flags), (aggr))
+
+#define	THM_HEAD_INIT_DIGEST(name, head, pool, flags, digest)		\
+	thm_head_init_digest(&(head)->name##_head, (pool),		\
+	    name##_KEYOFFSET(), name##_KEYFLAGS() | (flags), (digest))
 
 #define	THM_HEAD_DESTROY(name, head)					\
 	thm_head_destroy(&(head)->name##_head)
@@ -207,13 +823,81 @@ name##_FIELD(struct type *elm)						\
 	((struct name##_BUCKET *)thm_prev((cursor)))
 
 #define	THM_FIND(name, head, key, cursor)				\
-	((struct name##_BUCKET *)thm_find(&(head)->name##_head, (key),	\
-	    (cursor)))
+	((struct name##_BUCKET *)name##_FIND((head), (key), (cursor)))
 
 #define	THM_NFIND(name, head, key, cursor)				\
 	((struct name##_BUCKET *)thm_nfind(&(head)->name##_head, (key),	\
 	    (cursor)))
 
+#define	THM_COUNT(name, head)						\
+	thm_count(&(head)->name##_head)
+
+#define	THM_RANK(name, head, key)					\
+	thm_rank(&(head)->name##_head, (key))
+
+#define	THM_SELECT(name, head, k, cursor)				\
+	((struct name##_BUCKET *)thm_select(&(head)->name##_head, (k),	\
+	    (cursor)))
+
+#define	THM_AGGREGATE(name, head, lo, hi)				\
+	thm_aggregate(&(head)->name##_head, (lo), (hi))
+
+#define	THM_AGGR_UPDATE(name, head, key)				\
+	thm_aggr_update(&(head)->name##_head, (key))
+
+#define	THM_DIGEST(name, head)						\
+	thm_digest(&(head)->name##_head)
+
+#define	THM_DIGEST_RANGE(name, head, lo, hi)				\
+	thm_digest_range(&(head)->name##_head, (lo), (hi))
+
+#define	THM_DIGEST_UPDATE(name, head, key)				\
+	thm_digest_update(&(head)->name##_head, (key))
+
+#define	THM_DIGEST_CMP(name, a, b, cb, arg)				\
+	thm_digest_cmp(&(a)->name##_head, &(b)->name##_head, (cb), (arg))
+
+#define	THM_DIFF(name, a, b, eq, cb, arg)				\
+	thm_diff(&(a)->name##_head, &(b)->name##_head, (eq), (cb), (arg))
+
+#define	THM_INTERSECT(name, a, b, cb, arg)				\
+	thm_intersect(&(a)->name##_head, &(b)->name##_head, (cb), (arg))
+
+#define	THM_UNION(name, a, b, cb, arg)					\
+	thm_union(&(a)->name##_head, &(b)->name##_head, (cb), (arg))
+
+#define	THM_DIFFERENCE(name, a, b, cb, arg)				\
+	thm_difference(&(a)->name##_head, &(b)->name##_head, (cb), (arg))
+
+#define	THM_SFIRST(name, head, scursor)					\
+	((struct name##_BUCKET *)thm_sfirst(&(head)->name##_head, (scursor)))
+
+#define	THM_SLAST(name, head, scursor)					\
+	((struct name##_BUCKET *)thm_slast(&(head)->name##_head, (scursor)))
+
+#define	THM_SNEXT(name, scursor)					\
+	((struct name##_BUCKET *)thm_next(&(scursor)->tsc_cursor))
+
+#define	THM_SPREV(name, scursor)					\
+	((struct name##_BUCKET *)thm_prev(&(scursor)->tsc_cursor))
+
+#define	THM_SFIND(name, head, key, len, scursor)			\
+	((struct name##_BUCKET *)thm_sfind(&(head)->name##_head, (key),	\
+	    (len), (scursor)))
+
+#define	THM_SNFIND(name, head, key, len, scursor)			\
+	((struct name##_BUCKET *)thm_snfind(&(head)->name##_head, (key), \
+	    (len), (scursor)))
+
+#define	THM_HFIND(name, head, key)					\
+	name##_HFIND((head), (key))
+
+#define	THM_HINSERT(name, head, elm, key)				\
+	name##_HINSERT((head), (elm), (key))
+
+#define	THM_HREMOVE(name, head, key)					\
+	name##_HREMOVE((head), (key))
+
 #define	THM_INSERT(name, head, entry)					\
 	((struct name##_BUCKET *)thm_insert(&(head)->name##_head,	\
 	    name##_FIELD((entry))))